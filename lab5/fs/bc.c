@@ -1,15 +1,414 @@
 
 #include "fs.h"
 
+// The cache holds at most bc_budget blocks; past that, each block read
+// in evicts one chosen by CLOCK.  The clock hand sweeps the DISKMAP
+// region in block order: a block whose PTE_A bit is set gets a second
+// chance (the bit is cleared by remapping the page, after writing the
+// block back if it is dirty), one whose bit is clear is written back
+// if dirty and unmapped.  Blocks mapped PTE_PIN, and blocks a client
+// also has mapped, are never evicted.  On a disk with a journal, dirty
+// blocks are not evicted either: only a commit (fs/journal.c) may
+// write them.  If everything is pinned, the cache goes over budget
+// rather than fail.
+#define BC_DEFBUDGET	2048
+#define BC_MINBUDGET	64
+
+static uint32_t bc_budget = BC_DEFBUDGET;
+static uint32_t bc_nresident;
+static uint32_t bc_hand;
+static struct Fscache bc_stat;
+
+static void bc_reserve(uint32_t n);
+
+// Number of blocks the cache can hold: the disk's, then the compressed
+// blocks numbered after them (see struct Zblock).
+static uint32_t
+bc_nblocks(void)
+{
+	return super->s_nblocks + super->s_nzblocks;
+}
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
 {
-	if (blockno == 0 || (super && blockno >= super->s_nblocks))
+	if (blockno == 0 || (super && blockno >= bc_nblocks()))
 		panic("bad block number %08x in diskaddr", blockno);
 	return (char*) (DISKMAP + blockno * BLKSIZE);
 }
 
+// Check if a virtual address is mapped.
+bool
+va_is_mapped(void *va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+// Check if a virtual address is dirty.
+bool
+va_is_dirty(void *va)
+{
+	return (uvpt[PGNUM(va)] & PTE_D) != 0;
+}
+
+// Flush the contents of the block containing VA out to disk if
+// necessary, then clear the PTE_D bit using sys_page_map.
+// If the block is not in the block cache or is not dirty, does
+// nothing.
+void
+flush_block(void *addr)
+{
+	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+
+	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
+		panic("flush_block of bad va %08x", addr);
+
+	bc_flush(blockno, 1);
+}
+
+// A write-back is done: clear the blocks' PTE_D bits.
+static void
+bc_flush_done(uint32_t blockno, uint32_t nblocks, int r)
+{
+	uint32_t i;
+	void *va;
+
+	if (r < 0)
+		panic("bc_flush: writing block %08x: %e", blockno, r);
+	for (i = 0; i < nblocks; i++) {
+		va = diskaddr(blockno + i);
+		if ((r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+			panic("bc_flush: sys_page_map: %e", r);
+	}
+	bc_stat.c_writebacks += nblocks;
+}
+
+// Queue a write-back of dirty block blockno, which clears its PTE_D bit
+// once done.  The caller must bio_drain.
+void
+bc_writeback(uint32_t blockno)
+{
+	bio_submit(blockno, 1, 1, bc_flush_done);
+}
+
+// Return the first dirty block in [blockno, end), or end if there is
+// none.
+uint32_t
+bc_next_dirty(uint32_t blockno, uint32_t end)
+{
+	void *va;
+
+	for (; blockno < end; blockno++) {
+		va = diskaddr(blockno);
+		if (!(uvpd[PDX(va)] & PTE_P))
+			blockno += NPTENTRIES - 1 - PTX(va);
+		else if (va_is_mapped(va) && va_is_dirty(va))
+			return blockno;
+	}
+	return end;
+}
+
+// Write back the dirty blocks in [blockno, blockno + nblocks), each run
+// of consecutive dirty blocks as one request, and clear their PTE_D
+// bits.
+void
+bc_flush(uint32_t blockno, uint32_t nblocks)
+{
+	uint32_t b, end, n;
+	void *va;
+
+	end = blockno + nblocks;
+	if (super && end > super->s_nblocks)
+		end = super->s_nblocks;
+	for (b = blockno; b < end; b += n) {
+		va = diskaddr(b);
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			n = NPTENTRIES - PTX(va);
+			continue;
+		}
+		for (n = 0; n < BIO_MAXRUN && b + n < end
+			     && va_is_mapped(diskaddr(b + n))
+			     && va_is_dirty(diskaddr(b + n)); n++)
+			/* do nothing */;
+		if (n == 0) {
+			n = 1;
+			continue;
+		}
+		bio_submit(b, n, 1, bc_flush_done);
+	}
+	bio_drain();
+}
+
+// Return the address of block blockno, which has just been allocated,
+// filled with zeros and dirty.  It is not read from disk first.
+void *
+bc_zero_block(uint32_t blockno)
+{
+	void *va = diskaddr(blockno);
+	int r;
+
+	if (!va_is_mapped(va)) {
+		bc_reserve(1);
+		if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("bc_zero_block: sys_page_alloc: %e", r);
+	}
+	// the page may be fresh, but the write is what marks it dirty
+	memset(va, 0, BLKSIZE);
+	journal_fresh(blockno);
+	return va;
+}
+
+// Forget the cached copy of the block at va, if any, without writing
+// it back: the block has been freed.  A client that still has the page
+// mapped keeps the old contents; the block's next user gets a new page.
+void
+bc_drop(void *va)
+{
+	int r;
+
+	if (!va_is_mapped(va))
+		return;
+	if ((r = sys_page_unmap(0, va)) < 0)
+		panic("bc_drop: sys_page_unmap: %e", r);
+	bc_nresident--;
+}
+
+// Keep the block containing va in the cache for good.
+void
+bc_pin(void *va)
+{
+	bool dirty;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	// fault it in if need be
+	*(volatile char *) va;
+	if (uvpt[PGNUM(va)] & PTE_PIN)
+		return;
+	dirty = va_is_dirty(va);
+	if ((r = sys_page_map(0, va, 0, va, (uvpt[PGNUM(va)] & PTE_SYSCALL) | PTE_PIN)) < 0)
+		panic("bc_pin: sys_page_map: %e", r);
+	// remapping clears PTE_D; a write sets it again
+	if (dirty)
+		*(volatile char *) va = *(volatile char *) va;
+}
+
+// Count a lookup of the block at va as a hit if it is cached.
+// (Misses are counted as the blocks are read in.)
+void
+bc_lookup(void *va)
+{
+	if (va_is_mapped(va))
+		bc_stat.c_hits++;
+}
+
+// Count n lookups of blocks known to be cached as hits.
+void
+bc_count_hits(uint32_t n)
+{
+	bc_stat.c_hits += n;
+}
+
+// An evicted block has been written back: drop it.
+static void
+bc_evict_done(uint32_t blockno, uint32_t nblocks, int r)
+{
+	if (r < 0)
+		panic("bc_evict: writing block %08x: %e", blockno, r);
+	if ((r = sys_page_unmap(0, diskaddr(blockno))) < 0)
+		panic("bc_evict: sys_page_unmap: %e", r);
+	bc_stat.c_writebacks++;
+}
+
+// Evict one block by CLOCK.  Returns 0 on success, -E_NO_MEM if every
+// cached block is pinned or shared with a client.  Dirty blocks are
+// queued for writing back, and are only unmapped once written: the
+// caller must bio_drain before it reuses the memory or touches them.
+static int
+bc_evict(void)
+{
+	uint32_t n, nblocks;
+	pte_t pte;
+	void *va;
+	int r;
+
+	if (!super)
+		return -E_NO_MEM;
+	nblocks = bc_nblocks();
+	// two sweeps: one may be needed to clear all the PTE_A bits
+	for (n = 0; n < 2 * nblocks; n++, bc_hand++) {
+		if (bc_hand < 2 || bc_hand >= nblocks)
+			bc_hand = 2;
+		va = diskaddr(bc_hand);
+		if (!(uvpd[PDX(va)] & PTE_P)) {
+			// skip the rest of an empty page table
+			n += NPTENTRIES - 1 - PTX(va);
+			bc_hand += NPTENTRIES - 1 - PTX(va);
+			continue;
+		}
+		pte = uvpt[PGNUM(va)];
+		if (!(pte & PTE_P) || (pte & PTE_PIN) || pageref(va) > 1)
+			continue;
+		// blocks being written back stay dirty until they are done
+		if ((pte & PTE_D) && (bio_pending(bc_hand) || super->s_njournal))
+			continue;
+		if (pte & PTE_A) {
+			if (pte & PTE_D)
+				bio_submit(bc_hand, 1, 1, bc_flush_done);
+			else if ((r = sys_page_map(0, va, 0, va, pte & PTE_SYSCALL)) < 0)
+				panic("bc_evict: sys_page_map: %e", r);
+			continue;
+		}
+		if (pte & PTE_D)
+			bio_submit(bc_hand, 1, 1, bc_evict_done);
+		else if ((r = sys_page_unmap(0, va)) < 0)
+			panic("bc_evict: sys_page_unmap: %e", r);
+		bc_nresident--;
+		bc_stat.c_evictions++;
+		bc_hand++;
+		return 0;
+	}
+	return -E_NO_MEM;
+}
+
+// Make room for n more blocks, evicting as needed, and count them in.
+static void
+bc_reserve(uint32_t n)
+{
+	// Don't drain unless there was something to evict: queued reads
+	// are better left to be merged.
+	if (bc_nresident + n > bc_budget) {
+		while (bc_nresident + n > bc_budget && bc_evict() == 0)
+			/* do nothing */;
+		bio_drain();
+	}
+	bc_nresident += n;
+}
+
+// Is the cache holding more blocks than its budget?
+bool
+bc_overbudget(void)
+{
+	return bc_nresident > bc_budget;
+}
+
+// Set the cache budget, if budget is not 0, and the write policy, if
+// writethrough is not -1, and store the statistics in *st.
+void
+bc_control(uint32_t budget, int writethrough, struct Fscache *st)
+{
+	if (budget) {
+		bc_budget = MAX(budget, BC_MINBUDGET);
+		while (bc_nresident > bc_budget && bc_evict() == 0)
+			/* do nothing */;
+		bio_drain();
+	}
+	if (writethrough != -1)
+		bc_writethrough = (writethrough != 0);
+	*st = bc_stat;
+	st->c_budget = bc_budget;
+	st->c_resident = bc_nresident;
+	st->c_writethrough = bc_writethrough;
+}
+
+static void
+bc_prefetch_done(uint32_t blockno, uint32_t nblocks, int r)
+{
+	if (r < 0)
+		panic("bc_prefetch: reading block %08x: %e", blockno, r);
+}
+
+// Compressed block blockno's entry in the block map, which is pinned.
+static struct Zblock *
+bc_zblock(uint32_t blockno)
+{
+	uint32_t i = blockno - super->s_nblocks;
+
+	return (struct Zblock *) diskaddr(super->s_zmap + i / NZBLOCK) + i % NZBLOCK;
+}
+
+// Number of disk blocks, from z->z_blockno, holding z's data.
+static uint32_t
+bc_zspan(struct Zblock *z)
+{
+	return (z->z_off + z->z_len - 1) / BLKSIZE + 1;
+}
+
+// Bring the blocks in [blockno, blockno + nblocks) into the cache ahead
+// of use.  Blocks already cached are skipped; each run of missing ones
+// is read as one request, into pages mapped ahead of time so no page
+// faults are taken for them.  For a run of compressed blocks, which
+// must belong to one file, it is the disk blocks holding their data
+// that are read: the blocks are decompressed as they are faulted in.
+// The reads are only queued: the caller must bio_drain before it
+// touches the blocks.
+void
+bc_prefetch(uint32_t blockno, uint32_t nblocks)
+{
+	struct Zblock *first, *last;
+	uint32_t b, end, i, n;
+	int r;
+
+	end = blockno + nblocks;
+	if (super && end > bc_nblocks())
+		end = bc_nblocks();
+	for (b = blockno; b < end; b += n) {
+		if (va_is_mapped(diskaddr(b))) {
+			n = 1;
+			continue;
+		}
+		for (n = 0; n < BIO_MAXRUN && b + n < end
+			     && !va_is_mapped(diskaddr(b + n)); n++)
+			/* do nothing */;
+		if (super && b >= super->s_nblocks) {
+			first = bc_zblock(b);
+			last = bc_zblock(b + n - 1);
+			bc_prefetch(first->z_blockno,
+				    last->z_blockno + bc_zspan(last) - first->z_blockno);
+			continue;
+		}
+		bc_reserve(n);
+		for (i = 0; i < n; i++)
+			if ((r = sys_page_alloc(0, diskaddr(b + i), PTE_P|PTE_U|PTE_W)) < 0)
+				panic("bc_prefetch: sys_page_alloc: %e", r);
+		bc_stat.c_prefetched += n;
+		bio_submit(b, n, 0, bc_prefetch_done);
+	}
+}
+
+// Fill the page at va with compressed block blockno: gather its data,
+// which may straddle two disk blocks, decompress it into a new page,
+// and leave the page read-only and clean, so it is never written back.
+static void
+bc_zfill(uint32_t blockno, void *va)
+{
+	static char zbuf[2 * BLKSIZE];
+	struct Zblock *z = bc_zblock(blockno);
+	int r;
+
+	if (va_is_mapped(va))
+		panic("bc_pgfault: write to compressed block %08x", blockno);
+	if (z->z_len > BLKSIZE || z->z_off >= BLKSIZE
+	    || z->z_blockno + bc_zspan(z) > super->s_nblocks)
+		panic("bc_pgfault: bad map entry for block %08x", blockno);
+	bc_prefetch(z->z_blockno, bc_zspan(z));
+	bio_drain();
+	memmove(zbuf, (char *) diskaddr(z->z_blockno) + z->z_off, z->z_len);
+
+	bc_reserve(1);
+	bc_stat.c_misses++;
+	bc_stat.c_zfills++;
+	if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("bc_pgfault: sys_page_alloc: %e", r);
+	if (z->z_len == BLKSIZE)
+		memmove(va, zbuf, BLKSIZE);
+	else if (lz4_decompress(zbuf, z->z_len, va, BLKSIZE) != BLKSIZE)
+		panic("bc_pgfault: compressed block %08x is corrupt", blockno);
+	if ((r = sys_page_map(0, va, 0, va, PTE_P|PTE_U)) < 0)
+		panic("bc_pgfault: sys_page_map: %e", r);
+}
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -23,10 +422,15 @@ bc_pgfault(struct UTrapframe *utf)
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
 		panic("page fault in FS: eip %08x, va %08x, err %04x",
 		      utf->utf_eip, addr, utf->utf_err);
+	bc_stat.c_faults++;
 
 	// Sanity check the block number.
-	if (super && blockno >= super->s_nblocks)
+	if (super && blockno >= bc_nblocks())
 		panic("reading non-existent block %08x\n", blockno);
+	if (super && blockno >= super->s_nblocks) {
+		bc_zfill(blockno, ROUNDDOWN(addr, PGSIZE));
+		return;
+	}
 
 	// Allocate a page in the disk map region, read the contents
 	// of the block from the disk into that page.
@@ -34,10 +438,12 @@ bc_pgfault(struct UTrapframe *utf)
 	//
 	// LAB 5: you code here:
 	addr = ROUNDDOWN(addr, PGSIZE);
+	bc_reserve(1);
+	bc_stat.c_misses++;
 	r = sys_page_alloc(0, addr, PTE_W | PTE_U | PTE_P);
 	if (r < 0) panic("can not alloc a page for bc_pgfault %e\n", r);
-	r = ide_read(blockno * BLKSECTS , addr , BLKSECTS);
-	if (r < 0) panic("bc_pgfault ide_read error %e\n", r);
+	r = bio_rw(blockno, 1, 0);
+	if (r < 0) panic("bc_pgfault bio_rw error %e\n", r);
 
 }
 
@@ -0,0 +1,284 @@
+// Block I/O requests between the block cache and the disk driver.
+//
+// Requests are queued in block order and not started until somebody
+// waits (bio_drain, bio_step, a synchronous bio_rw) or the request pool
+// runs out, so a batch submitted together reaches the disk as few, long
+// commands.  One command is in flight at a time.  The next is chosen by
+// a one-way elevator: the lowest queued block at or past where the last
+// command ended, wrapping around to the lowest.  A request that has
+// seen BIO_READPASS (reads) or BIO_WRITEPASS (writes) commands go ahead
+// of it goes next, oldest first, which bounds how long the elevator can
+// starve it.  The chosen request is merged with its queued neighbours
+// in the same direction whose blocks are contiguous with it, up to
+// BIO_MAXRUN blocks per command.
+//
+// Callers must not queue overlapping requests.
+
+#include "fs.h"
+
+#define BIO_NPOOL	64
+#define BIO_READPASS	16
+#define BIO_WRITEPASS	48
+
+enum {
+	BIO_FREE = 0,
+	BIO_QUEUED,
+	BIO_ACTIVE,
+	BIO_DONE,
+};
+
+struct Bio {
+	uint32_t bio_blockno;
+	uint32_t bio_nblocks;
+	bool bio_write;
+	bio_done_t bio_done;	// completion callback, or null
+	bool bio_sync;		// bio_rw waits for it and releases it
+	int bio_state;
+	int bio_error;
+	uint32_t bio_seq;	// submission order
+	uint32_t bio_passed;	// commands started ahead of it
+	struct Bio *bio_link;	// free list, or the next in a command
+};
+
+static struct Bio bio_pool[BIO_NPOOL];
+static struct Bio *bio_free;
+// Queued requests, sorted by block number, then submission order
+static struct Bio *bio_queue[BIO_NPOOL];
+static int bio_nqueued;
+// Requests of the command in flight
+static struct Bio *bio_active;
+static uint32_t bio_head;	// block after the last command's
+static uint32_t bio_seq;
+static struct Fscache bio_stat;
+
+static void bio_complete(int r);
+
+void
+bio_init(void)
+{
+	int i;
+
+	for (i = BIO_NPOOL - 1; i >= 0; i--) {
+		bio_pool[i].bio_link = bio_free;
+		bio_free = &bio_pool[i];
+	}
+}
+
+// Take a request from the pool, running the queue to free one if need
+// be.
+static struct Bio *
+bio_alloc(void)
+{
+	struct Bio *bio;
+
+	while (!bio_free) {
+		if (!bio_active && !bio_nqueued)
+			panic("bio_alloc: out of requests");
+		bio_step();
+	}
+	bio = bio_free;
+	bio_free = bio->bio_link;
+	return bio;
+}
+
+static void
+bio_release(struct Bio *bio)
+{
+	bio->bio_state = BIO_FREE;
+	bio->bio_link = bio_free;
+	bio_free = bio;
+}
+
+// Queue a request to read (write == 0) or write the nblocks blocks from
+// blockno between the disk and their block cache pages, which must be
+// mapped.  done, if not null, is called once the request is complete.
+static struct Bio *
+bio_queue_new(uint32_t blockno, uint32_t nblocks, bool write, bio_done_t done,
+	      bool sync)
+{
+	struct Bio *bio;
+	int i;
+
+	assert(nblocks > 0 && nblocks <= BIO_MAXRUN);
+	bio = bio_alloc();
+	bio->bio_blockno = blockno;
+	bio->bio_nblocks = nblocks;
+	bio->bio_write = write;
+	bio->bio_done = done;
+	bio->bio_sync = sync;
+	bio->bio_state = BIO_QUEUED;
+	bio->bio_error = 0;
+	bio->bio_seq = bio_seq++;
+	bio->bio_passed = 0;
+
+	for (i = bio_nqueued; i > 0 && bio_queue[i - 1]->bio_blockno > blockno; i--)
+		bio_queue[i] = bio_queue[i - 1];
+	bio_queue[i] = bio;
+	bio_nqueued++;
+	bio_stat.c_bios++;
+	return bio;
+}
+
+// Submit a request without waiting for it; see bio_queue_new.
+void
+bio_submit(uint32_t blockno, uint32_t nblocks, bool write, bio_done_t done)
+{
+	bio_queue_new(blockno, nblocks, write, done, 0);
+}
+
+// Pick the queued request to start next.
+static int
+bio_choose(void)
+{
+	int i, pick = -1;
+	struct Bio *bio;
+
+	for (i = 0; i < bio_nqueued; i++) {
+		bio = bio_queue[i];
+		if (bio->bio_passed < (bio->bio_write ? BIO_WRITEPASS : BIO_READPASS))
+			continue;
+		if (pick < 0 || bio->bio_seq < bio_queue[pick]->bio_seq)
+			pick = i;
+	}
+	if (pick >= 0) {
+		bio_stat.c_biodeadlines++;
+		return pick;
+	}
+	for (i = 0; i < bio_nqueued && bio_queue[i]->bio_blockno < bio_head; i++)
+		/* do nothing */;
+	return i < bio_nqueued ? i : 0;
+}
+
+// Can queued request b follow request a in one command?
+static bool
+bio_mergeable(struct Bio *a, struct Bio *b)
+{
+	return a->bio_write == b->bio_write
+		&& a->bio_blockno + a->bio_nblocks == b->bio_blockno;
+}
+
+// Start the next command, made of the chosen request and the queued
+// neighbours it merges with.
+static void
+bio_dispatch(void)
+{
+	int first, last, i, r;
+	uint32_t n;
+	struct Bio **tail;
+
+	assert(!bio_active && bio_nqueued > 0);
+	first = last = bio_choose();
+	n = bio_queue[first]->bio_nblocks;
+	while (first > 0 && bio_mergeable(bio_queue[first - 1], bio_queue[first])
+	       && n + bio_queue[first - 1]->bio_nblocks <= BIO_MAXRUN)
+		n += bio_queue[--first]->bio_nblocks;
+	while (last + 1 < bio_nqueued
+	       && bio_mergeable(bio_queue[last], bio_queue[last + 1])
+	       && n + bio_queue[last + 1]->bio_nblocks <= BIO_MAXRUN)
+		n += bio_queue[++last]->bio_nblocks;
+
+	tail = &bio_active;
+	for (i = first; i <= last; i++) {
+		bio_queue[i]->bio_state = BIO_ACTIVE;
+		*tail = bio_queue[i];
+		tail = &bio_queue[i]->bio_link;
+	}
+	*tail = NULL;
+	memmove(&bio_queue[first], &bio_queue[last + 1],
+		(bio_nqueued - last - 1) * sizeof(bio_queue[0]));
+	bio_nqueued -= last - first + 1;
+	for (i = 0; i < bio_nqueued; i++)
+		bio_queue[i]->bio_passed++;
+
+	bio_head = bio_active->bio_blockno + n;
+	bio_stat.c_biocmds++;
+	if (ramdisk)
+		r = ramdisk_rw(bio_active->bio_blockno, n, bio_active->bio_write);
+	else
+		r = ide_start(bio_active->bio_blockno * BLKSECTS,
+			      diskaddr(bio_active->bio_blockno), n * BLKSECTS,
+			      bio_active->bio_write);
+	if (r != 1)
+		bio_complete(r);
+}
+
+// The command in flight has finished with result r (0 or < 0): mark its
+// requests done and run their callbacks.  A request bio_rw waits for is
+// left for it to release.
+static void
+bio_complete(int r)
+{
+	struct Bio *bio, *next;
+
+	for (bio = bio_active, bio_active = NULL; bio; bio = next) {
+		next = bio->bio_link;
+		bio->bio_state = BIO_DONE;
+		bio->bio_error = r < 0 ? r : 0;
+		if (bio->bio_done)
+			bio->bio_done(bio->bio_blockno, bio->bio_nblocks, r);
+		if (!bio->bio_sync)
+			bio_release(bio);
+	}
+}
+
+// Make progress: finish the command in flight, if there is one, or
+// else start the next.
+void
+bio_step(void)
+{
+	if (bio_active)
+		bio_complete(ide_finish());
+	else if (bio_nqueued)
+		bio_dispatch();
+}
+
+// Run every queued request to completion.
+void
+bio_drain(void)
+{
+	while (bio_active || bio_nqueued)
+		bio_step();
+}
+
+// Read (write == 0) or write the nblocks blocks from blockno, waiting
+// for the transfer; requests queued before it may be started first if
+// the elevator prefers them.  Returns 0 on success, < 0 on error.
+int
+bio_rw(uint32_t blockno, uint32_t nblocks, bool write)
+{
+	struct Bio *bio;
+	int r;
+
+	bio = bio_queue_new(blockno, nblocks, write, NULL, 1);
+	while (bio->bio_state != BIO_DONE)
+		bio_step();
+	r = bio->bio_error;
+	bio_release(bio);
+	return r;
+}
+
+// Is block blockno part of a request not yet complete?
+bool
+bio_pending(uint32_t blockno)
+{
+	struct Bio *bio;
+	int i;
+
+	for (bio = bio_active; bio; bio = bio->bio_link)
+		if (blockno - bio->bio_blockno < bio->bio_nblocks)
+			return 1;
+	for (i = 0; i < bio_nqueued; i++)
+		if (blockno - bio_queue[i]->bio_blockno < bio_queue[i]->bio_nblocks)
+			return 1;
+	return 0;
+}
+
+// Store the request statistics in *st.
+void
+bio_control(struct Fscache *st)
+{
+	st->c_ramdisk = ramdisk;
+	st->c_bios = bio_stat.c_bios;
+	st->c_biocmds = bio_stat.c_biocmds;
+	st->c_biodeadlines = bio_stat.c_biodeadlines;
+}
@@ -1,4 +1,5 @@
 #include <inc/string.h>
+#include <inc/x86.h>
 
 #include "fs.h"
 
@@ -13,13 +14,148 @@ check_super(void)
 	if (super->s_magic != FS_MAGIC)
 		panic("bad file system magic number");
 
-	if (super->s_nblocks > DISKSIZE/BLKSIZE)
+	if (super->s_nblocks > DISKSIZE/BLKSIZE
+	    || super->s_nzblocks > DISKSIZE/BLKSIZE - super->s_nblocks)
 		panic("file system is too large");
 
+	if (super->s_nzblocks && (super->s_zmap < 2 || super->s_zmap
+				  + ROUNDUP(super->s_nzblocks, NZBLOCK) / NZBLOCK > super->s_nblocks))
+		panic("bad compressed block map");
+
 	cprintf("superblock is good\n");
 }
 
 
+// --------------------------------------------------------------
+// Free block bitmap
+// --------------------------------------------------------------
+
+// A set bit in the bitmap means the block is free.  On top of it the
+// server keeps, in memory, the number of free blocks under each bitmap
+// word and under each bitmap block, so that the allocator can step
+// over full stretches of the disk, 32 or BLKBITSIZE blocks at a time,
+// and find a free bit in a word with bsf.
+static uint8_t bm_wordfree[DISKSIZE / BLKSIZE / 32];
+static uint16_t bm_blockfree[DISKSIZE / BLKSIZE / BLKBITSIZE];
+
+// Number of set bits in w.
+static uint32_t
+nbits(uint32_t w)
+{
+	uint32_t n;
+
+	for (n = 0; w; n++)
+		w &= w - 1;
+	return n;
+}
+
+// Build the free-count summaries from the bitmap.
+static void
+bitmap_init(void)
+{
+	uint32_t i, nwords;
+
+	// fsformat leaves the bits past the last block set; clear them
+	// so that they are never handed out.
+	nwords = (super->s_nblocks + 31) / 32;
+	if (super->s_nblocks % 32)
+		bitmap[nwords - 1] &= (1 << (super->s_nblocks % 32)) - 1;
+	for (i = 0; i < nwords; i++) {
+		bm_wordfree[i] = nbits(bitmap[i]);
+		bm_blockfree[i / (BLKBITSIZE / 32)] += bm_wordfree[i];
+	}
+}
+
+// Check to see if the block bitmap indicates that block 'blockno' is free.
+// Return 1 if the block is free, 0 if not.
+bool
+block_is_free(uint32_t blockno)
+{
+	if (super == 0 || blockno >= super->s_nblocks)
+		return 0;
+	if (bitmap[blockno / 32] & (1 << (blockno % 32)))
+		return 1;
+	return 0;
+}
+
+// Mark a block free in the bitmap, and drop it from the cache
+// unwritten.
+void
+free_block(uint32_t blockno)
+{
+	// Blockno zero is the null pointer of block numbers.
+	if (blockno == 0)
+		panic("attempt to free zero block");
+	if (block_is_free(blockno))
+		panic("free_block: block %08x is already free", blockno);
+	bitmap[blockno/32] |= 1<<(blockno%32);
+	journal_freed(blockno);
+	bm_wordfree[blockno/32]++;
+	bm_blockfree[blockno/BLKBITSIZE]++;
+	bc_drop(diskaddr(blockno));
+}
+
+// Find the first free block at or after 'goal' and before 'end'.
+// Returns the block number, or -E_NO_DISK if there is none.
+static int
+bitmap_scan(uint32_t goal, uint32_t end)
+{
+	uint32_t w, word;
+
+	w = goal / 32;
+	// the part of the goal's word at or after the goal
+	if (goal < end && (word = bitmap[w] & ~((1 << (goal % 32)) - 1)))
+		goto found;
+	for (w++; w * 32 < end; w++) {
+		if (w % (BLKBITSIZE / 32) == 0 && bm_blockfree[w / (BLKBITSIZE / 32)] == 0) {
+			// skip a whole bitmap block's worth of full words
+			w += BLKBITSIZE / 32 - 1;
+			continue;
+		}
+		if (bm_wordfree[w] && (word = bitmap[w]))
+			goto found;
+	}
+	return -E_NO_DISK;
+
+found:
+	if (w * 32 + bsf(word) >= end)
+		return -E_NO_DISK;
+	return w * 32 + bsf(word);
+}
+
+// Allocate a free block, as close after 'goal' as possible so that a
+// file's blocks come out contiguous, wrapping around to the start of
+// the disk if need be.  The bitmap block is left dirty, to be written
+// back with the rest.
+//
+// Return block number allocated on success,
+// -E_NO_DISK if we are out of blocks, or if the journal transaction
+// could not hold another (see journal_room).
+int
+alloc_block_near(uint32_t goal)
+{
+	int r;
+
+	if (!journal_room())
+		return -E_NO_DISK;
+	if (goal >= super->s_nblocks)
+		goal = 0;
+	if ((r = bitmap_scan(goal, super->s_nblocks)) < 0
+	    && (r = bitmap_scan(0, goal)) < 0)
+		return r;
+	bitmap[r/32] &= ~(1<<(r%32));
+	bm_wordfree[r/32]--;
+	bm_blockfree[r/BLKBITSIZE]--;
+	return r;
+}
+
+// Allocate a free block anywhere; see alloc_block_near.
+int
+alloc_block(void)
+{
+	return alloc_block_near(0);
+}
+
 // --------------------------------------------------------------
 // File system structures
 // --------------------------------------------------------------
@@ -28,19 +164,40 @@ check_super(void)
 void
 fs_init(void)
 {
+	uint32_t i;
+
 	static_assert(sizeof(struct File) == 256);
 
-	// Find a JOS disk.  Use the second IDE disk (number 1) if available.
+	// Find a JOS disk.  Use the second IDE disk (number 1) if available,
+	// and a RAM disk copy of it if the server was built with one.
 	if (ide_probe_disk1())
 		ide_set_disk(1);
 	else
 		ide_set_disk(0);
+	ide_dma_init();
+#ifdef FS_RAMDISK
+	ramdisk_load();
+#endif
+	bio_init();
 
 	bc_init();
 
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
+	journal_init();
+
+	// Set "bitmap" to the beginning of the first bitmap block.
+	bitmap = diskaddr(2);
+	bitmap_init();
+
+	// The super block, bitmap and compressed block map stay in the
+	// cache.
+	bc_pin(super);
+	for (i = 0; i * BLKBITSIZE < super->s_nblocks; i++)
+		bc_pin(diskaddr(2 + i));
+	for (i = 0; i * NZBLOCK < super->s_nzblocks; i++)
+		bc_pin(diskaddr(super->s_zmap + i));
 }
 
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
@@ -59,18 +216,24 @@ fs_init(void)
 //
 // Analogy: This is like pgdir_walk for files.
 // Hint: Don't forget to clear any block you allocate.
+static uint32_t file_block_goal(struct File *f, uint32_t filebno);
+
 static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
 	int r;
 	uint32_t *ptr;
-	char *blk;
 
 	if (filebno < NDIRECT)
 		ptr = &f->f_direct[filebno];
 	else if (filebno < NDIRECT + NINDIRECT) {
 		if (f->f_indirect == 0) {
-			return -E_NOT_FOUND;
+			if (!alloc)
+				return -E_NOT_FOUND;
+			if ((r = alloc_block_near(file_block_goal(f, NDIRECT))) < 0)
+				return r;
+			f->f_indirect = r;
+			bc_zero_block(r);
 		}
 		ptr = (uint32_t*)diskaddr(f->f_indirect) + filebno - NDIRECT;
 	} else
@@ -80,8 +243,266 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 	return 0;
 }
 
+// Where a new block for the filebno'th block of file 'f' should go:
+// right after the file's previous block, or for its first block, after
+// the directory block holding f.
+static uint32_t
+file_block_goal(struct File *f, uint32_t filebno)
+{
+	uint32_t diskbno;
+
+	if (filebno > 0 && file_map_run(f, filebno - 1, 1, &diskbno) > 0)
+		return diskbno + 1;
+	return ((uintptr_t) f - DISKMAP) / BLKSIZE + 1;
+}
+
+// --------------------------------------------------------------
+// Extents
+// --------------------------------------------------------------
+
+// Return the index of the last of the n extents at ext that starts at
+// or before filebno, or -1 if there is none.
+static int
+extent_find(struct Extent *ext, uint32_t n, uint32_t filebno)
+{
+	uint32_t lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ext[mid].e_fileblk <= filebno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (int) lo - 1;
+}
+
+// One level of the walk down f's extent tree to a file block: a list
+// of entries, and the one followed or found.
+struct Extpath {
+	struct Extent *p_ext;
+	uint32_t *p_n;		// entries in the list
+	uint32_t p_max;		// room in the list
+	int p_i;		// entry for the block, -1 if none
+};
+
+// Walk down f's extent tree towards filebno, filling in path[0] (the
+// File) to path[f->f_extdepth] (the extents that filebno belongs in).
+static void
+file_extent_path(struct File *f, uint32_t filebno, struct Extpath *path)
+{
+	struct Extpath *p = path;
+	uint32_t d;
+
+	p->p_ext = f->f_extent;
+	p->p_n = &f->f_nextent;
+	p->p_max = NFEXTENT;
+	for (d = 0; d < f->f_extdepth; d++, p++) {
+		// the first entry covers everything before the second
+		if ((p->p_i = extent_find(p->p_ext, *p->p_n, filebno)) < 0)
+			p->p_i = 0;
+		p[1].p_ext = diskaddr(p->p_ext[p->p_i].e_diskblk);
+		// extent blocks stay in the cache
+		bc_pin(p[1].p_ext);
+		p[1].p_n = &p->p_ext[p->p_i].e_len;
+		p[1].p_max = NEXTBLK;
+	}
+	p->p_i = extent_find(p->p_ext, *p->p_n, filebno);
+}
+
+// file_map_run for an extent-mapped file: the extent that holds filebno
+// gives the whole run.
+static int
+file_extent_map(struct File *f, uint32_t filebno, uint32_t max, uint32_t *pdiskbno)
+{
+	struct Extpath path[EXT_MAXDEPTH + 1];
+	struct Extent *e;
+
+	file_extent_path(f, filebno, path);
+	if (path[f->f_extdepth].p_i < 0)
+		return 0;
+	e = &path[f->f_extdepth].p_ext[path[f->f_extdepth].p_i];
+	if (filebno - e->e_fileblk >= e->e_len)
+		return 0;
+	*pdiskbno = e->e_diskblk + (filebno - e->e_fileblk);
+	return MIN(max, e->e_len - (filebno - e->e_fileblk));
+}
+
+// Make room in the full list at level d of path, on the way to
+// filebno.  The File's own list moves down into a new block, making the
+// tree a level deeper; any other list is split in two, which may first
+// need room in its parent.  A file that grows at the end gets a new,
+// empty last block of extents rather than a split one, so that its
+// blocks end up full.
+// Returns 0 on success, < 0 on error; either way the path is stale.
+static int
+file_extent_split(struct File *f, struct Extpath *path, uint32_t d,
+		  uint32_t filebno)
+{
+	struct Extpath *p = &path[d], *parent = &path[d - 1];
+	struct Extent *new;
+	uint32_t half;
+	int i, r;
+
+	if (d > 0 && *parent->p_n == parent->p_max)
+		return file_extent_split(f, path, d - 1, filebno);
+	if (d == 0 && f->f_extdepth == EXT_MAXDEPTH)
+		return -E_NO_DISK;
+	if ((r = alloc_block()) < 0)
+		return r;
+	new = bc_zero_block(r);
+
+	if (d == 0) {
+		memmove(new, f->f_extent, f->f_nextent * sizeof(*new));
+		memset(f->f_extent, 0, sizeof(f->f_extent));
+		f->f_extent[0].e_diskblk = r;
+		f->f_extent[0].e_len = f->f_nextent;
+		f->f_nextent = 1;
+		f->f_extdepth++;
+		return 0;
+	}
+
+	if (d == f->f_extdepth && filebno > p->p_ext[*p->p_n - 1].e_fileblk)
+		half = *p->p_n;
+	else
+		half = *p->p_n / 2;
+	memmove(new, &p->p_ext[half], (*p->p_n - half) * sizeof(*new));
+	memset(&p->p_ext[half], 0, (*p->p_n - half) * sizeof(*new));
+	i = parent->p_i;
+	memmove(&parent->p_ext[i + 2], &parent->p_ext[i + 1],
+		(*parent->p_n - i - 1) * sizeof(*new));
+	parent->p_ext[i + 1].e_fileblk = half < *p->p_n ? new[0].e_fileblk : filebno;
+	parent->p_ext[i + 1].e_diskblk = r;
+	parent->p_ext[i + 1].e_len = *p->p_n - half;
+	*p->p_n = half;
+	(*parent->p_n)++;
+	return 0;
+}
+
+// Record that the filebno'th block of f, which had none, is in disk
+// block diskbno, growing the neighbouring extent if it can.
+// Returns 0 on success, < 0 on error.
+static int
+file_extent_add(struct File *f, uint32_t filebno, uint32_t diskbno)
+{
+	struct Extpath path[EXT_MAXDEPTH + 1], *p;
+	struct Extent *ext;
+	uint32_t *n;
+	int i, r;
+
+	while (1) {
+		file_extent_path(f, filebno, path);
+		p = &path[f->f_extdepth];
+		ext = p->p_ext;
+		n = p->p_n;
+		i = p->p_i;
+		if (i >= 0 && ext[i].e_fileblk + ext[i].e_len == filebno
+		    && ext[i].e_diskblk + ext[i].e_len == diskbno) {
+			ext[i].e_len++;
+			// the block may close the gap to the next extent
+			if (i + 1 < *n && ext[i + 1].e_fileblk == filebno + 1
+			    && ext[i + 1].e_diskblk == diskbno + 1) {
+				ext[i].e_len += ext[i + 1].e_len;
+				memmove(&ext[i + 1], &ext[i + 2],
+					(*n - i - 2) * sizeof(*ext));
+				memset(&ext[--(*n)], 0, sizeof(*ext));
+			}
+			return 0;
+		}
+		if (i + 1 < *n && ext[i + 1].e_fileblk == filebno + 1
+		    && ext[i + 1].e_diskblk == diskbno + 1) {
+			ext[i + 1].e_fileblk--;
+			ext[i + 1].e_diskblk--;
+			ext[i + 1].e_len++;
+			return 0;
+		}
+		if (*n < p->p_max) {
+			memmove(&ext[i + 2], &ext[i + 1], (*n - i - 1) * sizeof(*ext));
+			ext[i + 1].e_fileblk = filebno;
+			ext[i + 1].e_diskblk = diskbno;
+			ext[i + 1].e_len = 1;
+			(*n)++;
+			return 0;
+		}
+		if ((r = file_extent_split(f, path, f->f_extdepth, filebno)) < 0)
+			return r;
+	}
+}
+
+// Free what the *n entries at ext, depth levels above the extents, map
+// from file block nblocks on, and the extent blocks left empty.
+static void
+extent_truncate(struct Extent *ext, uint32_t *n, uint32_t depth,
+		uint32_t nblocks)
+{
+	struct Extent *e;
+	uint32_t b, keep;
+
+	while (*n > 0) {
+		e = &ext[*n - 1];
+		if (depth > 0) {
+			bc_pin(diskaddr(e->e_diskblk));
+			extent_truncate(diskaddr(e->e_diskblk), &e->e_len,
+					depth - 1, nblocks);
+			if (e->e_len > 0)
+				break;
+			free_block(e->e_diskblk);
+		} else {
+			if (e->e_fileblk + e->e_len <= nblocks)
+				break;
+			keep = nblocks > e->e_fileblk ? nblocks - e->e_fileblk : 0;
+			for (b = keep; b < e->e_len; b++)
+				free_block(e->e_diskblk + b);
+			if (keep) {
+				e->e_len = keep;
+				break;
+			}
+		}
+		memset(e, 0, sizeof(*e));
+		(*n)--;
+	}
+}
+
+// Free the blocks of extent-mapped f from file block nblocks on.  The
+// tree gets shallower again while the File has room for what the one
+// block below it holds.
+static void
+file_extent_truncate(struct File *f, uint32_t nblocks)
+{
+	uint32_t b;
+
+	extent_truncate(f->f_extent, &f->f_nextent, f->f_extdepth, nblocks);
+	if (f->f_nextent == 0)
+		f->f_extdepth = 0;
+	while (f->f_extdepth > 0 && f->f_nextent == 1
+	       && f->f_extent[0].e_len <= NFEXTENT) {
+		b = f->f_extent[0].e_diskblk;
+		f->f_nextent = f->f_extent[0].e_len;
+		memset(f->f_extent, 0, sizeof(f->f_extent));
+		memmove(f->f_extent, diskaddr(b), f->f_nextent * sizeof(struct Extent));
+		f->f_extdepth--;
+		free_block(b);
+	}
+}
+
+// Flush the extent blocks under the n entries at ext, depth levels
+// above the extents.
+static void
+extent_flush(struct Extent *ext, uint32_t n, uint32_t depth)
+{
+	uint32_t i;
+
+	if (depth == 0)
+		return;
+	for (i = 0; i < n; i++) {
+		extent_flush(diskaddr(ext[i].e_diskblk), ext[i].e_len, depth - 1);
+		flush_block(diskaddr(ext[i].e_diskblk));
+	}
+}
+
 // Set *blk to the address in memory where the filebno'th
-// block of file 'f' would be mapped.
+// block of file 'f' would be mapped, allocating the block if
+// the file has none there yet.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
@@ -91,15 +512,435 @@ int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
 	int r;
-	uint32_t *ptr;
+	uint32_t *ptr, diskbno;
+
+	if (f->f_flags & FILE_EXTENTS) {
+		if (filebno >= MAXEXTFILESIZE / BLKSIZE)
+			return -E_INVAL;
+		if (file_extent_map(f, filebno, 1, &diskbno) == 0) {
+			if ((r = alloc_block_near(file_block_goal(f, filebno))) < 0)
+				return r;
+			if ((diskbno = r, r = file_extent_add(f, filebno, diskbno)) < 0) {
+				free_block(diskbno);
+				return r;
+			}
+			goto fresh;
+		}
+	} else {
+		if ((r = file_block_walk(f, filebno, &ptr, 1)) < 0)
+			return r;
+		if (*ptr == 0) {
+			if ((r = alloc_block_near(file_block_goal(f, filebno))) < 0)
+				return r;
+			diskbno = *ptr = r;
+			goto fresh;
+		}
+		diskbno = *ptr;
+	}
+	// the journal writes regular files' blocks as data, not metadata
+	if (f->f_type == FTYPE_REG)
+		journal_data(diskbno);
+	bc_lookup(diskaddr(diskbno));
+	file_readahead(f, filebno, 1);
+	*blk = diskaddr(diskbno);
+	return 0;
+
+fresh:
+	if (f->f_type == FTYPE_REG)
+		journal_data(diskbno);
+	*blk = bc_zero_block(diskbno);
+	return 0;
+}
+
+// Find the run of at most 'max' file blocks starting at filebno whose
+// disk blocks are consecutive.  Stores the first disk block number in
+// *pdiskbno.  Never allocates.
+//
+// Returns the length of the run, 0 if filebno has no block, < 0 on error.
+int
+file_map_run(struct File *f, uint32_t filebno, uint32_t max, uint32_t *pdiskbno)
+{
+	int r;
+	uint32_t n, *ptr;
+
+	if (f->f_flags & FILE_EXTENTS)
+		return file_extent_map(f, filebno, max, pdiskbno);
+
+	for (n = 0; n < max; n++) {
+		if ((r = file_block_walk(f, filebno + n, &ptr, 0)) < 0) {
+			if (r == -E_NOT_FOUND || r == -E_INVAL)
+				break;
+			return r;
+		}
+		if (*ptr == 0 || (n > 0 && *ptr != *pdiskbno + n))
+			break;
+		if (n == 0)
+			*pdiskbno = *ptr;
+	}
+	return n;
+}
+
+// Find the cache page of the filebno'th block of f, for file_read_cached:
+// like file_get_block, but touching nothing that is not cached and
+// changing nothing.  Returns -E_AGAIN if the block, or any block on the
+// way to it, is not cached (or the file has no block there).
+static int
+file_cached_block(struct File *f, uint32_t filebno, char **blk)
+{
+	struct Extent *ext;
+	uint32_t n, d, diskbno;
+	int i;
+
+	if (f->f_flags & FILE_EXTENTS) {
+		ext = f->f_extent;
+		n = f->f_nextent;
+		for (d = 0; d < f->f_extdepth; d++) {
+			if (n == 0)
+				return -E_AGAIN;
+			if ((i = extent_find(ext, n, filebno)) < 0)
+				i = 0;
+			n = ext[i].e_len;
+			ext = diskaddr(ext[i].e_diskblk);
+			if (!va_is_mapped(ext))
+				return -E_AGAIN;
+		}
+		i = extent_find(ext, n, filebno);
+		if (i < 0 || filebno - ext[i].e_fileblk >= ext[i].e_len)
+			return -E_AGAIN;
+		diskbno = ext[i].e_diskblk + (filebno - ext[i].e_fileblk);
+	} else if (filebno < NDIRECT)
+		diskbno = f->f_direct[filebno];
+	else if (filebno < NDIRECT + NINDIRECT && f->f_indirect
+		 && va_is_mapped(diskaddr(f->f_indirect)))
+		diskbno = ((uint32_t *) diskaddr(f->f_indirect))[filebno - NDIRECT];
+	else
+		return -E_AGAIN;
+	if (diskbno == 0 || !va_is_mapped(diskaddr(diskbno)))
+		return -E_AGAIN;
+	*blk = diskaddr(diskbno);
+	return 0;
+}
+
+// --------------------------------------------------------------
+// Read-ahead
+// --------------------------------------------------------------
+
+// Each file being read gets an adaptive read-ahead window.  An access
+// that carries on where the last one on that file stopped doubles the
+// window, up to RA_MAXWIN blocks; any other access (bar re-reading the
+// last block) closes it.  Whenever an access comes within half a
+// window of the end of what was read ahead, the blocks up to a window
+// past it are prefetched, as runs of disk-contiguous blocks.
+#define RA_MINWIN	4
+#define RA_MAXWIN	64
+#define NRA		16	// files tracked at once
+
+struct Readahead {
+	struct File *ra_file;
+	uint32_t ra_next;	// block a sequential reader wants next
+	uint32_t ra_win;	// window in blocks, 0 when not sequential
+	uint32_t ra_end;	// blocks below this have been read ahead
+};
+
+static struct Readahead ratab[NRA];
+static uint32_t ra_recycle;
+
+// Note an access to blocks [filebno, filebno + nblocks) of f, and read
+// ahead if it looks sequential.
+void
+file_readahead(struct File *f, uint32_t filebno, uint32_t nblocks)
+{
+	struct Readahead *ra;
+	uint32_t b, end, diskbno;
+	int i, n;
+
+	for (i = 0; i < NRA && ratab[i].ra_file != f; i++)
+		/* do nothing */;
+	if (i < NRA)
+		ra = &ratab[i];
+	else {
+		// reads from the start of a file are taken as sequential
+		ra = &ratab[ra_recycle++ % NRA];
+		memset(ra, 0, sizeof(*ra));
+		ra->ra_file = f;
+	}
+
+	if (filebno == ra->ra_next)
+		ra->ra_win = ra->ra_win ? MIN(2 * ra->ra_win, RA_MAXWIN) : RA_MINWIN;
+	else if (filebno + 1 != ra->ra_next)
+		ra->ra_win = ra->ra_end = 0;
+	ra->ra_next = filebno + nblocks;
+
+	if (ra->ra_win == 0 || ra->ra_next + ra->ra_win / 2 <= ra->ra_end)
+		return;
+	b = MAX(filebno, ra->ra_end);
+	end = MIN(ra->ra_next + ra->ra_win, ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE);
+	while (b < end) {
+		if ((n = file_map_run(f, b, end - b, &diskbno)) <= 0)
+			break;
+		bc_prefetch(diskbno, n);
+		b += n;
+	}
+	bio_drain();
+	ra->ra_end = end;
+}
 
-	if ((r = file_block_walk(f, filebno, &ptr, 1)) < 0)
+// Serializes file_read_cached's updates of the read-ahead state, the
+// one thing it changes; everything else that does holds the file
+// system exclusively.
+static struct Mutex ra_lock;
+
+// For file_read_cached: note an access to the cached blocks [filebno,
+// filebno + nblocks) of f as file_readahead would, unless it would read
+// ahead, in which case leave the state alone and return false.
+static bool
+file_readahead_cached(struct File *f, uint32_t filebno, uint32_t nblocks)
+{
+	struct Readahead *ra;
+	uint32_t win, end;
+	int i;
+
+	for (i = 0; i < NRA && ratab[i].ra_file != f; i++)
+		/* do nothing */;
+	if (i == NRA)
+		return 0;
+	ra = &ratab[i];
+
+	win = ra->ra_win;
+	end = ra->ra_end;
+	if (filebno == ra->ra_next)
+		win = win ? MIN(2 * win, RA_MAXWIN) : RA_MINWIN;
+	else if (filebno + 1 != ra->ra_next)
+		win = end = 0;
+	if (win != 0 && filebno + nblocks + win / 2 > end)
+		return 0;
+	ra->ra_win = win;
+	ra->ra_end = end;
+	ra->ra_next = filebno + nblocks;
+	return 1;
+}
+
+// Queue reads of the blocks of f holding [offset, offset + count) that
+// are not cached, without waiting for them (see bc_prefetch).
+void
+file_prefetch(struct File *f, off_t offset, size_t count)
+{
+	uint32_t b, end, diskbno;
+	int n;
+
+	if (offset < 0 || offset >= f->f_size)
+		return;
+	b = offset / BLKSIZE;
+	end = ROUNDUP(MIN((off_t) (offset + count), f->f_size), BLKSIZE) / BLKSIZE;
+	while (b < end) {
+		if ((n = file_map_run(f, b, end - b, &diskbno)) <= 0)
+			break;
+		bc_prefetch(diskbno, n);
+		b += n;
+	}
+}
+
+// --------------------------------------------------------------
+// Directory index
+// --------------------------------------------------------------
+
+// Directories of DI_MINBLOCKS blocks or more get a hashed name index
+// (see struct Dirindex), rebuilt at twice the size whenever it gets
+// over half full.  Anything that goes wrong with an index just drops
+// it: lookups then fall back to scanning the directory.
+
+// Set *pf to entry n of dir.
+static int
+dir_entry(struct File *dir, uint32_t n, struct File **pf)
+{
+	char *blk;
+	int r;
+
+	if (n >= dir->f_size / sizeof(struct File))
+		return -E_INVAL;
+	if ((r = file_get_block(dir, n / BLKFILES, &blk)) < 0)
 		return r;
-	if (*ptr == 0) {
-		return -E_NOT_FOUND;
+	// directories stay in the cache
+	bc_pin(blk);
+	*pf = (struct File*) blk + n % BLKFILES;
+	return 0;
+}
+
+// Return dir's index, or NULL if it has none.
+static struct Dirindex *
+dir_index(struct File *dir)
+{
+	struct Dirindex *di;
+
+	if (dir->f_type != FTYPE_DIR || dir->f_dirindex == 0
+	    || dir->f_dirindex >= super->s_nblocks)
+		return NULL;
+	di = diskaddr(dir->f_dirindex);
+	bc_pin(di);
+	if (di->di_magic != DI_MAGIC)
+		return NULL;
+	return di;
+}
+
+// Return a pointer to slot i of the table of di.
+static uint32_t *
+dir_index_slot(struct Dirindex *di, uint32_t i)
+{
+	uint32_t *blk = diskaddr(di->di_blocks[i / DI_SLOTSPERBLK]);
+
+	bc_pin(blk);
+	return &blk[i % DI_SLOTSPERBLK];
+}
+
+// Free dir's index, if it has one.
+static void
+dir_index_drop(struct File *dir)
+{
+	struct Dirindex *di;
+	uint32_t i;
+
+	if (dir->f_type != FTYPE_DIR)
+		return;
+	if ((di = dir_index(dir)) != NULL)
+		for (i = 0; i < di->di_nslots / DI_SLOTSPERBLK; i++)
+			free_block(di->di_blocks[i]);
+	if (dir->f_dirindex && dir->f_dirindex < super->s_nblocks)
+		free_block(dir->f_dirindex);
+	dir->f_dirindex = 0;
+}
+
+// Record in di that entry n is named name.
+static void
+dir_index_insert(struct Dirindex *di, const char *name, uint32_t n)
+{
+	uint32_t i, *slot;
+
+	for (i = dirhash(name); ; i++) {
+		slot = dir_index_slot(di, i & (di->di_nslots - 1));
+		if (*slot == DI_EMPTY || *slot == DI_DELETED)
+			break;
+	}
+	if (*slot == DI_EMPTY)
+		di->di_nused++;
+	*slot = n + 1;
+}
+
+// Build a new index for dir, with room for at least nentries names at
+// no more than half full, replacing any index dir had.
+// Returns 0 on success, < 0 on error.
+static int
+dir_index_build(struct File *dir, uint32_t nentries)
+{
+	struct Dirindex *di;
+	struct File *f;
+	uint32_t nslots, i, n;
+	int r;
+
+	for (nslots = DI_SLOTSPERBLK; nslots < 2 * nentries; nslots *= 2)
+		/* do nothing */;
+	if (nslots / DI_SLOTSPERBLK > DI_NBLOCKS)
+		return -E_NO_DISK;
+
+	dir_index_drop(dir);
+	if ((r = alloc_block_near(file_block_goal(dir, dir->f_size / BLKSIZE))) < 0)
+		return r;
+	dir->f_dirindex = r;
+	di = bc_zero_block(r);
+	for (i = 0; i < nslots / DI_SLOTSPERBLK; i++) {
+		if ((r = alloc_block_near(dir->f_dirindex + 1 + i)) < 0) {
+			while (i-- > 0)
+				free_block(di->di_blocks[i]);
+			free_block(dir->f_dirindex);
+			dir->f_dirindex = 0;
+			return r;
+		}
+		di->di_blocks[i] = r;
+		bc_zero_block(r);
+	}
+	di->di_nslots = nslots;
+	di->di_magic = DI_MAGIC;
+
+	for (n = 0; n < dir->f_size / sizeof(struct File); n++) {
+		if ((r = dir_entry(dir, n, &f)) < 0)
+			goto fail;
+		if (f->f_name[0] != '\0')
+			dir_index_insert(di, f->f_name, n);
 	}
-	*blk = diskaddr(*ptr);
 	return 0;
+
+fail:
+	dir_index_drop(dir);
+	return r;
+}
+
+// Look name up in dir's index, di.  Returns as dir_lookup does.
+static int
+dir_index_lookup(struct File *dir, struct Dirindex *di, const char *name,
+		 struct File **file)
+{
+	uint32_t i, slot;
+	struct File *f;
+	int r;
+
+	for (i = dirhash(name); ; i++) {
+		slot = *dir_index_slot(di, i & (di->di_nslots - 1));
+		if (slot == DI_EMPTY)
+			return -E_NOT_FOUND;
+		if (slot == DI_DELETED)
+			continue;
+		if ((r = dir_entry(dir, slot - 1, &f)) < 0)
+			return r;
+		if (strcmp(f->f_name, name) == 0) {
+			*file = f;
+			return 0;
+		}
+	}
+}
+
+// Note that entry n of dir, f, has just been named, building or
+// growing dir's index as needed.
+static void
+dir_index_add(struct File *dir, uint32_t n, struct File *f)
+{
+	struct Dirindex *di;
+	uint32_t nentries = dir->f_size / sizeof(struct File);
+
+	if ((di = dir_index(dir)) == NULL) {
+		if (dir->f_size / BLKSIZE >= DI_MINBLOCKS)
+			dir_index_build(dir, nentries);
+		return;
+	}
+	if (2 * (di->di_nused + 1) > di->di_nslots)
+		dir_index_build(dir, 2 * nentries);
+	else
+		dir_index_insert(di, f->f_name, n);
+}
+
+// Note that f, an entry of dir, is about to lose its name.
+static void
+dir_index_remove(struct File *dir, struct File *f)
+{
+	struct Dirindex *di;
+	uint32_t i, *slot;
+	struct File *g;
+
+	if ((di = dir_index(dir)) == NULL)
+		return;
+	for (i = dirhash(f->f_name); ; i++) {
+		slot = dir_index_slot(di, i & (di->di_nslots - 1));
+		if (*slot == DI_EMPTY)
+			break;
+		if (*slot == DI_DELETED)
+			continue;
+		if (dir_entry(dir, *slot - 1, &g) < 0)
+			break;
+		if (g == f) {
+			*slot = DI_DELETED;
+			return;
+		}
+	}
+	// not indexed: the index is stale
+	dir_index_drop(dir);
 }
 
 // Try to find a file named "name" in dir.  If so, set *file to it.
@@ -113,6 +954,15 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	uint32_t i, j, nblock;
 	char *blk;
 	struct File *f;
+	struct Dirindex *di;
+
+	if ((di = dir_index(dir)) != NULL) {
+		r = dir_index_lookup(dir, di, name, file);
+		if (r == 0 || r == -E_NOT_FOUND)
+			return r;
+		// the index is stale
+		dir_index_drop(dir);
+	}
 
 	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
@@ -122,6 +972,8 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	for (i = 0; i < nblock; i++) {
 		if ((r = file_get_block(dir, i, &blk)) < 0)
 			return r;
+		// directories stay in the cache
+		bc_pin(blk);
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
 			if (strcmp(f[j].f_name, name) == 0) {
@@ -132,6 +984,127 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
+// Set *file to point at a free File structure in dir, and *pn to its
+// entry number.  The caller is responsible for filling in the File
+// fields.
+static int
+dir_alloc_file(struct File *dir, struct File **file, uint32_t *pn)
+{
+	int r;
+	uint32_t nblock, i, j;
+	char *blk;
+	struct File *f;
+
+	assert((dir->f_size % BLKSIZE) == 0);
+	nblock = dir->f_size / BLKSIZE;
+	for (i = 0; i < nblock; i++) {
+		if ((r = file_get_block(dir, i, &blk)) < 0)
+			return r;
+		f = (struct File*) blk;
+		for (j = 0; j < BLKFILES; j++)
+			if (f[j].f_name[0] == '\0') {
+				*file = &f[j];
+				*pn = i * BLKFILES + j;
+				return 0;
+			}
+	}
+	dir->f_size += BLKSIZE;
+	if ((r = file_get_block(dir, i, &blk)) < 0)
+		return r;
+	bc_pin(blk);
+	f = (struct File*) blk;
+	*file = &f[0];
+	*pn = i * BLKFILES;
+	return 0;
+}
+
+
+// --------------------------------------------------------------
+// Path lookup cache
+// --------------------------------------------------------------
+
+// walk_path looks each path component up here before going to the
+// directory.  The cache is direct mapped, NPATHCACHE entries keyed by
+// (directory, name), and remembers failed lookups too (pc_file NULL).
+// Names of PC_MAXNAME bytes or more are not cached.  File structures
+// never move, so the entries stay good until file_create or
+// file_remove changes the name's directory: both call
+// pathcache_invalidate for the name, and removing a directory empties
+// the cache, since entries for names inside it are keyed by its
+// File, which a new file may reuse.
+#define NPATHCACHE	256
+#define PC_MAXNAME	32
+
+struct Pathcache {
+	struct File *pc_dir;	// NULL if the entry is unused
+	struct File *pc_file;	// NULL for a name that is not there
+	char pc_name[PC_MAXNAME];
+};
+
+static struct Pathcache pathcache[NPATHCACHE];
+static bool pathcache_off;
+static uint32_t pathcache_hits, pathcache_misses;
+
+// Return the cache entry (dir, name) maps to, or NULL if the name
+// is too long to be cached.
+static struct Pathcache *
+pathcache_slot(struct File *dir, const char *name)
+{
+	if (strlen(name) >= PC_MAXNAME)
+		return NULL;
+	return &pathcache[(dirhash(name) ^ ((uintptr_t) dir / sizeof(struct File)))
+			  % NPATHCACHE];
+}
+
+// Forget what the cache knows about name in dir.
+static void
+pathcache_invalidate(struct File *dir, const char *name)
+{
+	struct Pathcache *pc;
+
+	if ((pc = pathcache_slot(dir, name)) && pc->pc_dir == dir
+	    && strcmp(pc->pc_name, name) == 0)
+		pc->pc_dir = NULL;
+}
+
+// Look name up in dir through the cache; see dir_lookup.
+static int
+dir_lookup_cached(struct File *dir, const char *name, struct File **file)
+{
+	struct Pathcache *pc;
+	int r;
+
+	if (pathcache_off || (pc = pathcache_slot(dir, name)) == NULL)
+		return dir_lookup(dir, name, file);
+	if (pc->pc_dir == dir && strcmp(pc->pc_name, name) == 0) {
+		pathcache_hits++;
+		if (pc->pc_file == NULL)
+			return -E_NOT_FOUND;
+		*file = pc->pc_file;
+		return 0;
+	}
+	pathcache_misses++;
+	if ((r = dir_lookup(dir, name, file)) < 0 && r != -E_NOT_FOUND)
+		return r;
+	pc->pc_dir = dir;
+	pc->pc_file = (r == 0 ? *file : NULL);
+	strcpy(pc->pc_name, name);
+	return r;
+}
+
+// Turn the path cache on or off, if enable is not -1, and store its
+// statistics in *st.
+void
+pathcache_control(int enable, struct Fscache *st)
+{
+	if (enable != -1) {
+		pathcache_off = !enable;
+		memset(pathcache, 0, sizeof(pathcache));
+	}
+	st->c_pathcache = !pathcache_off;
+	st->c_pathhits = pathcache_hits;
+	st->c_pathmisses = pathcache_misses;
+}
 
 // Skip over slashes.
 static const char*
@@ -180,7 +1153,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if ((r = dir_lookup_cached(dir, name, &f)) < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -198,11 +1171,76 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 	return 0;
 }
 
+// Pack the entries of directory dir from entry *pn on into the n bytes
+// at buf, as struct Dirents (see FSREQ_READDIR), as many as fit; free
+// slots are skipped.  Sets *pn to the entry after the last one packed.
+// Returns the number of bytes stored, 0 at the end of dir, or < 0 on
+// error (-E_INVAL if dir is not a directory or the next entry does not
+// fit in n bytes).
+int
+file_readdir(struct File *dir, uint32_t *pn, void *buf, size_t n)
+{
+	struct File *f;
+	struct Dirent *d;
+	uint32_t nentries, len;
+	size_t used = 0;
+	int r;
+
+	if (dir->f_type != FTYPE_DIR)
+		return -E_INVAL;
+	nentries = dir->f_size / sizeof(struct File);
+	for (; *pn < nentries; (*pn)++) {
+		if ((r = dir_entry(dir, *pn, &f)) < 0)
+			return r;
+		if (f->f_name[0] == '\0')
+			continue;
+		len = strnlen(f->f_name, MAXNAMELEN - 1);
+		if (used + DIRENT_SIZE(len) > n)
+			return used ? used : -E_INVAL;
+		d = (struct Dirent*) ((char*) buf + used);
+		d->d_size = f->f_size;
+		d->d_type = f->f_type;
+		d->d_namelen = len;
+		memmove(d->d_name, f->f_name, len);
+		d->d_name[len] = '\0';
+		used += DIRENT_SIZE(len);
+	}
+	return used;
+}
+
 // --------------------------------------------------------------
 // File operations
 // --------------------------------------------------------------
 
 
+// Create "path".  On success set *pf to point at the file and return 0.
+// On error return < 0.
+int
+file_create(const char *path, struct File **pf)
+{
+	char name[MAXNAMELEN];
+	int r;
+	uint32_t n;
+	struct File *dir, *f;
+
+	if ((r = walk_path(path, &dir, &f, name)) == 0)
+		return -E_FILE_EXISTS;
+	if (r != -E_NOT_FOUND || dir == 0)
+		return r;
+	if ((r = dir_alloc_file(dir, &f, &n)) < 0)
+		return r;
+
+	memset(f, 0, sizeof(*f));
+	strcpy(f->f_name, name);
+	f->f_type = FTYPE_REG;
+	f->f_flags = FILE_EXTENTS;
+	dir_index_add(dir, n, f);
+	pathcache_invalidate(dir, name);
+	*pf = f;
+	file_flush(dir);
+	return 0;
+}
+
 // Open "path".  On success set *pf to point at the file and return 0.
 // On error return < 0.
 int
@@ -239,4 +1277,285 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 }
 
 
+// Like file_read, but only if everything it needs is already cached
+// and it is not time to read ahead, so that it changes nothing but the
+// read-ahead state and may run with the file system held shared (see
+// fs/serv.c).  Returns the number of bytes read, or -E_AGAIN if the
+// read must go through file_read.
+ssize_t
+file_read_cached(struct File *f, void *buf, size_t count, off_t offset)
+{
+	uint32_t b, end;
+	off_t pos;
+	char *blk;
+	int bn;
+	bool ok;
 
+	if (!va_is_mapped(f))
+		return -E_AGAIN;
+	if (offset >= f->f_size)
+		return 0;
+	count = MIN(count, f->f_size - offset);
+	if (count == 0)
+		return 0;
+
+	end = (offset + count - 1) / BLKSIZE + 1;
+	for (b = offset / BLKSIZE; b < end; b++)
+		if (file_cached_block(f, b, &blk) < 0)
+			return -E_AGAIN;
+	mutex_lock(&ra_lock);
+	if ((ok = file_readahead_cached(f, offset / BLKSIZE, end - offset / BLKSIZE)))
+		bc_count_hits(end - offset / BLKSIZE);
+	mutex_unlock(&ra_lock);
+	if (!ok)
+		return -E_AGAIN;
+
+	for (pos = offset; pos < offset + count; ) {
+		file_cached_block(f, pos / BLKSIZE, &blk);
+		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		memmove(buf, blk + pos % BLKSIZE, bn);
+		pos += bn;
+		buf += bn;
+	}
+	return count;
+}
+
+// --------------------------------------------------------------
+// Compressed files
+// --------------------------------------------------------------
+
+// A compressed file (FILE_LZ4) is read like any other: its blocks are
+// decompressed as the block cache faults them in.  Before it is
+// changed it is given ordinary blocks.  Its compressed data is packed
+// in with other files' and is never freed.
+
+// Give compressed file f ordinary blocks holding its data.  Returns 0
+// on success, < 0 on error, when f is left as it was.
+static int
+file_unpack(struct File *f)
+{
+	struct Extent e;
+	uint32_t b, nblocks;
+	char *blk;
+	int r;
+
+	e = f->f_extent[0];
+	nblocks = f->f_nextent ? e.e_len : 0;
+	f->f_flags &= ~FILE_LZ4;
+	f->f_nextent = 0;
+	for (b = 0; b < nblocks; b++) {
+		if ((r = file_get_block(f, b, &blk)) < 0)
+			goto fail;
+		memmove(blk, diskaddr(e.e_diskblk + b), BLKSIZE);
+	}
+	for (b = 0; b < nblocks; b++)
+		bc_drop(diskaddr(e.e_diskblk + b));
+	return 0;
+
+fail:
+	file_extent_truncate(f, 0);
+	f->f_flags |= FILE_LZ4;
+	f->f_extent[0] = e;
+	f->f_nextent = 1;
+	return r;
+}
+
+// Make compressed file f an empty ordinary one.
+static void
+file_zdrop(struct File *f)
+{
+	uint32_t b;
+
+	for (b = 0; f->f_nextent && b < f->f_extent[0].e_len; b++)
+		bc_drop(diskaddr(f->f_extent[0].e_diskblk + b));
+	f->f_flags &= ~FILE_LZ4;
+	f->f_nextent = 0;
+	memset(f->f_extent, 0, sizeof(f->f_extent));
+}
+
+// Write count bytes from buf into f, starting at seek position
+// offset.  This is meant to mimic the standard pwrite function.
+// Extends the file if necessary.
+// Returns the number of bytes written, < 0 on error.
+int
+file_write(struct File *f, const void *buf, size_t count, off_t offset)
+{
+	int r, bn;
+	off_t pos;
+	char *blk;
+
+	if ((f->f_flags & FILE_LZ4) && (r = file_unpack(f)) < 0)
+		return r;
+
+	// Extend file if necessary
+	if (offset + count > f->f_size)
+		if ((r = file_set_size(f, offset + count)) < 0)
+			return r;
+
+	for (pos = offset; pos < offset + count; ) {
+		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+			return r;
+		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
+		memmove(blk + pos % BLKSIZE, buf, bn);
+		pos += bn;
+		buf += bn;
+	}
+
+	return count;
+}
+
+// Remove a block from file f.  If it's not there, just silently succeed.
+// Returns 0 on success, < 0 on error.
+static int
+file_free_block(struct File *f, uint32_t filebno)
+{
+	int r;
+	uint32_t *ptr;
+
+	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
+		return r;
+	if (*ptr) {
+		free_block(*ptr);
+		*ptr = 0;
+	}
+	return 0;
+}
+
+// Remove any blocks currently used by file 'f',
+// but not necessary for a file of size 'newsize'.
+// For both the old and new sizes, figure out the number of blocks required,
+// and then clear the blocks from new_nblocks to old_nblocks.
+// If the new_nblocks is no more than NDIRECT, and the indirect block has
+// been allocated (f->f_indirect != 0), then free the indirect block too.
+// (Remember to clear the f->f_indirect pointer so you'll know
+// whether it's valid!)
+// Do not change f->f_size.
+static void
+file_truncate_blocks(struct File *f, off_t newsize)
+{
+	int r;
+	uint32_t bno, old_nblocks, new_nblocks;
+
+	// only ever truncated to nothing: see file_set_size
+	if (f->f_flags & FILE_LZ4) {
+		file_zdrop(f);
+		return;
+	}
+	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
+	if (f->f_flags & FILE_EXTENTS) {
+		file_extent_truncate(f, new_nblocks);
+		return;
+	}
+	for (bno = new_nblocks; bno < old_nblocks; bno++)
+		if ((r = file_free_block(f, bno)) < 0 && r != -E_NOT_FOUND)
+			cprintf("warning: file_free_block: %e", r);
+
+	if (new_nblocks <= NDIRECT && f->f_indirect) {
+		free_block(f->f_indirect);
+		f->f_indirect = 0;
+	}
+}
+
+// Set the size of file f, truncating or extending as necessary.
+// Blocks are only allocated as they are written; a shrunk file has the
+// tail of its new last block zeroed so that growing it again reads
+// zeros there.  A compressed file is unpacked first, unless it is
+// being emptied.
+int
+file_set_size(struct File *f, off_t newsize)
+{
+	char *blk;
+	int r;
+
+	if (newsize < 0 || newsize > (f->f_flags & FILE_EXTENTS ? MAXEXTFILESIZE : MAXFILESIZE))
+		return -E_INVAL;
+	if ((f->f_flags & FILE_LZ4) && newsize > 0 && (r = file_unpack(f)) < 0)
+		return r;
+	if (f->f_size > newsize) {
+		file_truncate_blocks(f, newsize);
+		if (newsize % BLKSIZE) {
+			if ((r = file_get_block(f, newsize / BLKSIZE, &blk)) < 0)
+				return r;
+			memset(blk + newsize % BLKSIZE, 0, BLKSIZE - newsize % BLKSIZE);
+		}
+	}
+	f->f_size = newsize;
+	return 0;
+}
+
+// Flush the contents and metadata of file f out to disk.
+// Loop over all the blocks in file, writing back each run of
+// disk-contiguous blocks in one go.
+// Also flush the block holding the File itself, its indirect block or
+// extent blocks, a directory's index and the free block bitmap.
+// On a disk with a journal, does nothing: f's changes go out with
+// everything else at the next commit (see journal.c), so closing a
+// file does not force it to disk.  A client that needs it there now
+// calls sync().
+void
+file_flush(struct File *f)
+{
+	uint32_t b, end, diskbno;
+	struct Dirindex *di;
+	int n;
+
+	if (super->s_njournal)
+		return;
+	end = (f->f_size + BLKSIZE - 1) / BLKSIZE;
+	for (b = 0; b < end; b += n) {
+		if ((n = file_map_run(f, b, end - b, &diskbno)) < 0)
+			break;
+		if (n == 0) {
+			n = 1;
+			continue;
+		}
+		bc_flush(diskbno, n);
+	}
+	flush_block(f);
+	if (f->f_indirect)
+		flush_block(diskaddr(f->f_indirect));
+	if (f->f_flags & FILE_EXTENTS)
+		extent_flush(f->f_extent, f->f_nextent, f->f_extdepth);
+	if ((di = dir_index(f)) != NULL) {
+		for (b = 0; b < di->di_nslots / DI_SLOTSPERBLK; b++)
+			flush_block(diskaddr(di->di_blocks[b]));
+		flush_block(di);
+	}
+	bc_flush(2, (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE);
+}
+
+// Remove a file by truncating it and then zeroing the name.
+int
+file_remove(const char *path)
+{
+	int r;
+	struct File *dir, *f;
+
+	if ((r = walk_path(path, &dir, &f, 0)) < 0)
+		return r;
+	if (dir == 0)
+		return -E_INVAL;	// the root
+
+	pathcache_invalidate(dir, f->f_name);
+	if (f->f_type == FTYPE_DIR)
+		memset(pathcache, 0, sizeof(pathcache));
+	dir_index_drop(f);
+	file_truncate_blocks(f, 0);
+	dir_index_remove(dir, f);
+	f->f_name[0] = '\0';
+	f->f_size = 0;
+	if (!super->s_njournal)
+		flush_block(f);
+
+	return 0;
+}
+
+// Sync the entire file system.  A big hammer.  Dirty blocks go out in
+// block order, each run of them in as few commands as possible, as a
+// journal transaction if the disk has a journal.
+void
+fs_sync(void)
+{
+	journal_commit();
+}
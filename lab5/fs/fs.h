@@ -11,37 +11,95 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Block cache pages mapped with this PTE_AVAIL bit are never evicted. */
+#define PTE_PIN		0x200
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
+bool bc_writethrough;		// sync after every change, not periodically
+bool ramdisk;			// blocks live on the RAM disk, not the IDE disk
 
 /* ide.c */
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+int	ide_start(uint32_t secno, void *va, size_t nsecs, bool write);
+int	ide_finish(void);
+void	ide_dma_init(void);
+void	ide_control(int dma, struct Fscache *st);
+
+/* ramdisk.c */
+bool	ramdisk_load(void);
+int	ramdisk_rw(uint32_t blockno, uint32_t nblocks, bool write);
+
+/* lz4.c */
+int	lz4_decompress(const void *src, size_t srclen, void *dst, size_t dstlen);
+
+/* bio.c */
+// Most blocks one disk command can move
+#define BIO_MAXRUN	(256 / BLKSECTS)
+// Called when a request completes, with r 0 or < 0 on error
+typedef void (*bio_done_t)(uint32_t blockno, uint32_t nblocks, int r);
+void	bio_init(void);
+void	bio_submit(uint32_t blockno, uint32_t nblocks, bool write, bio_done_t done);
+int	bio_rw(uint32_t blockno, uint32_t nblocks, bool write);
+bool	bio_pending(uint32_t blockno);
+void	bio_step(void);
+void	bio_drain(void);
+void	bio_control(struct Fscache *st);
 
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
+void	bc_prefetch(uint32_t blockno, uint32_t nblocks);
+void	bc_pin(void *va);
+void	bc_lookup(void *va);
+void	bc_count_hits(uint32_t n);
+void	bc_control(uint32_t budget, int writethrough, struct Fscache *st);
+void	bc_flush(uint32_t blockno, uint32_t nblocks);
+void	bc_writeback(uint32_t blockno);
+uint32_t bc_next_dirty(uint32_t blockno, uint32_t end);
+bool	bc_overbudget(void);
+void*	bc_zero_block(uint32_t blockno);
+void	bc_drop(void *va);
 void	flush_block(void *addr);
 void	bc_init(void);
 
+/* journal.c */
+void	journal_init(void);
+void	journal_commit(void);
+bool	journal_wanted(bool wrote);
+bool	journal_room(void);
+void	journal_data(uint32_t blockno);
+void	journal_freed(uint32_t blockno);
+void	journal_fresh(uint32_t blockno);
+void	journal_control(struct Fscache *st);
+
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_map_run(struct File *f, uint32_t filebno, uint32_t max, uint32_t *pdiskbno);
+void	file_readahead(struct File *f, uint32_t filebno, uint32_t nblocks);
+void	file_prefetch(struct File *f, off_t offset, size_t count);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+ssize_t	file_read_cached(struct File *f, void *buf, size_t count, off_t offset);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
 int	file_remove(const char *path);
+int	file_readdir(struct File *dir, uint32_t *pn, void *buf, size_t n);
 void	fs_sync(void);
+void	pathcache_control(int enable, struct Fscache *st);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_block_near(uint32_t goal);
+void	free_block(uint32_t blockno);
 
 /* test.c */
 void	fs_test(void);
@@ -33,6 +33,8 @@ typedef int bool;
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
 #define MAX_DIR_ENTS 128
+// Journal blocks, header included, on disks big enough to spare them
+#define NJOURNAL 256
 
 struct Dir
 {
@@ -45,6 +47,13 @@ uint32_t nblocks;
 char *diskmap, *diskpos;
 struct Super *super;
 uint32_t *bitmap;
+struct Jheader *jh;
+
+// The compressed block map, written out by finishdisk, and what
+// compression saved
+struct Zblock *zmap;
+uint32_t nzblocks, zmapsize;
+uint32_t nzfiles, nfiles, rawblocks, zdiskblocks;
 
 void
 panic(const char *fmt, ...)
@@ -117,6 +126,14 @@ opendisk(const char *name)
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// The journal follows, near the metadata it holds copies of.
+	if (nblocks >= 8 * NJOURNAL) {
+		jh = alloc(NJOURNAL * BLKSIZE);
+		jh->jh_magic = JH_MAGIC;
+		super->s_journal = blockof(jh);
+		super->s_njournal = NJOURNAL;
+	}
 }
 
 void
@@ -124,6 +141,19 @@ finishdisk(void)
 {
 	int r, i;
 
+	if (nzblocks) {
+		super->s_nzblocks = nzblocks;
+		super->s_zmap = blockof(alloc(nzblocks * sizeof *zmap));
+		memmove(diskmap + super->s_zmap * BLKSIZE, zmap,
+			nzblocks * sizeof *zmap);
+		if (nblocks + nzblocks > 0xC0000000 / BLKSIZE)
+			panic("too many compressed blocks");
+	}
+	if (nzfiles)
+		printf("fsformat: %u of %u files compressed, %u blocks in %u, "
+		       "block map %u blocks\n", nzfiles, nfiles, rawblocks,
+		       zdiskblocks, (uint32_t) (ROUNDUP(nzblocks, NZBLOCK) / NZBLOCK));
+
 	for (i = 0; i < blockof(diskpos); ++i)
 		bitmap[i/32] &= ~(1<<(i%32));
 
@@ -134,24 +164,166 @@ finishdisk(void)
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
+	// Every file is contiguous, so one extent maps it.
 	f->f_size = len;
+	f->f_flags = FILE_EXTENTS;
 	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
-		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
-		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
-			ind[i - NDIRECT] = start + i;
+	if (len) {
+		f->f_nextent = 1;
+		f->f_extent[0].e_fileblk = 0;
+		f->f_extent[0].e_diskblk = start;
+		f->f_extent[0].e_len = len / BLKSIZE;
+	}
+}
+
+// --------------------------------------------------------------
+// LZ4 compression, in the block format fs/lz4.c decompresses
+// --------------------------------------------------------------
+
+#define LZ4_HASHLOG	12
+#define LZ4_MINMATCH	4
+// The last match must start LZ4_MFLIMIT bytes before the end, and the
+// last LZ4_LASTLITERALS bytes must be literals, for decoders that copy
+// in words.
+#define LZ4_MFLIMIT	12
+#define LZ4_LASTLITERALS 5
+// Room for compressing a block that does not compress
+#define LZ4_BOUND	(BLKSIZE + BLKSIZE / 255 + 16)
+
+uint32_t
+lz4_hash(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return (v * 2654435761U) >> (32 - LZ4_HASHLOG);
+}
+
+uint8_t *
+lz4_putlen(uint8_t *op, uint32_t n)
+{
+	for (; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = n;
+	return op;
+}
+
+uint8_t *
+lz4_sequence(uint8_t *op, const uint8_t *lit, uint32_t nlit,
+	     uint32_t offset, uint32_t matchlen)
+{
+	uint8_t *token = op++;
+
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15)
+		op = lz4_putlen(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (matchlen == 0)
+		return op;
+	*op++ = offset;
+	*op++ = offset >> 8;
+	matchlen -= LZ4_MINMATCH;
+	*token |= matchlen < 15 ? matchlen : 15;
+	if (matchlen >= 15)
+		op = lz4_putlen(op, matchlen - 15);
+	return op;
+}
+
+// Compress the n bytes at src into dst, which must have room for
+// LZ4_BOUND bytes, taking the first match a hash table finds.  Returns
+// the compressed size.
+uint32_t
+lz4_compress(const uint8_t *src, uint32_t n, uint8_t *dst)
+{
+	int32_t table[1 << LZ4_HASHLOG];
+	const uint8_t *ip = src, *anchor = src, *ref;
+	const uint8_t *end = src + n;
+	uint8_t *op = dst;
+	uint32_t h, len;
+	int32_t prev;
+
+	memset(table, 0xFF, sizeof table);
+	while (n >= LZ4_MFLIMIT && ip < end - LZ4_MFLIMIT) {
+		h = lz4_hash(ip);
+		prev = table[h];
+		table[h] = ip - src;
+		if (prev < 0 || ip - src - prev > 0xFFFF
+		    || memcmp(src + prev, ip, 4) != 0) {
+			ip++;
+			continue;
+		}
+		ref = src + prev;
+		for (len = LZ4_MINMATCH; ip + len < end - LZ4_LASTLITERALS
+			     && ref[len] == ip[len]; len++)
+			/* do nothing */;
+		op = lz4_sequence(op, anchor, ip - anchor, ip - ref, len);
+		ip += len;
+		anchor = ip;
 	}
+	op = lz4_sequence(op, anchor, end - anchor, 0, 0);
+	return op - dst;
+}
+
+// Store the size bytes at data as f's contents, compressed if that
+// takes fewer disk blocks.  Each block is compressed by itself and
+// numbered after the disk's blocks (see struct Zblock).
+void
+writezfile(struct File *f, const char *data, uint32_t size)
+{
+	static uint8_t zblk[LZ4_BOUND];
+	uint32_t n, i, len, zsize;
+	char *zdata, *start, blk[BLKSIZE];
+	struct Zblock *z;
+
+	n = ROUNDUP(size, BLKSIZE) / BLKSIZE;
+	zdata = malloc(n * BLKSIZE);
+	if (nzblocks + n > zmapsize) {
+		zmapsize = 2 * (nzblocks + n);
+		zmap = realloc(zmap, zmapsize * sizeof *zmap);
+	}
+	z = &zmap[nzblocks];
+	for (zsize = i = 0; i < n; i++) {
+		// the tail of the last block is zeros, as the server keeps it
+		len = size - i * BLKSIZE;
+		memset(blk, 0, BLKSIZE);
+		memcpy(blk, data + i * BLKSIZE, len < BLKSIZE ? len : BLKSIZE);
+		len = lz4_compress((uint8_t *) blk, BLKSIZE, zblk);
+		if (len >= BLKSIZE)
+			memcpy(zdata + zsize, blk, len = BLKSIZE);
+		else
+			memcpy(zdata + zsize, zblk, len);
+		z[i].z_blockno = zsize / BLKSIZE;
+		z[i].z_off = zsize % BLKSIZE;
+		z[i].z_len = len;
+		zsize += len;
+	}
+
+	nfiles++;
+	if (ROUNDUP(zsize, BLKSIZE) >= n * BLKSIZE) {
+		start = alloc(size);
+		memcpy(start, data, size);
+		finishfile(f, blockof(start), size);
+	} else {
+		start = alloc(zsize);
+		memcpy(start, zdata, zsize);
+		for (i = 0; i < n; i++)
+			z[i].z_blockno += blockof(start);
+		finishfile(f, nblocks + nzblocks, size);
+		f->f_flags |= FILE_LZ4;
+		nzblocks += n;
+		nzfiles++;
+		rawblocks += n;
+		zdiskblocks += ROUNDUP(zsize, BLKSIZE) / BLKSIZE;
+	}
+	free(zdata);
 }
 
 void
 startdir(struct File *f, struct Dir *dout)
 {
 	dout->f = f;
-	dout->ents = malloc(MAX_DIR_ENTS * sizeof *dout->ents);
+	dout->ents = calloc(MAX_DIR_ENTS, sizeof *dout->ents);
 	dout->n = 0;
 }
 
@@ -166,6 +338,33 @@ diradd(struct Dir *d, uint32_t type, const char *name)
 	return out;
 }
 
+// Build the hashed name index (struct Dirindex) for the nents entries
+// at ents, as the file server would for a directory that size.
+void
+finishindex(struct File *dir, struct File *ents, uint32_t nents)
+{
+	struct Dirindex *di;
+	uint32_t *table, nslots, i, j;
+
+	for (nslots = DI_SLOTSPERBLK; nslots < 2 * nents; nslots *= 2)
+		/* do nothing */;
+	di = alloc(BLKSIZE);
+	table = alloc(nslots * sizeof *table);
+	di->di_magic = DI_MAGIC;
+	di->di_nslots = nslots;
+	for (i = 0; i < nslots / DI_SLOTSPERBLK; i++)
+		di->di_blocks[i] = blockof(table) + i;
+	for (j = 0; j < nents; j++) {
+		if (ents[j].f_name[0] == '\0')
+			continue;
+		for (i = dirhash(ents[j].f_name); table[i & (nslots - 1)]; i++)
+			/* do nothing */;
+		table[i & (nslots - 1)] = j + 1;
+		di->di_nused++;
+	}
+	dir->f_dirindex = blockof(di);
+}
+
 void
 finishdir(struct Dir *d)
 {
@@ -173,12 +372,14 @@ finishdir(struct Dir *d)
 	struct File *start = alloc(size);
 	memmove(start, d->ents, size);
 	finishfile(d->f, blockof(start), ROUNDUP(size, BLKSIZE));
+	if (ROUNDUP(size, BLKSIZE) / BLKSIZE >= DI_MINBLOCKS)
+		finishindex(d->f, start, ROUNDUP(size, BLKSIZE) / sizeof(struct File));
 	free(d->ents);
 	d->ents = NULL;
 }
 
 void
-writefile(struct Dir *dir, const char *name)
+writefile(struct Dir *dir, const char *name, bool compress)
 {
 	int r, fd;
 	struct File *f;
@@ -192,7 +393,7 @@ writefile(struct Dir *dir, const char *name)
 		panic("stat %s: %s", name, strerror(errno));
 	if (!S_ISREG(st.st_mode))
 		panic("%s is not a regular file", name);
-	if (st.st_size >= MAXFILESIZE)
+	if (st.st_size >= MAXEXTFILESIZE)
 		panic("%s too large", name);
 
 	last = strrchr(name, '/');
@@ -202,16 +403,29 @@ writefile(struct Dir *dir, const char *name)
 		last = name;
 
 	f = diradd(dir, FTYPE_REG, last);
-	start = alloc(st.st_size);
-	readn(fd, start, st.st_size);
-	finishfile(f, blockof(start), st.st_size);
+	// Each file's data is block aligned and contiguous on disk, so
+	// the file server can map long runs of it (FSREQ_MAP): spawn
+	// shares program pages straight from the block cache that way.
+	// A compressed file's blocks are numbered consecutively for the
+	// same reason.
+	if (compress && st.st_size > 0) {
+		start = malloc(st.st_size);
+		readn(fd, start, st.st_size);
+		writezfile(f, start, st.st_size);
+		free(start);
+	} else {
+		start = alloc(st.st_size);
+		readn(fd, start, st.st_size);
+		finishfile(f, blockof(start), st.st_size);
+	}
 	close(fd);
 }
 
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS files...\n");
+	fprintf(stderr, "Usage: fsformat fs.img NBLOCKS [-z] files...\n"
+		"  -z compresses the files after it that LZ4 shrinks\n");
 	exit(2);
 }
 
@@ -221,21 +435,26 @@ main(int argc, char **argv)
 	int i;
 	char *s;
 	struct Dir root;
+	bool compress = 0;
 
 	assert(BLKSIZE % sizeof(struct File) == 0);
 
 	if (argc < 3)
 		usage();
 
+	// The file server maps at most DISKSIZE (3GB) of disk
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > 0xC0000000 / BLKSIZE)
 		usage();
 
 	opendisk(argv[1]);
 
 	startdir(&super->s_root, &root);
 	for (i = 3; i < argc; i++)
-		writefile(&root, argv[i]);
+		if (strcmp(argv[i], "-z") == 0)
+			compress = 1;
+		else
+			writefile(&root, argv[i], compress);
 	finishdir(&root);
 
 	finishdisk();
@@ -1,5 +1,6 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code: bus-master DMA on a PCI IDE controller,
+ * sleeping until the completion interrupt, or PIO if there is none.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,8 +13,58 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
+// Device control register: nIEN masks the drive's interrupt
+#define IDE_CTL		0x3F6
+#define IDE_NIEN	0x02
+
+// PCI configuration space
+#define PCI_CONFADDR	0xCF8
+#define PCI_CONFDATA	0xCFC
+#define PCI_ID		0x00
+#define PCI_CMD		0x04
+#define PCI_CMD_IO	0x0001
+#define PCI_CMD_MASTER	0x0004
+#define PCI_CLASS	0x08
+#define PCI_BAR4	0x20
+
+// Bus-master registers of the primary channel, from BAR4 (the PIIX
+// layout, which every PCI IDE controller follows)
+#define BM_CMD		0
+#define BM_START	0x01
+#define BM_READ		0x08	// the controller writes memory
+#define BM_STATUS	2
+#define BM_ACTIVE	0x01
+#define BM_ERR		0x02
+#define BM_IRQ		0x04
+#define BM_PRDT		4
+
+// A physical region descriptor: one piece of a DMA transfer, which must
+// not cross a 64 KB boundary; every transfer here is page-aligned, so
+// each page gets its own.
+struct Prd {
+	uint32_t prd_addr;
+	uint16_t prd_len;
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000	// last descriptor of the table
+
+// Most pages one command moves: 256 sectors
+#define DMA_MAXPAGES	(256 * SECTSIZE / PGSIZE)
+// Timer ticks to wait for a completion interrupt before giving up
+#define DMA_TICKS	500
+
 static int diskno = 1;
 
+// Bus-master I/O base, or 0 if there is no DMA.
+static uint16_t bmbase;
+// Use DMA when the controller has it.
+static bool dma_on = 1;
+static struct Prd prdt[DMA_MAXPAGES] __attribute__((aligned(PGSIZE)));
+static physaddr_t prdt_pa;
+// Bumped by the kernel on every IRQ_IDE; also the futex we sleep on.
+static volatile uint32_t ide_irqs;
+static struct Fscache ide_stat;
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -59,12 +110,86 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+static uint32_t
+pci_conf_read(int dev, int func, int reg)
+{
+	outl(PCI_CONFADDR, 0x80000000 | (dev << 11) | (func << 8) | reg);
+	return inl(PCI_CONFDATA);
+}
+
+static void
+pci_conf_write(int dev, int func, int reg, uint32_t v)
+{
+	outl(PCI_CONFADDR, 0x80000000 | (dev << 11) | (func << 8) | reg);
+	outl(PCI_CONFDATA, v);
+}
+
+// Look on PCI bus 0 for an IDE controller that can bus-master with its
+// primary channel at the legacy ports, turn bus-mastering on, and have
+// the kernel forward its interrupt to us.  Transfers stay PIO if any of
+// that fails.
+void
+ide_dma_init(void)
+{
+	int dev, func, r;
+	uint32_t class, bar;
+
+	for (dev = 0; dev < 32 && !bmbase; dev++)
+		for (func = 0; func < 8 && !bmbase; func++) {
+			if ((pci_conf_read(dev, func, PCI_ID) & 0xFFFF) == 0xFFFF)
+				continue;
+			// Mass storage, IDE, bus master, primary in
+			// compatibility mode
+			class = pci_conf_read(dev, func, PCI_CLASS);
+			if ((class >> 16) != 0x0101 || !(class & 0x8000)
+			    || (class & 0x100))
+				continue;
+			bar = pci_conf_read(dev, func, PCI_BAR4);
+			if (!(bar & 1) || (bar & 0xFFFC) == 0)
+				continue;
+			pci_conf_write(dev, func, PCI_CMD,
+				       pci_conf_read(dev, func, PCI_CMD)
+				       | PCI_CMD_IO | PCI_CMD_MASTER);
+			bmbase = bar & 0xFFFC;
+		}
+	if (!bmbase) {
+		cprintf("IDE DMA: no bus-master controller, using PIO\n");
+		return;
+	}
+	if ((r = sys_page_phys(prdt, 1, &prdt_pa)) < 0
+	    || (r = sys_irq_forward(IRQ_IDE, &ide_irqs)) < 0) {
+		cprintf("IDE DMA: %e, using PIO\n", r);
+		bmbase = 0;
+		return;
+	}
+	outb(IDE_CTL, 0);
+	cprintf("IDE DMA: bus master at port %04x\n", bmbase);
+}
+
+// Switch between DMA (if there is a controller for it) and PIO,
+// unless 'dma' is -1, and store the transfer statistics in *st.
+void
+ide_control(int dma, struct Fscache *st)
+{
+	if (dma >= 0)
+		dma_on = dma;
+	if (bmbase)
+		outb(IDE_CTL, dma_on ? 0 : IDE_NIEN);
+	st->c_dma = bmbase && dma_on;
+	st->c_dmacmds = ide_stat.c_dmacmds;
+	st->c_piocmds = ide_stat.c_piocmds;
+	st->c_irqwaits = ide_stat.c_irqwaits;
+	st->c_sectread = ide_stat.c_sectread;
+	st->c_sectwritten = ide_stat.c_sectwritten;
+}
+
+// Move nsecs sectors between the disk and va, by PIO.
+static int
+ide_pio(uint32_t secno, void *va, size_t nsecs, bool write)
 {
 	int r;
 
-	assert(nsecs <= 256);
+	ide_stat.c_piocmds++;
 
 	ide_wait_ready(0);
 
@@ -73,39 +198,142 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+	outb(0x1F7, write ? 0x30 : 0x20);	// WRITE SECTORS, READ SECTORS
 
-	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
+	for (; nsecs > 0; nsecs--, va += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
 			return r;
-		insl(0x1F0, dst, SECTSIZE/4);
+		if (write)
+			outsl(0x1F0, va, SECTSIZE/4);
+		else
+			insl(0x1F0, va, SECTSIZE/4);
 	}
 
 	return 0;
 }
 
+// The transfer ide_start has under way by DMA, if any
+static struct {
+	bool busy;
+	uint32_t secno;
+	void *va;
+	size_t nsecs;
+	bool write;
+} dma_cur;
+
+// Begin moving nsecs sectors between the disk and va.  A page-aligned
+// transfer goes by DMA when it can: then ide_start returns 1 and
+// ide_finish must be called before the next command.  Otherwise the
+// transfer is done by PIO before ide_start returns 0.  Returns < 0 on
+// error.
 int
-ide_write(uint32_t secno, const void *src, size_t nsecs)
+ide_start(uint32_t secno, void *va, size_t nsecs, bool write)
 {
-	int r;
+	physaddr_t pa[DMA_MAXPAGES];
+	size_t len = nsecs * SECTSIZE;
+	int i, r, npages;
+
+	assert(nsecs <= 256 && !dma_cur.busy);
+	if (write)
+		ide_stat.c_sectwritten += nsecs;
+	else
+		ide_stat.c_sectread += nsecs;
 
-	assert(nsecs <= 256);
+	if (!bmbase || !dma_on || PGOFF(va) != 0)
+		return ide_pio(secno, va, nsecs, write);
+
+	npages = ROUNDUP(len, PGSIZE) / PGSIZE;
+	if ((r = sys_page_phys(va, npages, pa)) < 0)
+		return r;
+	for (i = 0; i < npages; i++) {
+		prdt[i].prd_addr = pa[i];
+		prdt[i].prd_len = MIN(len - i * PGSIZE, PGSIZE);
+		prdt[i].prd_flags = 0;
+	}
+	prdt[npages - 1].prd_flags = PRD_EOT;
 
 	ide_wait_ready(0);
+	outb(bmbase + BM_CMD, 0);
+	outl(bmbase + BM_PRDT, prdt_pa);
+	outb(bmbase + BM_STATUS, BM_ERR | BM_IRQ);
+	outb(bmbase + BM_CMD, write ? 0 : BM_READ);
 
 	outb(0x1F2, nsecs);
 	outb(0x1F3, secno & 0xFF);
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+	outb(0x1F7, write ? 0xCA : 0xC8);	// WRITE DMA, READ DMA
+	outb(bmbase + BM_CMD, (write ? 0 : BM_READ) | BM_START);
+	ide_stat.c_dmacmds++;
 
-	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
-		if ((r = ide_wait_ready(1)) < 0)
-			return r;
-		outsl(0x1F0, src, SECTSIZE/4);
-	}
+	dma_cur.busy = 1;
+	dma_cur.secno = secno;
+	dma_cur.va = va;
+	dma_cur.nsecs = nsecs;
+	dma_cur.write = write;
+	return 1;
+}
+
+// Wait for the DMA transfer begun by ide_start, sleeping until the
+// drive interrupts.  If the interrupt never comes, DMA is turned off
+// and the transfer done again by PIO.  Returns 0 on success, < 0 on
+// error.
+int
+ide_finish(void)
+{
+	uint32_t irqs;
+	int r, st;
 
+	assert(dma_cur.busy);
+	dma_cur.busy = 0;
+
+	// Sample the counter before the status, so an interrupt in
+	// between makes the futex wait return at once.
+	for (;;) {
+		irqs = ide_irqs;
+		st = inb(bmbase + BM_STATUS);
+		if ((st & (BM_IRQ|BM_ERR)) || !(st & BM_ACTIVE))
+			break;
+		ide_stat.c_irqwaits++;
+		if (sys_futex_wait(&ide_irqs, irqs, DMA_TICKS) == -E_TIMEOUT
+		    && irqs == ide_irqs) {
+			st = inb(bmbase + BM_STATUS);
+			if ((st & (BM_IRQ|BM_ERR)) || !(st & BM_ACTIVE))
+				break;
+			cprintf("IDE DMA: timeout, using PIO\n");
+			outb(bmbase + BM_CMD, 0);
+			dma_on = 0;
+			outb(IDE_CTL, IDE_NIEN);
+			return ide_pio(dma_cur.secno, dma_cur.va, dma_cur.nsecs,
+				       dma_cur.write);
+		}
+	}
+	outb(bmbase + BM_CMD, 0);
+	// Reading the drive's status acknowledges its interrupt.
+	r = ide_wait_ready(1);
+	outb(bmbase + BM_STATUS, BM_ERR | BM_IRQ);
+	if (r < 0 || (st & BM_ERR))
+		return -1;
 	return 0;
 }
 
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	if ((r = ide_start(secno, dst, nsecs, 0)) == 1)
+		r = ide_finish();
+	return r;
+}
+
+int
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	int r;
+
+	if ((r = ide_start(secno, (void *) src, nsecs, 1)) == 1)
+		r = ide_finish();
+	return r;
+}
@@ -0,0 +1,325 @@
+// Write-ahead journal for metadata, on disks fsformat gave one (see
+// struct Jheader).
+//
+// Between commits nothing dirty is written home: the block cache keeps
+// dirty blocks until the next commit, which the server makes between
+// requests, when the file system is consistent.  All the requests since
+// the last commit so make up one transaction, and reach the disk
+// together:
+//
+//  1. Dirty data blocks of regular files are written home first, so
+//     that no committed metadata points at stale data.
+//  2. Copies of the dirty metadata blocks are written to the journal,
+//     one sequential run, then the header, naming them: the commit.
+//  3. The metadata blocks are written home (the checkpoint), and the
+//     header is cleared.
+//
+// After a crash, fs_init replays a header that was committed but not
+// cleared.  Which blocks are data is not on disk: file_get_block notes
+// the blocks of regular files as it hands them out.  A block freed
+// while holding metadata that is reused for data before the next
+// commit goes through the journal like metadata, so that it is not
+// overwritten while the disk still says it holds metadata.
+//
+// A transaction must fit in the journal, so the server commits early,
+// between requests, once the dirty metadata might come within jn_slack
+// blocks of filling it (see journal_wanted).  That leaves room for what
+// an ordinary request dirties: the bitmap, JN_OLDBLOCKS of the metadata
+// already on disk and JN_NEWBLOCKS new metadata blocks.  Only new
+// blocks can add up past that, as when a directory index is built or a
+// compressed file unpacked, so alloc_block asks journal_room before
+// handing out each one, and the request fails with -E_NO_DISK, the
+// file system still consistent, rather than outgrow the journal.
+//
+// Walking the cache to count the dirty metadata is too slow to do
+// after every request.  Instead the server keeps a bound on it: the
+// count at the last walk, plus each new metadata block as it is made,
+// plus JN_OLDBLOCKS for each request since that may have changed
+// anything.  The dirty bitmap blocks are counted directly.  Only when
+// the bound nears the limit is the cache walked again.
+
+#include "fs.h"
+
+#define JN_NWORDS	(DISKSIZE / BLKSIZE / 32)
+// Most blocks of metadata already on disk that one request changes,
+// besides the bitmap: the File's directory block and its parent's, the
+// extent tree path to each of up to three blocks it adds (two for a
+// write of up to a page, one for a growing directory), and the blocks
+// of a directory index that a name's probe crosses.
+#define JN_OLDBLOCKS	16
+// New metadata blocks an ordinary request may need: each block added
+// may split every level of the extent tree above it, and may reuse a
+// metadata block freed since the last commit.
+#define JN_NEWBLOCKS	(3 * (EXT_MAXDEPTH + 2))
+
+static struct Jheader *jh;
+static uint32_t jn_max;			// blocks a transaction can hold
+static uint32_t jn_nbitmap;		// blocks of the bitmap
+static uint32_t jn_slack;		// room kept for the next request
+static uint32_t jn_counted;		// dirty metadata outside the bitmap,
+					// at the last count
+static uint32_t jn_added;		// bound on what is dirtied since
+static bool jn_touched;			// has the current request allocated
+					// or freed a block?
+static uint32_t jn_data[JN_NWORDS];	// blocks of regular files
+static uint32_t jn_freed[JN_NWORDS];	// metadata blocks freed since the
+					// last commit
+static struct Fscache jn_stat;
+
+static bool
+jn_test(uint32_t *bits, uint32_t blockno)
+{
+	return (bits[blockno / 32] & (1 << (blockno % 32))) != 0;
+}
+
+// Is blockno in the journal itself?
+static bool
+jn_inside(uint32_t blockno)
+{
+	return blockno - super->s_journal < super->s_njournal;
+}
+
+// Is blockno data that is written home before a commit, rather than
+// through the journal?
+static bool
+jn_isdata(uint32_t blockno)
+{
+	return jn_test(jn_data, blockno) && !jn_test(jn_freed, blockno);
+}
+
+// Is blockno part of the bitmap?
+static bool
+jn_isbitmap(uint32_t blockno)
+{
+	return blockno - 2 < jn_nbitmap;
+}
+
+// Count the dirty metadata blocks outside the bitmap by walking the
+// cache, and restart the bound on them from there.
+static void
+jn_count(void)
+{
+	uint32_t b, n = 0, end = super->s_nblocks;
+
+	for (b = bc_next_dirty(1, end); b < end; b = bc_next_dirty(b + 1, end))
+		if (!jn_inside(b) && !jn_isdata(b) && !jn_isbitmap(b))
+			n++;
+	jn_counted = n;
+	jn_added = 0;
+}
+
+// Return a bound on the dirty metadata blocks, which the next commit
+// must hold.
+static uint32_t
+jn_bound(void)
+{
+	uint32_t i, n = jn_counted + jn_added;
+
+	for (i = 0; i < jn_nbitmap; i++)
+		if (va_is_mapped(diskaddr(2 + i)) && va_is_dirty(diskaddr(2 + i)))
+			n++;
+	return n;
+}
+
+// Copy i of the transaction, in the block after the header.
+static void *
+jn_copy(uint32_t i)
+{
+	return diskaddr(super->s_journal + 1 + i);
+}
+
+// Checksum of the header's block list and the first n copies.
+static uint32_t
+jn_sum(uint32_t n)
+{
+	uint32_t h = 2166136261U, i, j, *w;
+
+	h = (h ^ jh->jh_seq) * 16777619;
+	for (i = 0; i < n; i++) {
+		h = (h ^ jh->jh_blocks[i]) * 16777619;
+		w = jn_copy(i);
+		for (j = 0; j < BLKSIZE / 4; j++)
+			h = (h ^ w[j]) * 16777619;
+	}
+	return h;
+}
+
+// Clear the header: there is nothing left to replay.
+static void
+jn_clear(void)
+{
+	jh->jh_nblocks = 0;
+	flush_block(jh);
+}
+
+// Find the journal and replay the transaction it holds, if any.
+void
+journal_init(void)
+{
+	uint32_t i, b;
+
+	if (super->s_njournal == 0)
+		return;
+	if (super->s_njournal < 2 || super->s_journal < 2
+	    || super->s_journal + super->s_njournal > super->s_nblocks)
+		panic("bad journal");
+	jh = diskaddr(super->s_journal);
+	bc_pin(jh);
+	if (jh->jh_magic != JH_MAGIC)
+		panic("bad journal header");
+	jn_max = MIN(super->s_njournal - 1, JH_MAXBLOCKS);
+	jn_nbitmap = (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+	jn_slack = jn_nbitmap + JN_OLDBLOCKS + JN_NEWBLOCKS;
+	if (jn_max <= jn_slack)
+		panic("journal of %d blocks is too small", super->s_njournal);
+	if (jh->jh_nblocks == 0)
+		return;
+
+	if (jh->jh_nblocks > jn_max || jn_sum(jh->jh_nblocks) != jh->jh_sum) {
+		// the commit never finished, so neither did anything after it
+		cprintf("journal: transaction %d is torn, not replaying it\n",
+			jh->jh_seq);
+		jn_clear();
+		return;
+	}
+	for (i = 0; i < jh->jh_nblocks; i++) {
+		b = jh->jh_blocks[i];
+		if (b < 1 || b >= super->s_nblocks || jn_inside(b))
+			panic("journal: bad block %08x in transaction %d",
+			      b, jh->jh_seq);
+		memmove(diskaddr(b), jn_copy(i), BLKSIZE);
+		bc_writeback(b);
+	}
+	bio_drain();
+	cprintf("journal: replayed transaction %d, %d blocks\n",
+		jh->jh_seq, jh->jh_nblocks);
+	jn_clear();
+}
+
+// Note that blockno holds data of a regular file.
+void
+journal_data(uint32_t blockno)
+{
+	jn_data[blockno / 32] |= 1 << (blockno % 32);
+}
+
+// Note that blockno has been freed.
+void
+journal_freed(uint32_t blockno)
+{
+	jn_touched = 1;
+	if (!jn_test(jn_data, blockno))
+		jn_freed[blockno / 32] |= 1 << (blockno % 32);
+	jn_data[blockno / 32] &= ~(1 << (blockno % 32));
+}
+
+// Note that blockno has just been allocated and zeroed in the cache.
+void
+journal_fresh(uint32_t blockno)
+{
+	if (!jh || jn_inside(blockno))
+		return;
+	jn_touched = 1;
+	if (!jn_isdata(blockno))
+		jn_added++;
+}
+
+// May the request being served allocate another block?  Only if the
+// transaction can still hold one more new metadata block on top of the
+// most the rest of the request dirties otherwise.  The bound is counted
+// afresh before saying no.
+bool
+journal_room(void)
+{
+	uint32_t need = jn_nbitmap + JN_OLDBLOCKS + 1;
+
+	if (!jh || jn_bound() + need <= jn_max)
+		return 1;
+	jn_count();
+	return jn_bound() + need <= jn_max;
+}
+
+// Commit the n blocks listed in the header, whose copies are in the
+// cache, dirty, and checkpoint them.
+static void
+jn_write(uint32_t n)
+{
+	uint32_t i;
+
+	jh->jh_seq++;
+	jh->jh_sum = jn_sum(n);
+	bc_flush(super->s_journal + 1, n);
+	jh->jh_nblocks = n;
+	flush_block(jh);
+
+	for (i = 0; i < n; i++)
+		bc_writeback(jh->jh_blocks[i]);
+	bio_drain();
+	jn_clear();
+	jn_stat.c_commits++;
+	jn_stat.c_journaled += n;
+}
+
+// Write every dirty block to disk, as one transaction if the journal
+// holds it.  Without a journal, just write them back.
+void
+journal_commit(void)
+{
+	uint32_t b, n, end = super->s_nblocks;
+
+	if (super->s_njournal == 0) {
+		bc_flush(1, end - 1);
+		return;
+	}
+
+	for (b = bc_next_dirty(1, end); b < end; b = bc_next_dirty(b + 1, end))
+		if (jn_isdata(b))
+			bc_writeback(b);
+	bio_drain();
+
+	n = 0;
+	for (b = bc_next_dirty(1, end); b < end; b = bc_next_dirty(b + 1, end)) {
+		if (jn_inside(b))
+			continue;
+		// journal_room and journal_wanted keep this from happening
+		if (n == jn_max)
+			panic("journal: transaction outgrew the journal");
+		jh->jh_blocks[n] = b;
+		memmove(bc_zero_block(super->s_journal + 1 + n),
+			diskaddr(b), BLKSIZE);
+		n++;
+	}
+	if (n > 0)
+		jn_write(n);
+	memset(jn_freed, 0, ROUNDUP(end, 32) / 8);
+	jn_counted = jn_added = 0;
+}
+
+// Should the server commit now, rather than wait for the next sync?
+// Called after each request, with wrote set if it was one that changes
+// the file system.  Yes if the cache has gone over budget with blocks
+// only a commit can write back, or if the next request might dirty
+// more metadata than the journal has room left for.
+bool
+journal_wanted(bool wrote)
+{
+	if (!super->s_njournal)
+		return 0;
+	if (wrote || jn_touched)
+		jn_added += JN_OLDBLOCKS;
+	jn_touched = 0;
+	if (bc_overbudget())
+		return 1;
+	if (jn_bound() + jn_slack <= jn_max)
+		return 0;
+	jn_count();
+	return jn_bound() + jn_slack > jn_max;
+}
+
+// Store the journal statistics in *st.
+void
+journal_control(struct Fscache *st)
+{
+	st->c_commits = jn_stat.c_commits;
+	st->c_journaled = jn_stat.c_journaled;
+}
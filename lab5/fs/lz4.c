@@ -0,0 +1,70 @@
+// LZ4 block format decompression, for compressed files (FILE_LZ4);
+// fsformat does the compressing.  A block is a series of sequences,
+// each a token byte, whose high nibble is a literal count and low
+// nibble a match length less LZ4_MINMATCH, then the literals, then a
+// two-byte little-endian offset back into the output to copy the match
+// from.  A nibble of 15 continues in the bytes that follow, each added
+// in until one is less than 255.  The last sequence stops after its
+// literals.
+
+#include "fs.h"
+
+#define LZ4_MINMATCH	4
+
+// Read a length continued past its nibble at *pp, not beyond end.
+static int
+lz4_len(const uint8_t **pp, const uint8_t *end, uint32_t n)
+{
+	uint8_t b;
+
+	do {
+		if (*pp >= end)
+			return -E_INVAL;
+		b = *(*pp)++;
+		n += b;
+	} while (b == 255);
+	return n;
+}
+
+// Decompress the srclen bytes at src into dst, which has room for
+// dstlen.  Returns the number of bytes decompressed, or -E_INVAL if
+// src is not a well-formed block or does not fit.
+int
+lz4_decompress(const void *src, size_t srclen, void *dst, size_t dstlen)
+{
+	const uint8_t *ip = src, *iend = ip + srclen, *match;
+	uint8_t *op = dst, *oend = op + dstlen;
+	uint32_t token;
+	int n;
+
+	while (ip < iend) {
+		token = *ip++;
+		n = token >> 4;
+		if (n == 15 && (n = lz4_len(&ip, iend, n)) < 0)
+			return n;
+		if (n > iend - ip || n > oend - op)
+			return -E_INVAL;
+		memmove(op, ip, n);
+		ip += n;
+		op += n;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -E_INVAL;
+		match = op - (ip[0] | (ip[1] << 8));
+		ip += 2;
+		if (match == op || match < (uint8_t *) dst)
+			return -E_INVAL;
+		n = token & 15;
+		if (n == 15 && (n = lz4_len(&ip, iend, n)) < 0)
+			return n;
+		n += LZ4_MINMATCH;
+		if (n > oend - op)
+			return -E_INVAL;
+		// byte by byte: the match may overlap what it produces
+		while (n-- > 0)
+			*op++ = *match++;
+	}
+	return op - (uint8_t *) dst;
+}
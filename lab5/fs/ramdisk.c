@@ -0,0 +1,78 @@
+// A RAM disk: the whole IDE disk, read into memory at boot when the
+// file server is built with FS_RAMDISK ("make FS_RAMDISK=1").  The file
+// system then runs on it just as on the IDE disk, block cache and all,
+// but nothing is ever written back to the IDE disk, so changes are lost
+// at shutdown.  Meant for scratch data, tests, and measuring the file
+// server without the disk.
+
+#include "fs.h"
+
+// The RAM disk's blocks, in order, and the most there is room for
+#define RAMDISKVA	0xD8000000
+#define RAMDISKMAX	(0x08000000 / BLKSIZE)
+
+static uint32_t ramdisk_nblocks;
+
+static void *
+ramdisk_addr(uint32_t blockno)
+{
+	return (char *) RAMDISKVA + blockno * BLKSIZE;
+}
+
+// Read the IDE disk into memory and switch to it.  Returns true if the
+// file server now runs on the RAM disk, false (having said why) if it
+// stays on the IDE disk.
+bool
+ramdisk_load(void)
+{
+	struct Super *s;
+	uint32_t b, n, nblocks;
+	int r;
+
+	// The super block says how much there is to read.
+	if ((r = sys_page_alloc(0, ramdisk_addr(1), PTE_P|PTE_U|PTE_W)) < 0)
+		goto fail;
+	if ((r = ide_read(BLKSECTS, ramdisk_addr(1), BLKSECTS)) < 0)
+		goto fail;
+	s = ramdisk_addr(1);
+	if (s->s_magic != FS_MAGIC || s->s_nblocks > RAMDISKMAX) {
+		r = -E_INVAL;
+		goto fail;
+	}
+	nblocks = s->s_nblocks;
+
+	for (b = 0; b < nblocks; b += n) {
+		n = MIN(nblocks - b, BIO_MAXRUN);
+		for (ramdisk_nblocks = b; ramdisk_nblocks < b + n; ramdisk_nblocks++)
+			if (ramdisk_nblocks != 1
+			    && (r = sys_page_alloc(0, ramdisk_addr(ramdisk_nblocks),
+						   PTE_P|PTE_U|PTE_W)) < 0)
+				goto fail;
+		if ((r = ide_read(b * BLKSECTS, ramdisk_addr(b), n * BLKSECTS)) < 0)
+			goto fail;
+	}
+	ramdisk = 1;
+	cprintf("RAM disk: %d blocks\n", ramdisk_nblocks);
+	return 1;
+
+fail:
+	cprintf("RAM disk: %e, using the IDE disk\n", r);
+	for (b = 0; b < MAX(ramdisk_nblocks, 2); b++)
+		sys_page_unmap(0, ramdisk_addr(b));
+	ramdisk_nblocks = 0;
+	return 0;
+}
+
+// Move nblocks blocks from blockno between the RAM disk and their block
+// cache pages.  Returns 0 on success, < 0 on error.
+int
+ramdisk_rw(uint32_t blockno, uint32_t nblocks, bool write)
+{
+	if (blockno >= ramdisk_nblocks || nblocks > ramdisk_nblocks - blockno)
+		return -E_INVAL;
+	if (write)
+		memmove(ramdisk_addr(blockno), diskaddr(blockno), nblocks * BLKSIZE);
+	else
+		memmove(diskaddr(blockno), ramdisk_addr(blockno), nblocks * BLKSIZE);
+	return 0;
+}
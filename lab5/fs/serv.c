@@ -28,25 +28,93 @@
 //    communicate with the server.  File IDs are a lot like
 //    environment IDs in the kernel.  Use openfile_lookup to translate
 //    file IDs to struct OpenFile.
+//
+// A file is open for as long as a client has its Fd page mapped, so an
+// entry comes free without the server being told.  Free entries are
+// kept on a list.  Closing a file flushes it, which puts its entry on
+// the closing list, to be checked at the next openfile_alloc: it is
+// free if the Fd page is no longer mapped anywhere but here.  Entries
+// whose last client went away without closing them (by exiting, say)
+// are only found when the free list runs dry, by a sweep of the table.
 
 struct OpenFile {
 	uint32_t o_fileid;	// file id
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	int o_state;		// OPEN_FREE, OPEN_USED or OPEN_CLOSING
+	struct OpenFile *o_link;	// next on the free or closing list
+};
+
+enum {
+	OPEN_FREE = 0,
+	OPEN_USED,
+	OPEN_CLOSING,
 };
 
-// Max number of open files in the file system at once
-#define MAXOPEN		1024
 #define FILEVA		0xD0000000
 
 // initialize to force into data section
 struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
+struct OpenFile *openfile_free;
+struct OpenFile *openfile_closing;
+
+// Virtual address at which to receive page mappings containing client
+// requests.  Requests may carry up to FSREQ_MAXPAGES pages, which land
+// just below the disk map.
+union Fsipc *fsreq = (union Fsipc *)(DISKMAP - FSREQ_MAXPAGES*PGSIZE);
+
+// Request rings (see struct Fsring in inc/fs.h) set up by clients,
+// each mapped at its own FSRING_NPAGES-page stretch from RINGVA.
+struct Ring {
+	envid_t r_envid;	// owning client, or 0 if free
+	struct Fsring *r_ring;
+};
+
+#define MAXRING		64
+#define RINGVA		0xE0000000
+
+// Pages for FSREQ_READV replies are staged here, then given away.
+#define READVVA		0xE8000000
+
+struct Ring ringtab[MAXRING];
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// The server runs NWORKER threads (see sys_thread_create), each serving
+// the clients that picked it (see fs_worker in lib/file.c) from a
+// receive area and staging area of its own.  Everything else is shared,
+// under fs_lock: a read whose blocks are all cached holds it shared, so
+// that reads of cached data run in parallel (serve_read_fast), and any
+// other request holds it exclusively.  Worker 0 is the server's main
+// thread, with fsreq and READVVA; the others have WORKERSIZE bytes each
+// from WORKERVA, for those two areas and their stacks.
+#define NWORKER		4
+#define WORKERVA	0xEA000000
+#define WORKERSIZE	(4 * FSREQ_MAXPAGES * PGSIZE)
+#define WSTACKPAGES	4
+
+struct Worker {
+	const volatile struct Env *w_env;
+	union Fsipc *w_req;	// where requests are received
+	char *w_stage;		// where reply pages are staged
+	// statistics of the requests this worker served (see serve_stats)
+	struct Fsreqstat w_stat[FSSTAT_NTYPE];
+	uint64_t w_bytesread;
+	uint64_t w_byteswritten;
+};
+
+struct Worker workers[NWORKER];
+struct Rwlock fs_lock;
+
+// Request statistics are counted by each worker for itself, without
+// the lock, and summed by serve_stats, so they are only approximate
+// while other requests are being served.  While tracing is on, every
+// request also goes in the trace ring, the slot claimed atomically.
+uint64_t stats_since;
+bool tracing;
+volatile uint32_t trace_next;
+struct Fstrace trace_ring[FSTRACE_N];
 
 void
 serve_init(void)
@@ -58,29 +126,73 @@ serve_init(void)
 		opentab[i].o_fd = (struct Fd*) va;
 		va += PGSIZE;
 	}
+	for (i = MAXOPEN - 1; i >= 0; i--) {
+		opentab[i].o_state = OPEN_FREE;
+		opentab[i].o_link = openfile_free;
+		openfile_free = &opentab[i];
+	}
+	for (i = 0; i < MAXRING; i++)
+		ringtab[i].r_ring =
+			(struct Fsring*) (RINGVA + i * FSRING_NPAGES * PGSIZE);
+	workers[0].w_req = fsreq;
+	workers[0].w_stage = (char*) READVVA;
+	for (i = 1; i < NWORKER; i++) {
+		workers[i].w_req = (union Fsipc*) (WORKERVA + (i - 1) * WORKERSIZE);
+		workers[i].w_stage = (char*) workers[i].w_req + FSREQ_MAXPAGES * PGSIZE;
+	}
+	stats_since = read_tsc();
+}
+
+// Put o on the free list if no client has its Fd page any more.
+static void
+openfile_reclaim(struct OpenFile *o)
+{
+	o->o_state = OPEN_USED;
+	if (pageref(o->o_fd) <= 1) {
+		o->o_state = OPEN_FREE;
+		o->o_link = openfile_free;
+		openfile_free = o;
+	}
+}
+
+// Note that o may have just been closed (see above).
+void
+openfile_closed(struct OpenFile *o)
+{
+	if (o->o_state != OPEN_USED)
+		return;
+	o->o_state = OPEN_CLOSING;
+	o->o_link = openfile_closing;
+	openfile_closing = o;
 }
 
 // Allocate an open file.
 int
 openfile_alloc(struct OpenFile **o)
 {
+	struct OpenFile *of;
 	int i, r;
 
-	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_fd)) {
-		case 0:
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			/* fall through */
-		case 1:
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
-		}
+	while ((of = openfile_closing) != NULL) {
+		openfile_closing = of->o_link;
+		openfile_reclaim(of);
 	}
-	return -E_MAX_OPEN;
+	if (!openfile_free)
+		for (i = 0; i < MAXOPEN; i++)
+			if (opentab[i].o_state == OPEN_USED)
+				openfile_reclaim(&opentab[i]);
+	if ((of = openfile_free) == NULL)
+		return -E_MAX_OPEN;
+
+	if (pageref(of->o_fd) == 0
+	    && (r = sys_page_alloc(0, of->o_fd, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	openfile_free = of->o_link;
+	of->o_state = OPEN_USED;
+	of->o_fileid += MAXOPEN;
+	memset(of->o_fd, 0, PGSIZE);
+	*o = of;
+	return of->o_fileid;
 }
 
 // Look up an open file for envid.
@@ -90,7 +202,7 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	struct OpenFile *o;
 
 	o = &opentab[fileid % MAXOPEN];
-	if (pageref(o->o_fd) == 1 || o->o_fileid != fileid)
+	if (pageref(o->o_fd) <= 1 || o->o_fileid != fileid)
 		return -E_INVAL;
 	*po = o;
 	return 0;
@@ -124,16 +236,33 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	}
 	fileid = r;
 
-	if (req->req_omode != 0) {
-		if (debug)
-			cprintf("file_open omode 0x%x unsupported", req->req_omode);
-		return -E_INVAL;
+	// Open the file
+	if (req->req_omode & O_CREAT) {
+		if ((r = file_create(path, &f)) < 0) {
+			if (!(req->req_omode & O_EXCL) && r == -E_FILE_EXISTS)
+				goto try_open;
+			if (debug)
+				cprintf("file_create failed: %e", r);
+			return r;
+		}
+		if (req->req_omode & O_MKDIR)
+			f->f_type = FTYPE_DIR;
+	} else {
+try_open:
+		if ((r = file_open(path, &f)) < 0) {
+			if (debug)
+				cprintf("file_open failed: %e", r);
+			return r;
+		}
 	}
 
-	if ((r = file_open(path, &f)) < 0) {
-		if (debug)
-			cprintf("file_open failed: %e", r);
-		return r;
+	// Truncate
+	if (req->req_omode & O_TRUNC) {
+		if ((r = file_set_size(f, 0)) < 0) {
+			if (debug)
+				cprintf("file_set_size failed: %e", r);
+			return r;
+		}
 	}
 
 	// Save the file pointer
@@ -157,6 +286,25 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 }
 
 
+// Set the size of req->req_fileid to req->req_size bytes, truncating
+// or extending the file as necessary.
+int
+serve_set_size(envid_t envid, struct Fsreq_set_size *req)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_set_size %08x %08x %08x\n", envid, req->req_fileid, req->req_size);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+
+	return file_set_size(o->o_file, req->req_size);
+}
+
 // Read at most ipc->read.req_n bytes from the current seek position
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
@@ -192,6 +340,141 @@ serve_read(envid_t envid, union Fsipc *ipc)
 }
 
 
+// Read at most req->req_n bytes from the current seek position, like
+// serve_read, but into fresh pages at stage that the reply hands over
+// to the client; up to FSREQ_MAXPAGES pages go in one round trip.
+// Stores the first page in *pg_store and the page count in
+// *npages_store.  Returns the number of bytes read, or < 0 on error.
+int
+serve_readv(envid_t envid, struct Fsreq_read *req, char *stage,
+	    void **pg_store, int *npages_store)
+{
+	struct OpenFile *o;
+	size_t n;
+	int i, r;
+
+	if (debug)
+		cprintf("serve_readv %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	n = MIN(req->req_n, FSREQ_MAXPAGES * PGSIZE);
+	for (i = 0; i < n; i += PGSIZE)
+		if ((r = sys_page_alloc(0, stage + i, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	if ((r = file_read(o->o_file, stage, n, o->o_fd->fd_offset)) < 0)
+		return r;
+
+	o->o_fd->fd_offset += r;
+	*pg_store = stage;
+	*npages_store = ROUNDUP(r, PGSIZE) / PGSIZE;
+	return r;
+}
+
+// Give the client the data at the current seek position without
+// copying it, if we can: when the block holding that position lies
+// wholly within the file, reply with a read-only mapping of the block
+// cache page itself (in *pg_store and *perm_store) and return the
+// number of bytes from the position to the end of the block.
+// Otherwise (the partial last block), copy at most req->req_n bytes
+// into ipc->readRet as serve_read would, and return the count.
+// Either way the seek position is left alone; the client advances it
+// as it consumes the data.
+int
+serve_read_map(envid_t envid, union Fsipc *ipc, void **pg_store, int *perm_store)
+{
+	struct Fsreq_read *req = &ipc->read;
+	struct OpenFile *o;
+	off_t off;
+	char *blk;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_map %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	off = o->o_fd->fd_offset;
+	if (off < 0 || off >= o->o_file->f_size)
+		return 0;
+	if (ROUNDDOWN(off, BLKSIZE) + BLKSIZE <= o->o_file->f_size) {
+		if ((r = file_get_block(o->o_file, off / BLKSIZE, &blk)) < 0)
+			return r;
+		// fault the block in so there is a page to send
+		*(volatile char *) blk;
+		*pg_store = blk;
+		*perm_store = PTE_P|PTE_U;
+		return BLKSIZE - off % BLKSIZE;
+	}
+	return file_read(o->o_file, ipc->readRet.ret_buf,
+			 MIN(req->req_n, sizeof ipc->readRet.ret_buf), off);
+}
+
+// Map the file data at req->req_offset, which must be block aligned,
+// for a client's mmap.  If the blocks from there on lie wholly within
+// the file, reply with read-only mappings of the run of them that are
+// consecutive on disk (so consecutive in the block cache), at most
+// req->req_npages.  The partial last block is copied into a fresh page
+// at stage, whose tail past the end of file is zero, and a hole in the
+// file is sent as a fresh page of zeroes.  Stores the first
+// page in *pg_store and the page count in *npages_store.  Returns the
+// number of pages, 0 at or past the end of file, or < 0 on error.
+int
+serve_map(envid_t envid, struct Fsreq_map *req, char *stage,
+	  void **pg_store, int *npages_store)
+{
+	struct OpenFile *o;
+	struct File *f;
+	uint32_t bno, diskbno, max;
+	int i, r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x %d\n", envid, req->req_fileid,
+			req->req_offset, req->req_npages);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	f = o->o_file;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE != 0
+	    || req->req_npages <= 0)
+		return -E_INVAL;
+	if (req->req_offset >= f->f_size)
+		return 0;
+
+	bno = req->req_offset / BLKSIZE;
+	max = MIN(req->req_npages, FSREQ_MAXPAGES);
+	max = MIN(max, f->f_size / BLKSIZE - bno);
+	if (max == 0) {
+		if ((r = sys_page_alloc(0, stage, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		if ((r = file_read(f, stage, BLKSIZE, req->req_offset)) < 0)
+			return r;
+		*pg_store = stage;
+		*npages_store = 1;
+		return 1;
+	}
+
+	if ((r = file_map_run(f, bno, max, &diskbno)) < 0)
+		return r;
+	if (r == 0) {
+		if ((r = sys_page_alloc(0, stage, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		*pg_store = stage;
+		*npages_store = 1;
+		return 1;
+	}
+	bc_lookup(diskaddr(diskbno));
+	file_readahead(f, bno, max);
+	// fault the blocks in so there are pages to send
+	for (i = 0; i < r; i++)
+		*(volatile char *) diskaddr(diskbno + i);
+	*pg_store = diskaddr(diskbno);
+	*npages_store = r;
+	return r;
+}
 
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
 // caller in ipc->statRet.
@@ -216,13 +499,353 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 }
 
 
-// Our read-only file system do nothing for flush
+// Write req->req_n bytes from req->req_buf to req_fileid, starting at
+// the current seek position, and update the seek position
+// accordingly.  Extend the file if necessary.  Returns the number of
+// bytes written, or < 0 on error.
+int
+serve_write(envid_t envid, struct Fsreq_write *req)
+{
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_write %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((o->o_mode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+
+	if ((r = file_write(o->o_file, req->req_buf,
+			    MIN(req->req_n, sizeof req->req_buf),
+			    o->o_fd->fd_offset)) < 0)
+		return r;
+
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Set the cache and disk controls as serve_cache describes and store
+// the statistics of them all in *st.
+static void
+serve_control(struct Fsreq_cache *req, struct Fscache *st)
+{
+	bc_control(req->req_budget, req->req_writethrough, st);
+	pathcache_control(req->req_pathcache, st);
+	ide_control(req->req_dma, st);
+	bio_control(st);
+	journal_control(st);
+}
+
+// Set the block cache budget to ipc->cache.req_budget, unless that is
+// 0, the write policy to ipc->cache.req_writethrough and the path
+// cache on or off by ipc->cache.req_pathcache, unless those are -1,
+// and return the cache statistics in ipc->cacheRet.
+int
+serve_cache(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_cache req = ipc->cache;
+
+	if (debug)
+		cprintf("serve_cache %08x %08x %d %d %d\n", envid, req.req_budget,
+			req.req_writethrough, req.req_pathcache, req.req_dma);
+
+	serve_control(&req, &ipc->cacheRet);
+	return 0;
+}
+
+// Return the request statistics, summed over the workers, and the
+// cache statistics in ipc->statsRet, or the trace ring in
+// ipc->traceRet if ipc->stats.req_dump.  Then turn tracing on or off
+// by ipc->stats.req_trace, unless it is -1, and start counting afresh
+// if ipc->stats.req_reset.
+int
+serve_stats(envid_t envid, union Fsipc *ipc)
+{
+	static struct Fsreq_cache keep = { 0, -1, -1, -1 };
+	struct Fsreq_stats req = ipc->stats;
+	struct Fsstats *st = &ipc->statsRet;
+	struct Fsreqstat *rs, *ws;
+	int i, t, b;
+
+	if (debug)
+		cprintf("serve_stats %08x %d %d %d\n", envid, req.req_dump,
+			req.req_trace, req.req_reset);
+
+	if (req.req_dump) {
+		ipc->traceRet.tr_next = trace_next;
+		memmove(ipc->traceRet.tr_ring, trace_ring, sizeof trace_ring);
+	} else {
+		memset(st, 0, sizeof *st);
+		st->st_since = stats_since;
+		st->st_now = read_tsc();
+		for (i = 0; i < NWORKER; i++) {
+			st->st_bytesread += workers[i].w_bytesread;
+			st->st_byteswritten += workers[i].w_byteswritten;
+			for (t = 0; t < FSSTAT_NTYPE; t++) {
+				rs = &st->st_req[t];
+				ws = &workers[i].w_stat[t];
+				rs->rs_count += ws->rs_count;
+				rs->rs_errors += ws->rs_errors;
+				rs->rs_cycles += ws->rs_cycles;
+				for (b = 0; b < FSSTAT_NBUCKET; b++)
+					rs->rs_hist[b] += ws->rs_hist[b];
+			}
+		}
+		serve_control(&keep, &st->st_cache);
+	}
+
+	if (req.req_trace >= 0)
+		tracing = req.req_trace;
+	if (req.req_reset) {
+		for (i = 0; i < NWORKER; i++) {
+			memset(workers[i].w_stat, 0, sizeof workers[i].w_stat);
+			workers[i].w_bytesread = workers[i].w_byteswritten = 0;
+		}
+		trace_next = 0;
+		stats_since = read_tsc();
+	}
+	return 0;
+}
+
+// Read the entries of directory ipc->readdir.req_fileid from byte
+// offset req_offset on, packed as struct Dirents into ipc->readdirRet
+// (at most req_n bytes of them), and return where the next read should
+// start in ret_next.  The seek position is left alone.  Returns the
+// number of bytes of entries, 0 at the end, or < 0 on error.
+int
+serve_readdir(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_readdir req = ipc->readdir;
+	struct Fsret_readdir *ret = &ipc->readdirRet;
+	struct OpenFile *o;
+	uint32_t n;
+	int r;
+
+	if (debug)
+		cprintf("serve_readdir %08x %08x %08x\n", envid, req.req_fileid,
+			req.req_offset);
+
+	if ((r = openfile_lookup(envid, req.req_fileid, &o)) < 0)
+		return r;
+	if (req.req_offset < 0 || req.req_offset % sizeof(struct File) != 0)
+		return -E_INVAL;
+
+	n = req.req_offset / sizeof(struct File);
+	r = file_readdir(o->o_file, &n, ret->ret_buf,
+			 MIN(req.req_n, sizeof ret->ret_buf));
+	ret->ret_next = n * sizeof(struct File);
+	return r;
+}
+
+// Flush all data and metadata of req->req_fileid to disk.
 int
 serve_flush(envid_t envid, struct Fsreq_flush *req)
 {
+	struct OpenFile *o;
+	int r;
+
+	if (debug)
+		cprintf("serve_flush %08x %08x\n", envid, req->req_fileid);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	file_flush(o->o_file);
+	// clients flush on close
+	openfile_closed(o);
+	return 0;
+}
+
+// Remove the file req->req_path.
+int
+serve_remove(envid_t envid, struct Fsreq_remove *req)
+{
+	char path[MAXPATHLEN];
+
+	if (debug)
+		cprintf("serve_remove %08x %s\n", envid, req->req_path);
+
+	// Copy in the path, making sure it's null-terminated
+	memmove(path, req->req_path, MAXPATHLEN);
+	path[MAXPATHLEN-1] = 0;
+
+	return file_remove(path);
+}
+
+// Send up to req_n bytes of ipc->sendfile.req_fileid from req_offset,
+// or from the seek position, moving it, if req_offset < 0.  If the
+// client sent a second, writable page (one of a pipe's, say), the data
+// is read straight into it at req_pgoff, up to the end of the page;
+// if it sent the request page alone, the data is for the console.
+// Then its block cache pages are mapped in order at stage, which keeps
+// them should they be evicted, and *cons_store points at the data
+// there, for the caller to write out once it has dropped fs_lock.
+// Returns the number of bytes sent, 0 at end of file, or < 0 on error.
+int
+serve_sendfile(envid_t envid, union Fsipc *ipc, int npages, int perm,
+	       char *stage, char **cons_store)
+{
+	struct Fsreq_sendfile req = ipc->sendfile;
+	struct OpenFile *o;
+	struct File *f;
+	off_t off;
+	size_t n, tot;
+	char *blk;
+	int i, r;
+
+	if (debug)
+		cprintf("serve_sendfile %08x %08x %08x %08x %d\n", envid,
+			req.req_fileid, req.req_offset, req.req_n, npages);
+
+	if ((r = openfile_lookup(envid, req.req_fileid, &o)) < 0)
+		return r;
+	f = o->o_file;
+	off = req.req_offset < 0 ? o->o_fd->fd_offset : req.req_offset;
+	if (off < 0)
+		return -E_INVAL;
+
+	if (npages == 2) {
+		if (!(perm & PTE_W) || req.req_pgoff >= PGSIZE)
+			return -E_INVAL;
+		r = file_read(f, (char *) ipc + PGSIZE + req.req_pgoff,
+			      MIN(req.req_n, PGSIZE - req.req_pgoff), off);
+		if (r < 0)
+			return r;
+	} else if (npages == 1) {
+		if (off >= f->f_size)
+			return 0;
+		n = MIN(req.req_n, f->f_size - off);
+		n = MIN(n, FSREQ_MAXPAGES * PGSIZE - off % BLKSIZE);
+		file_prefetch(f, off, n);
+		bio_drain();
+		for (i = 0, tot = 0; tot < n; i++, tot += BLKSIZE) {
+			if ((r = file_get_block(f, off / BLKSIZE + i, &blk)) < 0)
+				break;
+			// fault the block in so there is a page to map
+			*(volatile char *) blk;
+			if ((r = sys_page_map(0, blk, 0, stage + i * PGSIZE,
+					      PTE_P|PTE_U)) < 0)
+				break;
+		}
+		if (i == 0)
+			return r;
+		r = MIN(n, i * BLKSIZE - off % BLKSIZE);
+		*cons_store = stage + off % BLKSIZE;
+	} else
+		return -E_INVAL;
+
+	if (req.req_offset < 0)
+		o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Write back every dirty block.
+int
+serve_sync(envid_t envid, union Fsipc *req)
+{
+	fs_sync();
+	return 0;
+}
+
+// Map the FSRING_NPAGES pages the client sent, received at req, as its
+// request ring, replacing any ring it had before.  Rings of clients
+// that have exited are reclaimed as needed.
+int
+serve_ring_setup(envid_t envid, union Fsipc *req, int npages)
+{
+	struct Ring *rg = NULL;
+	const volatile struct Env *e;
+	int i, r;
+
+	if (debug)
+		cprintf("serve_ring_setup %08x %d\n", envid, npages);
+
+	if (npages != FSRING_NPAGES)
+		return -E_INVAL;
+
+	for (i = 0; i < MAXRING; i++) {
+		e = &envs[ENVX(ringtab[i].r_envid)];
+		if (ringtab[i].r_envid == envid) {
+			rg = &ringtab[i];
+			break;
+		}
+		if (!rg && (ringtab[i].r_envid == 0
+			    || e->env_id != ringtab[i].r_envid
+			    || e->env_status == ENV_FREE))
+			rg = &ringtab[i];
+	}
+	if (!rg)
+		return -E_MAX_OPEN;
+
+	rg->r_envid = 0;
+	for (i = 0; i < FSRING_NPAGES; i++)
+		if ((r = sys_page_map(0, (char*) req + i*PGSIZE,
+				      0, (char*) rg->r_ring + i*PGSIZE,
+				      PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	rg->r_envid = envid;
 	return 0;
 }
 
+// Complete every submitted request on envid's ring.  Returns the
+// number of bytes of file data read.
+int
+serve_ring_kick(envid_t envid)
+{
+	struct Fsring *ring = NULL;
+	struct Fsring_slot *s;
+	struct OpenFile *o;
+	union Fsipc *data;
+	int i, r, ndone = 0, nread = 0;
+
+	for (i = 0; i < MAXRING; i++)
+		if (ringtab[i].r_envid == envid)
+			ring = ringtab[i].r_ring;
+	if (!ring)
+		return 0;
+
+	// Clear the kick flag first: anything submitted from now on
+	// either gets picked up below or sends another kick.
+	xchg(&ring->r_kicked, 0);
+	// Queue the disk reads of every read request first, so they reach
+	// the disk sorted and merged, not one at a time in slot order.
+	for (i = 0; i < FSRING_NSLOT; i++) {
+		s = &ring->r_slot[i];
+		if (s->s_state == FSRING_SUBMITTED && s->s_type == FSREQ_READ
+		    && openfile_lookup(envid, s->s_fileid, &o) >= 0)
+			file_prefetch(o->o_file, s->s_offset, MIN(s->s_n, PGSIZE));
+	}
+	bio_drain();
+	for (i = 0; i < FSRING_NSLOT; i++) {
+		s = &ring->r_slot[i];
+		if (s->s_state != FSRING_SUBMITTED)
+			continue;
+		data = (union Fsipc*) ((char*) ring + (1 + i) * PGSIZE);
+		if (s->s_type == FSREQ_READ) {
+			if ((r = openfile_lookup(envid, s->s_fileid, &o)) >= 0)
+				r = file_read(o->o_file, data,
+					      MIN(s->s_n, PGSIZE), s->s_offset);
+			if (r > 0)
+				nread += r;
+		} else if (s->s_type == FSREQ_STAT) {
+			data->stat.req_fileid = s->s_fileid;
+			r = serve_stat(envid, data);
+		} else
+			r = -E_INVAL;
+		s->s_ret = r;
+		// results must be in place before the slot says so
+		__asm __volatile("" : : : "memory");
+		s->s_state = FSRING_DONE;
+		ndone++;
+	}
+	if (ndone) {
+		xchg(&ring->r_done, ring->r_done + 1);
+		sys_futex_wake(&ring->r_done, NENV);
+	}
+	return nread;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -231,24 +854,169 @@ fshandler handlers[] = {
 	[FSREQ_READ] =		serve_read,
 	[FSREQ_STAT] =		serve_stat,
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
+	[FSREQ_WRITE] =		(fshandler)serve_write,
+	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_REMOVE] =	(fshandler)serve_remove,
+	[FSREQ_CACHE] =		serve_cache,
+	[FSREQ_READDIR] =	serve_readdir,
+	[FSREQ_STATS] =		serve_stats,
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Serve FSREQ_READ or FSREQ_READV, received by worker w, with fs_lock
+// held shared, if the blocks it reads are all cached: see serve_read
+// and serve_readv.  Returns -E_AGAIN if the request must be served the
+// usual way after all.
+int
+serve_read_fast(struct Worker *w, envid_t envid, uint32_t type,
+		void **pg_store, int *npages_store)
+{
+	uint32_t fileid = w->w_req->read.req_fileid;
+	struct OpenFile *o;
+	off_t off;
+	size_t n;
+	char *buf;
+	int i, r;
+
+	if (type == FSREQ_READ) {
+		n = MIN(w->w_req->read.req_n, sizeof w->w_req->readRet.ret_buf);
+		buf = w->w_req->readRet.ret_buf;
+	} else {
+		n = MIN(w->w_req->read.req_n, FSREQ_MAXPAGES * PGSIZE);
+		buf = w->w_stage;
+		for (i = 0; i < n; i += PGSIZE)
+			if ((r = sys_page_alloc(0, buf + i, PTE_P|PTE_U|PTE_W)) < 0)
+				return r;
+	}
+
+	rwlock_rdlock(&fs_lock);
+	if ((r = openfile_lookup(envid, fileid, &o)) < 0)
+		goto out;
+	// Other readers of a shared Fd may move the position under us:
+	// if one did, read again from the new one.
+	do {
+		off = o->o_fd->fd_offset;
+		if ((r = file_read_cached(o->o_file, buf, n, off)) < 0)
+			goto out;
+	} while (cmpxchg((volatile uint32_t *) &o->o_fd->fd_offset,
+			 off, off + r) != (uint32_t) off);
+	if (type == FSREQ_READV) {
+		*pg_store = buf;
+		*npages_store = ROUNDUP(r, PGSIZE) / PGSIZE;
+	}
+out:
+	rwlock_unlock(&fs_lock);
+	return r;
+}
+
+// Dirty blocks are written back by fs_sync whenever the server has
+// been idle for SYNC_TICKS timer ticks, and at least every SYNC_REQS
+// requests when it is kept busy; in write-through mode, after every
+// request that can dirty a block.  Worker 0 keeps the idle timer.  On
+// a disk with a journal, each fs_sync is one commit, grouping every
+// change since the last, and one is also made as soon as the cache
+// fills up with dirty blocks.
+#define SYNC_TICKS	100
+#define SYNC_REQS	512
+
+static uint32_t nreq;
+
+// Count a request of the given type from envid, which arrived at TSC
+// start, got reply r and moved nbytes of file data, in worker w's
+// statistics, and in the trace ring if tracing.
+static void
+serve_account(struct Worker *w, uint32_t type, envid_t envid, int r,
+	      uint64_t start, uint32_t nbytes)
+{
+	uint64_t cycles = read_tsc() - start, c;
+	struct Fsreqstat *rs;
+	struct Fstrace *t;
+	int b;
+
+	if (type >= FSSTAT_NTYPE)
+		type = 0;
+	rs = &w->w_stat[type];
+	rs->rs_count++;
+	if (r < 0)
+		rs->rs_errors++;
+	rs->rs_cycles += cycles;
+	for (b = 0, c = cycles >> FSSTAT_MINLOG; c && b < FSSTAT_NBUCKET - 1; b++)
+		c >>= 1;
+	rs->rs_hist[b]++;
+	if (type == FSREQ_WRITE)
+		w->w_byteswritten += nbytes;
+	else
+		w->w_bytesread += nbytes;
+
+	if (!tracing)
+		return;
+	t = &trace_ring[xadd(&trace_next, 1) % FSTRACE_N];
+	t->t_start = start;
+	t->t_cycles = MIN(cycles, ~0U);
+	t->t_type = type;
+	t->t_envid = envid;
+	t->t_result = r;
+}
+
+// ipc_recvv_timeout for worker w, which cannot use the library's: that
+// finds the results in thisenv, the main thread's Env.
+static int32_t
+serve_recv(struct Worker *w, envid_t *whom, int *npages, int *perm,
+	   uint32_t timeout)
+{
+	int r;
+
+	*whom = 0;
+	*perm = 0;
+	if ((r = sys_ipc_recvv(w->w_req, *npages, timeout)) < 0) {
+		*npages = 0;
+		return r;
+	}
+	*whom = w->w_env->env_ipc_from;
+	*perm = w->w_env->env_ipc_perm;
+	*npages = w->w_env->env_ipc_npages;
+	return w->w_env->env_ipc_value;
+}
+
 void
-serve(void)
+serve(struct Worker *w)
 {
-	uint32_t req, whom;
-	int perm, r;
+	uint32_t req, whom, nbytes;
+	int perm, r, i, npages, npg;
+	union Fsipc *fsreq = w->w_req;
+	uint64_t start;
 	void *pg;
+	char *cons;
+	bool locked, wrote;
 
+	w->w_env = &envs[ENVX(sys_getenvid())];
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		npages = FSREQ_MAXPAGES;
+		req = serve_recv(w, (envid_t *) &whom, &npages, &perm,
+				 w == &workers[0] ? SYNC_TICKS : 0);
+		if (req == -E_TIMEOUT) {
+			rwlock_wrlock(&fs_lock);
+			fs_sync();
+			nreq = 0;
+			rwlock_unlock(&fs_lock);
+			continue;
+		}
+		start = read_tsc();
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
-		// All requests must contain an argument page
+		// Kicks carry no page and get no reply
+		if (req == FSREQ_RING_KICK) {
+			rwlock_wrlock(&fs_lock);
+			r = serve_ring_kick(whom);
+			rwlock_unlock(&fs_lock);
+			serve_account(w, req, whom, 0, start, r);
+			continue;
+		}
+
+		// All other requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
@@ -256,17 +1024,111 @@ serve(void)
 		}
 
 		pg = NULL;
+		cons = NULL;
+		npg = 1;
+		locked = 0;
+		if ((req == FSREQ_READ || req == FSREQ_READV)
+		    && (r = serve_read_fast(w, whom, req, &pg, &npg)) != -E_AGAIN) {
+			perm = PTE_P|PTE_U|PTE_W;
+			goto reply;
+		}
+
+		rwlock_wrlock(&fs_lock);
+		locked = 1;
 		if (req == FSREQ_OPEN) {
 			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+		} else if (req == FSREQ_READ_MAP) {
+			r = serve_read_map(whom, fsreq, &pg, &perm);
+		} else if (req == FSREQ_READV) {
+			r = serve_readv(whom, &fsreq->read, w->w_stage, &pg, &npg);
+			perm = PTE_P|PTE_U|PTE_W;
+		} else if (req == FSREQ_MAP) {
+			r = serve_map(whom, &fsreq->map, w->w_stage, &pg, &npg);
+			perm = PTE_P|PTE_U;
+		} else if (req == FSREQ_RING_SETUP) {
+			r = serve_ring_setup(whom, fsreq, npages);
+		} else if (req == FSREQ_SENDFILE) {
+			r = serve_sendfile(whom, fsreq, npages, perm, w->w_stage,
+					   &cons);
 		} else if (req < NHANDLERS && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		wrote = (req == FSREQ_OPEN || req == FSREQ_WRITE
+			 || req == FSREQ_SET_SIZE || req == FSREQ_REMOVE);
+		if (bc_writethrough && wrote) {
+			fs_sync();
+			nreq = 0;
+		} else if (++nreq >= SYNC_REQS || journal_wanted(wrote)) {
+			fs_sync();
+			nreq = 0;
+		}
+		// A page of our own (an Fd page, a cache block) must not be
+		// reused or evicted before the client has it.
+		if (!pg || pg == w->w_stage) {
+			rwlock_unlock(&fs_lock);
+			locked = 0;
+		}
+		// Console output from serve_sendfile is written only now, so
+		// that a slow console does not hold up the other workers.
+		if (cons) {
+			sys_cputs(cons, r);
+			for (i = 0; i < FSREQ_MAXPAGES; i++)
+				sys_page_unmap(0, w->w_stage + i*PGSIZE);
+		}
+
+reply:
+		if (req == FSREQ_READV && npg == 0)
+			pg = NULL;
+		ipc_sendv(whom, r, pg, npg, perm);
+		if (locked)
+			rwlock_unlock(&fs_lock);
+		nbytes = 0;
+		if (r > 0 && (req == FSREQ_READ || req == FSREQ_READV
+			      || req == FSREQ_READ_MAP || req == FSREQ_SENDFILE
+			      || req == FSREQ_WRITE))
+			nbytes = r;
+		else if (r > 0 && req == FSREQ_MAP)
+			nbytes = r * PGSIZE;
+		serve_account(w, req, whom, r, start, nbytes);
+		for (i = 0; i < npages; i++)
+			sys_page_unmap(0, (char*) fsreq + i*PGSIZE);
+		// Staged pages now belong to the client.  Those it did not
+		// take, at end of file or after an error, are dropped too.
+		if (pg == w->w_stage || req == FSREQ_READV || req == FSREQ_MAP)
+			for (i = 0; i < FSREQ_MAXPAGES; i++)
+				sys_page_unmap(0, w->w_stage + i*PGSIZE);
+	}
+}
+
+// Start workers 1 to NWORKER - 1, each on its own stacks at the top of
+// its WORKERSIZE bytes.  A worker that cannot be started is done
+// without: its clients go to the others.
+void
+serve_start_workers(void)
+{
+	uintptr_t top, va;
+	uint32_t *sp;
+	int i, r;
+
+	for (i = 1; i < NWORKER; i++) {
+		top = WORKERVA + i * WORKERSIZE;
+		for (va = top - (WSTACKPAGES + 1) * PGSIZE; va < top; va += PGSIZE)
+			if ((r = sys_page_alloc(0, (void*) va, PTE_P|PTE_U|PTE_W)) < 0)
+				goto fail;
+		// the exception stack is the top page, the stack below it
+		sp = (uint32_t*) (top - PGSIZE);
+		*--sp = (uint32_t) &workers[i];
+		*--sp = 0;		// serve never returns
+		if ((r = sys_thread_create((void*) serve, sp, (void*) top)) < 0)
+			goto fail;
 	}
+	return;
+
+fail:
+	cprintf("FS worker %d: %e\n", i, r);
 }
 
 void
@@ -282,6 +1144,6 @@ umain(int argc, char **argv)
 
 	serve_init();
 	fs_init();
-	serve();
+	serve_start_workers();
+	serve(&workers[0]);
 }
-
@@ -59,6 +59,7 @@ struct Env {
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_xstacktop;	// Top of the user exception stack
 
 	// Lab 4 IPC
 	bool env_ipc_recving;		// Env is blocked receiving
@@ -66,6 +67,12 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	int env_ipc_npages;		// Receive window, then pages received
+
+	// Futex wait
+	physaddr_t env_futex_key;	// Futex we are blocked on, or 0
+	uint32_t env_futex_deadline;	// Tick at which the wait times out, or 0
+
 	int priority;
 };
 
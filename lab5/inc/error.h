@@ -26,6 +26,9 @@ enum {
 	E_NOT_EXEC	= 14,	// File not a valid executable
 	E_NOT_SUPP	= 15,	// Operation not supported
 
+	E_AGAIN		= 16,	// Value changed; try again
+	E_TIMEOUT	= 17,	// Wait timed out
+
 	MAXERROR
 };
 
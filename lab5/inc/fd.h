@@ -21,6 +21,24 @@ struct Dev {
 	int (*dev_close)(struct Fd *fd);
 	int (*dev_stat)(struct Fd *fd, struct Stat *stat);
 	int (*dev_trunc)(struct Fd *fd, off_t length);
+
+	// Optional direct buffer access, used by copyfd() to copy data
+	// once, straight between two devices.  dev_rbuf waits for data and
+	// points *buf at up to len contiguous readable bytes, returning
+	// the count (0 at eof); dev_consume then retires n of them.
+	// dev_wbuf/dev_commit are the same for free space (dev_wbuf
+	// returns 0 if no one will ever read what is written).
+	ssize_t (*dev_rbuf)(struct Fd *fd, const void **buf, size_t len);
+	void (*dev_consume)(struct Fd *fd, size_t n);
+	ssize_t (*dev_wbuf)(struct Fd *fd, void **buf, size_t len);
+	void (*dev_commit)(struct Fd *fd, size_t n);
+
+	// Optional, used by sendfile(): deliver up to len bytes from
+	// offset (from the position, moving it, if offset < 0) without
+	// the caller copying them, straight into dst, which must lie in
+	// a shared page of another device's (see dev_wbuf), or to the
+	// console if dst is NULL.  Returns the count, 0 at eof.
+	ssize_t (*dev_send)(struct Fd *fd, off_t offset, void *dst, size_t len);
 };
 
 struct FdFile {
@@ -44,11 +62,15 @@ struct Stat {
 	struct Dev *st_dev;
 };
 
+// Maximum number of file descriptors a program may hold open concurrently
+#define MAXFD		32
+
 char*	fd2data(struct Fd *fd);
 int	fd2num(struct Fd *fd);
 int	fd_alloc(struct Fd **fd_store);
 int	fd_close(struct Fd *fd, bool must_exist);
 int	fd_lookup(int fdnum, struct Fd **fd_store);
+bool	fd_intable(struct Fd *fd);
 int	dev_lookup(int devid, struct Dev **dev_store);
 
 extern struct Dev devfile;
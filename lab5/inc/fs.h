@@ -19,6 +19,9 @@
 // Maximum size of a complete pathname, including null
 #define MAXPATHLEN	1024
 
+// Max number of open files in the file system at once
+#define MAXOPEN		4096
+
 // Number of block pointers in a File descriptor
 #define NDIRECT		10
 // Number of direct block pointers in an indirect block
@@ -26,6 +29,32 @@
 
 #define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
 
+// Files created since extents came in map their blocks with extents
+// instead, runs of consecutive disk blocks, kept in file block order
+// in a B+tree f_extdepth levels deep.  At depth 0 the extents are the
+// NFEXTENT entries in the File itself.  Above that, those entries, and
+// the entries of all but the bottom level of blocks, are index entries
+// for a block of up to NEXTBLK entries one level down: e_fileblk is the
+// first file block that block covers (the first entry of a list covers
+// everything before the second), e_diskblk is the block and e_len the
+// number of entries in it.
+struct Extent {
+	uint32_t e_fileblk;		// first file block mapped
+	uint32_t e_diskblk;		// disk block it is in
+	uint32_t e_len;			// blocks mapped
+};
+
+#define NFEXTENT	4
+#define NEXTBLK		(BLKSIZE / sizeof(struct Extent))
+#define EXT_MAXDEPTH	3
+
+// Biggest extent-mapped file.  f_size is a signed 32-bit count.
+#define MAXEXTFILESIZE	0x40000000
+
+// File flags
+#define FILE_EXTENTS	0x1	// f_extent maps the file, not f_direct
+#define FILE_LZ4	0x2	// blocks stored compressed; see struct Zblock
+
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
@@ -36,9 +65,19 @@ struct File {
 	uint32_t f_direct[NDIRECT];	// direct blocks
 	uint32_t f_indirect;		// indirect block
 
+	// Directories only: the block holding the header of the hashed
+	// name index (struct Dirindex), or 0 if there is none.
+	uint32_t f_dirindex;
+
+	uint32_t f_flags;		// FILE_* flags
+	uint32_t f_extdepth;		// levels of extent index blocks
+	uint32_t f_nextent;		// entries in use in f_extent
+	struct Extent f_extent[NFEXTENT];
+
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4 - 4 - 12
+		      - sizeof(struct Extent)*NFEXTENT];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -48,6 +87,39 @@ struct File {
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
 
+// Hashed directory index, after ext3's htree.  A directory's entries
+// are still a plain array of struct File, which is all that code
+// ignoring the index needs to see.  The index is an open-addressed
+// hash table, probed linearly from dirhash(name), whose slots hold the
+// number of the entry with that name plus 1 (entry n is File
+// n % BLKFILES of directory block n / BLKFILES), or DI_EMPTY, or
+// DI_DELETED.  The table is di_nslots slots long, a power of 2, laid
+// out DI_SLOTSPERBLK to a block in the blocks di_blocks[] lists.
+#define DI_MAGIC	0x48545245	// 'HTRE'
+#define DI_EMPTY	0
+#define DI_DELETED	0xFFFFFFFF
+#define DI_SLOTSPERBLK	(BLKSIZE / 4)
+#define DI_NBLOCKS	(BLKSIZE / 4 - 3)
+#define DI_MINBLOCKS	2		// smallest directory given an index
+
+struct Dirindex {
+	uint32_t di_magic;		// DI_MAGIC
+	uint32_t di_nslots;		// table size
+	uint32_t di_nused;		// slots not DI_EMPTY
+	uint32_t di_blocks[DI_NBLOCKS];	// table blocks
+};
+
+// FNV-1a hash of a file name, for the directory index.
+static inline uint32_t
+dirhash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619;
+	return h;
+}
+
 
 // File system super-block (both in-memory and on-disk)
 
@@ -57,8 +129,46 @@ struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_nzblocks;		// compressed blocks, numbered from s_nblocks
+	uint32_t s_zmap;		// first block of their struct Zblocks
+	uint32_t s_journal;		// first block of the journal, or 0
+	uint32_t s_njournal;		// blocks in the journal
+};
+
+// Write-ahead journal for metadata (see fs/journal.c).  Block s_journal
+// holds a struct Jheader describing the last transaction committed, if
+// it has not been checkpointed yet: copies of its jh_nblocks blocks are
+// in the blocks after the header, in order, and jh_blocks[] says where
+// each belongs.  jh_sum covers the list and the copies, so that a torn
+// header is not replayed.
+#define JH_MAGIC	0x4C4E524A	// 'JRNL'
+#define JH_MAXBLOCKS	(BLKSIZE / 4 - 4)
+
+struct Jheader {
+	uint32_t jh_magic;		// JH_MAGIC
+	uint32_t jh_seq;		// transaction number
+	uint32_t jh_nblocks;		// 0 if there is nothing to replay
+	uint32_t jh_sum;
+	uint32_t jh_blocks[JH_MAXBLOCKS];
 };
 
+// fsformat can store a regular file's blocks LZ4 compressed (FILE_LZ4).
+// The file's single extent then maps its blocks to block numbers from
+// s_nblocks up, which are not on the disk: the block cache fills them
+// by decompressing, and never writes them back.  Compressed block
+// s_nblocks + i is entry i of the block map in the blocks from s_zmap:
+// z_len bytes at byte z_off of disk block z_blockno, running on into
+// the next disk block if need be, or the block as is if z_len is
+// BLKSIZE.  A file's compressed data is packed into consecutive disk
+// blocks, in file block order.  A compressed file that is written to
+// gets ordinary blocks first; its compressed data stays allocated.
+struct Zblock {
+	uint32_t z_blockno;
+	uint16_t z_off;
+	uint16_t z_len;
+};
+#define NZBLOCK		(BLKSIZE / sizeof(struct Zblock))
+
 // Definitions for requests from clients to file system
 enum {
 	FSREQ_OPEN = 1,
@@ -70,7 +180,145 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Ring setup sends the FSRING_NPAGES pages of a struct Fsring
+	FSREQ_RING_SETUP,
+	// Kick carries no page and gets no reply; see struct Fsring
+	FSREQ_RING_KICK,
+	// Readv takes a Fsreq_read and replies with the data as a run
+	// of up to FSREQ_MAXPAGES fresh pages
+	FSREQ_READV,
+	// Read-map takes a Fsreq_read; see serve_read_map
+	FSREQ_READ_MAP,
+	// Map takes a Fsreq_map and replies with up to req_npages
+	// read-only block cache pages; see serve_map
+	FSREQ_MAP,
+	// Cache takes a Fsreq_cache and returns a struct Fscache on the
+	// request page
+	FSREQ_CACHE,
+	// Readdir takes a Fsreq_readdir and returns a Fsret_readdir on the
+	// request page
+	FSREQ_READDIR,
+	// Stats takes a Fsreq_stats and returns a struct Fsstats, or a
+	// Fsret_trace, on the request page
+	FSREQ_STATS,
+	// Sendfile takes a Fsreq_sendfile, and may send a second page for
+	// the data; see serve_sendfile
+	FSREQ_SENDFILE
+};
+
+// A directory entry as FSREQ_READDIR returns it.  Entries are packed
+// one after another, each taking DIRENT_SIZE(d_namelen) bytes: d_name
+// is only as long as the name and its null.
+struct Dirent {
+	off_t d_size;
+	uint8_t d_type;			// FTYPE_REG or FTYPE_DIR
+	uint8_t d_namelen;		// strlen(d_name)
+	char d_name[MAXNAMELEN];
+};
+#define DIRENT_SIZE(namelen) \
+	ROUNDUP(offsetof(struct Dirent, d_name) + (namelen) + 1, sizeof(off_t))
+
+
+// Block cache budget and statistics
+struct Fscache {
+	uint32_t c_budget;		// most blocks kept in memory
+	uint32_t c_resident;		// blocks in memory now
+	uint32_t c_hits;		// file block lookups found in memory
+	uint32_t c_misses;		// blocks read in on a page fault
+	uint32_t c_prefetched;		// blocks read ahead of use
+	uint32_t c_evictions;
+	uint32_t c_writebacks;		// dirty blocks written out
+	uint32_t c_writethrough;	// 1 if writes are synced at once
+	uint32_t c_pathcache;		// 1 if the path lookup cache is on
+	uint32_t c_pathhits;		// path components found in it
+	uint32_t c_pathmisses;
+	uint32_t c_ramdisk;		// 1 if running on a RAM disk
+	uint32_t c_dma;			// 1 if disk transfers use DMA
+	uint32_t c_dmacmds;		// disk commands done by DMA
+	uint32_t c_piocmds;		// and by PIO
+	uint32_t c_irqwaits;		// sleeps for a DMA completion
+	uint32_t c_bios;		// block I/O requests queued
+	uint32_t c_biocmds;		// disk commands they were merged into
+	uint32_t c_biodeadlines;	// commands started out of elevator order
+	uint32_t c_zfills;		// compressed blocks decompressed
+	uint32_t c_commits;		// journal transactions committed
+	uint32_t c_journaled;		// blocks written to the journal
+	uint32_t c_faults;		// block cache page faults
+	uint32_t c_sectread;		// IDE sectors read
+	uint32_t c_sectwritten;		// and written
+};
+
+// File server statistics for FSREQ_STATS.  Each request type, indexed
+// by FSREQ_* (0 for requests of no known type), gets a count and a
+// histogram of its latencies, in TSC cycles from arrival to reply:
+// bucket i counts requests that took less than 2^(FSSTAT_MINLOG + i)
+// cycles but, after bucket 0, at least half that.  The last bucket
+// also counts everything longer.
+#define FSSTAT_NTYPE	(FSREQ_SENDFILE + 1)
+#define FSSTAT_NBUCKET	16
+#define FSSTAT_MINLOG	10
+
+struct Fsreqstat {
+	uint32_t rs_count;
+	uint32_t rs_errors;		// replies < 0
+	uint64_t rs_cycles;		// total latency
+	uint32_t rs_hist[FSSTAT_NBUCKET];
+};
+
+struct Fsstats {
+	uint64_t st_since;		// TSC when counting began
+	uint64_t st_now;		// TSC at the reply
+	uint64_t st_bytesread;		// file data served
+	uint64_t st_byteswritten;	// and written
+	struct Fscache st_cache;
+	struct Fsreqstat st_req[FSSTAT_NTYPE];
+};
+
+// An entry in the file server's ring of recent requests, recorded
+// while tracing is on
+#define FSTRACE_N	128
+
+struct Fstrace {
+	uint64_t t_start;		// TSC on arrival
+	uint32_t t_cycles;		// latency
+	uint32_t t_type;		// FSREQ_*
+	int32_t t_envid;		// client
+	int32_t t_result;		// reply value
+};
+
+// Most pages the server accepts with a single request
+#define FSREQ_MAXPAGES	16
+
+// Asynchronous request ring, shared between one client and the server.
+// The client fills a free slot and marks it FSRING_SUBMITTED; if
+// r_kicked was clear it sets it and sends FSREQ_RING_KICK.  The server
+// clears r_kicked, then completes every submitted slot, marks them
+// FSRING_DONE, bumps r_done and wakes any futex sleepers on it.
+// The ring is followed by one data page per slot, which receives the
+// data of a FSREQ_READ or the Fsret_stat of a FSREQ_STAT.
+#define FSRING_NSLOT	8
+#define FSRING_NPAGES	(1 + FSRING_NSLOT)
+
+enum {
+	FSRING_FREE = 0,
+	FSRING_SUBMITTED,
+	FSRING_DONE
+};
+
+struct Fsring_slot {
+	volatile uint32_t s_state;
+	int s_type;			// FSREQ_READ or FSREQ_STAT
+	int s_fileid;
+	off_t s_offset;			// reads: file offset (fd_offset is untouched)
+	size_t s_n;			// reads: bytes wanted, at most PGSIZE
+	int32_t s_ret;			// result once FSRING_DONE
+};
+
+struct Fsring {
+	volatile uint32_t r_kicked;	// a kick is pending
+	volatile uint32_t r_done;	// bumped after each batch of completions
+	struct Fsring_slot r_slot[FSRING_NSLOT];
 };
 
 union Fsipc {
@@ -108,6 +356,44 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;	// block aligned
+		int req_npages;
+	} map;
+	struct Fsreq_cache {
+		uint32_t req_budget;	// new budget in blocks, 0 to keep it
+		int req_writethrough;	// new write policy, -1 to keep it
+		int req_pathcache;	// path cache on or off, -1 to keep it
+		int req_dma;		// DMA on or off, -1 to keep it
+	} cache;
+	struct Fscache cacheRet;
+	struct Fsreq_readdir {
+		int req_fileid;
+		off_t req_offset;	// entry to start at, as a byte offset
+		size_t req_n;		// room for entries, in bytes
+	} readdir;
+	struct Fsret_readdir {
+		off_t ret_next;		// offset of the entry after the last
+		char ret_buf[PGSIZE - sizeof(off_t)];	// struct Dirents
+	} readdirRet;
+	struct Fsreq_stats {
+		int req_dump;		// return the trace ring, not the counts
+		int req_trace;		// tracing on or off, -1 to keep it
+		int req_reset;		// then start counting afresh
+	} stats;
+	struct Fsstats statsRet;
+	struct Fsret_trace {
+		uint32_t tr_next;	// requests ever recorded; the oldest
+					// entry is at tr_next % FSTRACE_N
+		struct Fstrace tr_ring[FSTRACE_N];
+	} traceRet;
+	struct Fsreq_sendfile {
+		int req_fileid;
+		off_t req_offset;	// < 0 for the seek position, which moves
+		size_t req_n;
+		uint32_t req_pgoff;	// where the data goes in the second page
+	} sendfile;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
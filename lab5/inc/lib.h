@@ -58,6 +58,15 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_try_sendv(envid_t to_env, uint32_t value, void *pg, int npages,
+			  int perm);
+int	sys_ipc_recvv(void *rcv_pg, int npages, uint32_t timeout);
+int	sys_futex_wait(const volatile uint32_t *addr, uint32_t expected,
+		       uint32_t timeout);
+int	sys_futex_wake(const volatile uint32_t *addr, int n);
+int	sys_irq_forward(int irq, volatile uint32_t *counter);
+int	sys_page_phys(void *va, int npages, physaddr_t *pa);
+envid_t	sys_thread_create(void *eip, void *esp, void *xstacktop);
 
 int sys_raid2_init(void);
 int sys_raid2_add(int num, int* a);
@@ -80,10 +89,16 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void	ipc_sendv(envid_t to_env, uint32_t value, void *pg, int npages, int perm);
+int32_t ipc_recvv(envid_t *from_env_store, void *pg, int *npages, int *perm_store);
+int32_t ipc_recvv_timeout(envid_t *from_env_store, void *pg, int *npages,
+			  int *perm_store, uint32_t timeout);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
 #define	PTE_SHARE	0x400
+#define	PTE_COW		0x800	// copy-on-write; also one of the PTE_AVAIL bits
+void	pgfault_init(void);
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
 
@@ -97,12 +112,35 @@ ssize_t	readn(int fd, void *buf, size_t nbytes);
 int	dup(int oldfd, int newfd);
 int	fstat(int fd, struct Stat *statbuf);
 int	stat(const char *path, struct Stat *statbuf);
+ssize_t	copyfd(int fdin, int fdout, size_t n);
+ssize_t	sendfile(int fdout, int fdin, off_t offset, size_t n);
 
 // file.c
 int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
+ssize_t	readpages(int fd, void *dstva, size_t n);
+ssize_t	readdir(int fd, void *buf, size_t n);
+int	fsmap(int fileid, off_t offset, void *dstva, int npages);
+int	fscache(uint32_t budget, int writethrough, int pathcache, int dma,
+		struct Fscache *st);
+int	fsstats(int reset, int trace, struct Fsstats *st);
+int	fstrace(struct Fsret_trace *tr);
 int	remove(const char *path);
 int	sync(void);
+int	fsa_read(int fd, void *buf, size_t n, off_t offset);
+int	fsa_stat(int fd, struct Stat *st);
+int	fsa_poll(int tag);
+int	fsa_wait(int tag);
+
+// mmap.c
+#define	PROT_READ	0x1
+#define	PROT_WRITE	0x2
+#define	MAP_SHARED	0x1
+#define	MAP_PRIVATE	0x2
+int	mmap(int fd, off_t offset, size_t len, int prot, int flags, void **va_store);
+int	munmap(void *va);
+void	munmap_all(void);
+int	mmap_fault(void *addr, uint32_t err);
 
 // pageref.c
 int	pageref(void *addr);
@@ -127,6 +165,42 @@ int	pipeisclosed(int pipefd);
 // wait.c
 void	wait(envid_t env);
 
+// sync.c
+// These may live in a PTE_SHARE page to synchronize several environments.
+struct Mutex {
+	volatile uint32_t m_state;	// 0 free, 1 locked, 2 locked + waiters
+};
+struct Cond {
+	volatile uint32_t c_seq;	// Bumped on every signal
+};
+struct Sem {
+	volatile uint32_t s_count;
+	volatile uint32_t s_nwaiters;
+};
+struct Rwlock {
+	volatile uint32_t rw_state;	// Readers holding it, or RW_WRITER
+	volatile uint32_t rw_writers;	// Writers waiting for it
+	volatile uint32_t rw_seq;	// Bumped whenever it comes free
+	volatile uint32_t rw_nwaiters;
+};
+#define RW_WRITER	0x80000000
+void	mutex_init(struct Mutex *m);
+void	mutex_lock(struct Mutex *m);
+int	mutex_trylock(struct Mutex *m);
+void	mutex_unlock(struct Mutex *m);
+void	cond_init(struct Cond *c);
+int	cond_wait(struct Cond *c, struct Mutex *m, uint32_t timeout);
+void	cond_signal(struct Cond *c);
+void	cond_broadcast(struct Cond *c);
+void	sem_init(struct Sem *s, uint32_t count);
+int	sem_wait(struct Sem *s, uint32_t timeout);
+int	sem_trywait(struct Sem *s);
+void	sem_post(struct Sem *s);
+void	rwlock_init(struct Rwlock *rw);
+void	rwlock_rdlock(struct Rwlock *rw);
+void	rwlock_wrlock(struct Rwlock *rw);
+void	rwlock_unlock(struct Rwlock *rw);
+
 /* File open modes */
 #define	O_RDONLY	0x0000		/* open for reading only */
 #define	O_WRONLY	0x0001		/* open for writing only */
@@ -137,6 +137,20 @@
 #define PFTEMP		(UTEMP + PTSIZE - PGSIZE)
 // The location of the user-level STABS data structure
 #define USTABDATA	(PTSIZE / 2)
+// exec stages the new program's segments, then its stack, from here up
+// in the calling environment, and sys_exec moves them into place
+#define DTEMP		0x80000000
+// mmap() places regions in [MMAPBASE, MMAPTOP), which must stay clear
+// of DTEMP: an environment with live mappings may call exec
+#define MMAPBASE	0x40000000
+#define MMAPTOP		DTEMP
+#if MMAPTOP > DTEMP
+#error "the mmap window overlaps exec's staging area"
+#endif
+// Programs may map pages of their own in [UPRIVBASE, UPRIVTOP), which
+// no library code uses; exec's staging area ends below it
+#define UPRIVBASE	0x90000000
+#define UPRIVTOP	0xC0000000
 
 // Physical address of startup code for non-boot CPUs (APs)
 #define MPENTRY_PADDR	0x7000
@@ -23,6 +23,13 @@ enum {
 	SYS_raid2_add,
 	SYS_raid2_change,
 	SYS_raid2_check,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_ipc_try_sendv,
+	SYS_ipc_recvv,
+	SYS_irq_forward,
+	SYS_page_phys,
+	SYS_thread_create,
 	NSYSCALLS
 };
 
@@ -293,4 +293,38 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Atomically: if *addr == expected, set it to newval.
+// Returns the old value of *addr.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t expected, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1" :
+			"=a" (result), "+m" (*addr) :
+			"r" (newval), "0" (expected) :
+			"cc", "memory");
+	return result;
+}
+
+// Atomically add 'delta' to *addr.  Returns the old value of *addr.
+static inline uint32_t
+xadd(volatile uint32_t *addr, uint32_t delta)
+{
+	asm volatile("lock; xaddl %0, %1" :
+			"+r" (delta), "+m" (*addr) :
+			: "cc", "memory");
+	return delta;
+}
+
+// Return the index of the lowest set bit in 'word', which must not be 0.
+static inline uint32_t
+bsf(uint32_t word)
+{
+	uint32_t index;
+
+	asm("bsfl %1, %0" : "=r" (index) : "rm" (word) : "cc");
+	return index;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -14,6 +14,7 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -278,10 +279,15 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_xstacktop = UXSTACKTOP;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
+	// And any stale futex wait.
+	e->env_futex_key = 0;
+	e->env_futex_deadline = 0;
+
 	// commit the allocation
 	env_free_list = e->env_link;
 	*newenv_store = e;
@@ -452,6 +458,15 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// Threads sharing the address space (see sys_thread_create) leave
+	// it to the last of them to go.
+	pa = PADDR(e->env_pgdir);
+	if (pa2page(pa)->pp_ref > 1) {
+		e->env_pgdir = 0;
+		page_decref(pa2page(pa));
+		goto done;
+	}
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -480,10 +495,14 @@ env_free(struct Env *e)
 	e->env_pgdir = 0;
 	page_decref(pa2page(pa));
 
+done:
 	// return the environment to the free list
 	e->env_status = ENV_FREE;
 	e->env_link = env_free_list;
 	env_free_list = e;
+
+	// Wake anyone sleeping in wait() on this environment.
+	futex_wake_key(PADDR(&e->env_status), NENV);
 }
 
 //
@@ -567,6 +586,9 @@ env_run(struct Env *e)
 	curenv->env_status = ENV_RUNNING ;
 	curenv->env_runs++;
 	lcr3(PADDR(curenv->env_pgdir));
+	// From here on, other CPUs changing this address space must
+	// shoot down our TLB entries (see tlb_shootdown).
+	thiscpu->cpu_inuser = 1;
 	unlock_kernel();
 	env_pop_tf(&curenv->env_tf);
 //	panic("env_run not yet implemented");
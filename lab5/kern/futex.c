@@ -0,0 +1,168 @@
+// Futexes: block an environment until a word in memory changes.
+//
+// A futex is named by the physical address of the word, so two
+// environments that share a page (e.g. through PTE_SHARE) see the
+// same futex even when they map the page at different addresses.
+// Waiters are simply marked ENV_NOT_RUNNABLE with env_futex_key set;
+// the big kernel lock serializes everything here.
+
+#include <inc/error.h>
+#include <inc/memlayout.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/pmap.h>
+#include <kern/futex.h>
+
+// Timer ticks since boot, counted on the boot CPU.
+static uint32_t futex_ticks;
+// Upper bound on the number of waiters with a timeout pending.
+static uint32_t futex_ntimed;
+
+// Translate a user address in e's address space into a futex key.
+// Returns 0 if the address is not a valid, aligned, user-readable word.
+static physaddr_t
+futex_key(struct Env *e, const volatile uint32_t *addr)
+{
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	if ((uintptr_t) addr & 3)
+		return 0;
+	if (user_mem_check(e, (const void *) addr, sizeof(*addr), PTE_U) < 0)
+		return 0;
+	if ((pp = page_lookup(e->env_pgdir, (void *) addr, &pte)) == NULL)
+		return 0;
+	return page2pa(pp) + PGOFF(addr);
+}
+
+// Make a sleeping environment runnable, with 'result' as the return
+// value of its sys_futex_wait (or of its timed-out sys_ipc_recvv).
+static void
+futex_wakeup(struct Env *e, int32_t result)
+{
+	e->env_futex_key = 0;
+	e->env_futex_deadline = 0;
+	e->env_ipc_recving = 0;
+	e->env_tf.tf_regs.reg_eax = result;
+	e->env_status = ENV_RUNNABLE;
+}
+
+uint32_t
+futex_now(void)
+{
+	return futex_ticks;
+}
+
+// Have futex_tick wake 'e', which is about to block in a futex wait or
+// an IPC receive, with -E_TIMEOUT once 'timeout' ticks have passed.
+// 0 means never.
+void
+futex_set_timeout(struct Env *e, uint32_t timeout)
+{
+	e->env_futex_deadline = 0;
+	if (timeout) {
+		// Deadline 0 means "none", so nudge a wrapped deadline.
+		e->env_futex_deadline = (futex_ticks + timeout) ? : 1;
+		futex_ntimed++;
+	}
+}
+
+// Block 'e' (which must be curenv) until a futex_wake on 'addr', as
+// long as *addr still equals 'expected'.  'timeout' is in timer ticks;
+// 0 means wait forever.  If 'e' blocks, this does not return: the
+// result (0 on wakeup, -E_TIMEOUT on timeout) is delivered in eax.
+int
+futex_wait(struct Env *e, const volatile uint32_t *addr,
+	   uint32_t expected, uint32_t timeout)
+{
+	physaddr_t key;
+
+	if ((key = futex_key(e, addr)) == 0)
+		return -E_INVAL;
+	// The page is mapped in the current address space, so this
+	// read cannot fault.
+	if (*addr != expected)
+		return -E_AGAIN;
+
+	e->env_futex_key = key;
+	futex_set_timeout(e, timeout);
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_status = ENV_NOT_RUNNABLE;
+	return 0;
+}
+
+// Wake up to 'n' environments waiting on 'key'.
+// Returns the number of environments woken.
+int
+futex_wake_key(physaddr_t key, int n)
+{
+	int i, woken = 0;
+
+	for (i = 0; i < NENV && woken < n; i++) {
+		if (envs[i].env_status != ENV_NOT_RUNNABLE
+		    || envs[i].env_futex_key != key)
+			continue;
+		futex_wakeup(&envs[i], 0);
+		woken++;
+	}
+	return woken;
+}
+
+// Wake every environment waiting on any futex in the physical page 'pa'.
+int
+futex_wake_page(physaddr_t pa)
+{
+	int i, woken = 0;
+
+	for (i = 0; i < NENV; i++) {
+		if (envs[i].env_status != ENV_NOT_RUNNABLE
+		    || envs[i].env_futex_key == 0
+		    || PTE_ADDR(envs[i].env_futex_key) != pa)
+			continue;
+		futex_wakeup(&envs[i], 0);
+		woken++;
+	}
+	return woken;
+}
+
+int
+futex_wake(struct Env *e, const volatile uint32_t *addr, int n)
+{
+	physaddr_t key;
+
+	if (n < 0)
+		return -E_INVAL;
+	if ((key = futex_key(e, addr)) == 0)
+		return -E_INVAL;
+	return futex_wake_key(key, n);
+}
+
+// Called on every timer interrupt on the boot CPU.
+// Advances the clock and times out expired waiters.
+void
+futex_tick(void)
+{
+	int i;
+	uint32_t ntimed = 0;
+
+	futex_ticks++;
+	if (futex_ntimed == 0)
+		return;
+	for (i = 0; i < NENV; i++) {
+		if (envs[i].env_futex_deadline == 0)
+			continue;
+		if (envs[i].env_status != ENV_NOT_RUNNABLE
+		    || (envs[i].env_futex_key == 0 && !envs[i].env_ipc_recving)) {
+			// Woken some other way; forget the deadline.
+			envs[i].env_futex_deadline = 0;
+			continue;
+		}
+		if ((int32_t) (futex_ticks - envs[i].env_futex_deadline) < 0) {
+			ntimed++;
+			continue;
+		}
+		futex_wakeup(&envs[i], -E_TIMEOUT);
+	}
+	futex_ntimed = ntimed;
+}
@@ -0,0 +1,21 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/env.h>
+
+int futex_wait(struct Env *e, const volatile uint32_t *addr,
+	       uint32_t expected, uint32_t timeout);
+int futex_wake(struct Env *e, const volatile uint32_t *addr, int n);
+int futex_wake_key(physaddr_t key, int n);
+int futex_wake_page(physaddr_t pa);
+void futex_tick(void);
+uint32_t futex_now(void);
+void futex_set_timeout(struct Env *e, uint32_t timeout);
+
+#endif	// !JOS_KERN_FUTEX_H
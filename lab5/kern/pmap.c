@@ -76,6 +76,7 @@ static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static void tlb_shootdown(pde_t *pgdir);
 
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
@@ -497,7 +498,11 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 //		PageInfo* now_page = (PageInfo*) pa2page(PTE_ADDR(now) + PGOFF(va));
 //		page_remove(now_page);
 		if (PTE_ADDR(*now) == page2pa(pp)) {
+			// same page, new permissions; this also clears the
+			// accessed and dirty bits, so drop any TLB entry that
+			// would keep the processor from setting them again
 			*now = PTE_ADDR(page2pa(pp)) | perm | PTE_P;
+			tlb_invalidate(pgdir, va);
 			return 0;
 		}
 //		cprintf("%d\n", *now);
@@ -580,6 +585,32 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+	// Threads may be running in it on other CPUs too.
+	if (pgdir != kern_pgdir && pa2page(PADDR(pgdir))->pp_ref > 1)
+		tlb_shootdown(pgdir);
+}
+
+// Flush the TLBs of the other CPUs running user code on pgdir, a page
+// directory shared by threads (see sys_thread_create), and wait until
+// they have.  CPUs in the kernel are left alone: they reload cr3 once
+// they have the big kernel lock (see trap), before they touch user
+// memory, and again on the way back to user mode.
+static void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct CpuInfo *c;
+	uint32_t acks;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || !c->cpu_inuser || !c->cpu_env
+		    || c->cpu_env->env_pgdir != pgdir)
+			continue;
+		acks = c->cpu_tlbacks;
+		lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_TLB);
+		// done when it answers, or traps into the kernel first
+		while (c->cpu_inuser && c->cpu_tlbacks == acks)
+			asm volatile("pause");
+	}
 }
 
 //
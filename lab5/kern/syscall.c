@@ -12,7 +12,7 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
-#define DTEMP 0x80000000 
+#include <kern/futex.h>
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
 // Destroys the environment on memory errors.
@@ -120,6 +120,7 @@ sys_env_set_status(envid_t envid, int status)
 	int r = envid2env(envid, &e, 1);
 	if (r < 0) return -E_BAD_ENV;
 	e->env_status = status;
+	e->env_futex_key = 0;
 	return 0;
 //	panic("sys_env_set_status not implemented");
 }
@@ -328,11 +329,62 @@ sys_page_unmap(envid_t envid, void *va)
 		return -E_BAD_ENV;
 	if ((uint32_t)va >= UTOP || ROUNDUP(va, PGSIZE) != va) 
 		return -E_INVAL;
+	pte_t *pte;
+	struct PageInfo *pp = page_lookup(e->env_pgdir, va, &pte);
+	bool shared = pp && pp->pp_ref > 1;
 	page_remove(e->env_pgdir, va);
+	// Dropping a mapping of a shared page changes its reference count,
+	// which user code (e.g. pipeisclosed) may be sleeping on.
+	if (shared)
+		futex_wake_page(page2pa(pp));
 	return 0;
 //	panic("sys_page_unmap not implemented");
 }
 
+// Like sys_ipc_try_send, but sends the 'npages' consecutive pages
+// starting at 'srcva'.  The receiver gets as many of them as fit in
+// the window it passed to sys_ipc_recvv, mapped consecutively, and
+// env_ipc_npages is set to the number actually mapped.
+// All the pages are checked before any is mapped.
+static int
+sys_ipc_try_sendv(envid_t envid, uint32_t value, void *srcva, int npages,
+		  unsigned perm)
+{
+	struct Env *e;
+	struct PageInfo *pg;
+	pte_t *pte;
+	int i, n = 0;
+	int r = envid2env(envid, &e, 0);
+	if (r) return r;
+	if (!e->env_ipc_recving || e->env_ipc_from != 0) return -E_IPC_NOT_RECV;
+	if (srcva < (void*)UTOP) {
+		if (srcva != ROUNDDOWN(srcva, PGSIZE)) return -E_INVAL;
+		if (npages < 1 || npages > (UTOP - (uintptr_t) srcva) / PGSIZE)
+			return -E_INVAL;
+		for (i = 0; i < npages; i++) {
+			pg = page_lookup(curenv->env_pgdir, srcva + i * PGSIZE, &pte);
+			if (!pg) return -E_INVAL;
+			if ((*pte & perm & 7) != (perm & 7)) return -E_INVAL;
+			if ((perm & PTE_W) && !(*pte & PTE_W)) return -E_INVAL;
+		}
+		if (e->env_ipc_dstva < (void*)UTOP)
+			n = MIN(npages, e->env_ipc_npages);
+		for (i = 0; i < n; i++) {
+			pg = page_lookup(curenv->env_pgdir, srcva + i * PGSIZE, NULL);
+			r = page_insert(e->env_pgdir, pg, e->env_ipc_dstva + i * PGSIZE, perm);
+			if (r) return r;
+		}
+	}
+	e->env_ipc_recving = 0;
+	e->env_ipc_from = curenv->env_id;
+	e->env_ipc_value = value;
+	e->env_ipc_perm = n ? perm : 0;
+	e->env_ipc_npages = n;
+	e->env_status = ENV_RUNNABLE;
+	e->env_tf.tf_regs.reg_eax = 0;
+	return 0;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -374,32 +426,7 @@ sys_page_unmap(envid_t envid, void *va)
 static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
-	// LAB 4: Your code here.
-	struct Env *e;
-        int r = envid2env(envid, &e, 0);
-        if (r) return r;
-        if (!e->env_ipc_recving || e->env_ipc_from != 0) return -E_IPC_NOT_RECV;
-        if (srcva < (void*)UTOP) {
-                pte_t *pte;
-                struct PageInfo *pg = page_lookup(curenv->env_pgdir, srcva, &pte);
-                if (!pg) return -E_INVAL;
-                if ((*pte & perm & 7) != (perm & 7)) return -E_INVAL;
-                if ((perm & PTE_W) && !(*pte & PTE_W)) return -E_INVAL;
-                if (srcva != ROUNDDOWN(srcva, PGSIZE)) return -E_INVAL;
-                if (e->env_ipc_dstva < (void*)UTOP) {
-                        r = page_insert(e->env_pgdir, pg, e->env_ipc_dstva, perm);
-                        if (r) return r;
-                        e->env_ipc_perm = perm;
-                }
-        }
-        e->env_ipc_recving = 0;
-        e->env_ipc_from = curenv->env_id;
-        e->env_ipc_value = value; 
-        e->env_status = ENV_RUNNABLE;
-        e->env_tf.tf_regs.reg_eax = 0;
-//		cprintf("----!1-----\n");
-        return 0;
-	//panic("sys_ipc_try_send not implemented");
+	return sys_ipc_try_sendv(envid, value, srcva, 1, perm);
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -413,15 +440,34 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+static int sys_ipc_recvv(void *dstva, int npages, uint32_t timeout);
+
 static int
 sys_ipc_recv(void *dstva)
+{
+	return sys_ipc_recvv(dstva, 1, 0);
+}
+
+// Like sys_ipc_recv, but willing to receive up to 'npages' pages,
+// mapped consecutively starting at 'dstva' (see sys_ipc_try_sendv).
+// If 'timeout' is not 0, give up after that many timer ticks and
+// return -E_TIMEOUT.
+//	-E_INVAL if dstva < UTOP and the window does not fit below UTOP.
+static int
+sys_ipc_recvv(void *dstva, int npages, uint32_t timeout)
 {
 	// LAB 4: Your code here.
 	if (((uint32_t)dstva < UTOP) && ROUNDDOWN(dstva , PGSIZE) != dstva)  return -E_INVAL;
+	if ((uint32_t)dstva < UTOP
+	    && (npages < 1 || npages > (UTOP - (uint32_t) dstva) / PGSIZE))
+		return -E_INVAL;
+    curenv->env_ipc_npages = npages;
     curenv->env_ipc_recving = 1;
     curenv->env_status = ENV_NOT_RUNNABLE;
     curenv->env_ipc_dstva = dstva;
 	curenv->env_ipc_from = 0;
+	curenv->env_futex_key = 0;
+	futex_set_timeout(curenv, timeout);
 	sched_yield ();
 //	cprintf("----!2-----\n");
     return 0;
@@ -625,6 +671,127 @@ static void sys_raid2_check() {
 
 }
 
+// Block until another environment calls sys_futex_wake on 'addr',
+// provided *addr still equals 'expected' when we go to sleep.
+// 'timeout' is in timer ticks, 0 meaning forever.
+// 'addr' may be any 4-byte-aligned word the environment can read,
+// including the read-only UENVS mapping; environments sharing the
+// underlying page share the futex.
+//
+// Returns 0 on wakeup (spurious wakeups are possible, so callers must
+// recheck their condition), < 0 on error.  Errors are:
+//	-E_INVAL if addr is misaligned or not readable.
+//	-E_AGAIN if *addr != expected.
+//	-E_TIMEOUT if the timeout expired first.
+static int
+sys_futex_wait(const volatile uint32_t *addr, uint32_t expected, uint32_t timeout)
+{
+	int r;
+
+	if ((r = futex_wait(curenv, addr, expected, timeout)) < 0)
+		return r;
+	sched_yield();
+}
+
+// Wake up to 'n' environments blocked in sys_futex_wait on 'addr'.
+// Returns the number woken, or -E_INVAL if addr is bad.
+static int
+sys_futex_wake(const volatile uint32_t *addr, int n)
+{
+	return futex_wake(curenv, addr, n);
+}
+
+// Only environments with I/O privilege drive devices, and a device that
+// can DMA can already reach any physical memory, so the next two calls
+// give nothing away to them; everybody else gets -E_BAD_ENV.
+static bool
+env_has_io(struct Env *e)
+{
+	return (e->env_tf.tf_eflags & FL_IOPL_MASK) == FL_IOPL_3;
+}
+
+// Forward hardware interrupt 'irq' to the calling environment: each time
+// it fires, the word at 'counter' is incremented and one environment in
+// sys_futex_wait on it is woken.  A null 'counter' stops forwarding.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the environment has no I/O privilege.
+//	-E_INVAL if irq is one the kernel handles itself, or counter is
+//		misaligned or not writable.
+static int
+sys_irq_forward(int irq, volatile uint32_t *counter)
+{
+	if (!env_has_io(curenv))
+		return -E_BAD_ENV;
+	return irq_forward(curenv, irq, counter);
+}
+
+// Store the physical addresses of the 'npages' pages mapped from 'va'
+// in pa[0..npages-1], for programming a DMA engine.  The caller must
+// keep the pages mapped until the transfer is done.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the environment has no I/O privilege.
+//	-E_INVAL if va is not page-aligned, or a page is not mapped.
+static int
+sys_page_phys(void *va, int npages, physaddr_t *pa)
+{
+	struct PageInfo *pp;
+	int i;
+
+	if (!env_has_io(curenv))
+		return -E_BAD_ENV;
+	if (PGOFF(va) || npages < 0 || (uintptr_t) va >= UTOP
+	    || npages > (UTOP - (uintptr_t) va) / PGSIZE)
+		return -E_INVAL;
+	user_mem_assert(curenv, pa, npages * sizeof(*pa), PTE_U|PTE_W);
+	for (i = 0; i < npages; i++, va += PGSIZE) {
+		if ((pp = page_lookup(curenv->env_pgdir, va, NULL)) == NULL)
+			return -E_INVAL;
+		pa[i] = page2pa(pp);
+	}
+	return 0;
+}
+
+// Create a thread: a new environment that shares the caller's address
+// space, rather than a copy of it, and starts running at eip with stack
+// pointer esp.  It takes page faults, if the caller has a page fault
+// upcall, on the exception stack whose top is xstacktop; threads must
+// not share one.  Type, I/O privilege and priority are the caller's.
+// Threads exit with sys_env_destroy(0); the address space goes when the
+// last of them does.
+//
+// Returns envid of new environment, or < 0 on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_INVAL if eip, esp or xstacktop is above UTOP, or xstacktop
+//		is not page-aligned.
+static envid_t
+sys_thread_create(uintptr_t eip, uintptr_t esp, uintptr_t xstacktop)
+{
+	struct Env *e;
+	int r;
+
+	if (eip >= UTOP || esp > UTOP || xstacktop > UTOP
+	    || xstacktop < PGSIZE || PGOFF(xstacktop))
+		return -E_INVAL;
+	if ((r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+	page_decref(pa2page(PADDR(e->env_pgdir)));
+	e->env_pgdir = curenv->env_pgdir;
+	pa2page(PADDR(e->env_pgdir))->pp_ref++;
+
+	e->env_type = curenv->env_type;
+	e->priority = curenv->priority;
+	e->env_tf = curenv->env_tf;
+	e->env_tf.tf_eip = eip;
+	e->env_tf.tf_esp = esp;
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	e->env_xstacktop = xstacktop;
+	e->env_status = ENV_RUNNABLE;
+	return e->env_id;
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -671,6 +838,10 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 			return sys_ipc_try_send((envid_t)a1, (uint32_t) a2, (void*) a3, (unsigned) a4);
 		case SYS_ipc_recv :
 			return sys_ipc_recv((void*) a1);
+		case SYS_ipc_try_sendv :
+			return sys_ipc_try_sendv((envid_t) a1, a2, (void*) a3, (int) a4, (unsigned) a5);
+		case SYS_ipc_recvv :
+			return sys_ipc_recvv((void*) a1, (int) a2, a3);
 		case SYS_change_priority :
 			sys_change_priority((envid_t) a1, (int) a2);
 			goto _success_invoke;
@@ -689,6 +860,16 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		case SYS_raid2_check :
 			sys_raid2_check();
 			goto _success_invoke;
+		case SYS_futex_wait :
+			return sys_futex_wait((uint32_t*) a1, a2, a3);
+		case SYS_futex_wake :
+			return sys_futex_wake((uint32_t*) a1, (int) a2);
+		case SYS_irq_forward :
+			return sys_irq_forward((int) a1, (uint32_t *) a2);
+		case SYS_page_phys :
+			return sys_page_phys((void *) a1, (int) a2, (physaddr_t *) a3);
+		case SYS_thread_create :
+			return sys_thread_create(a1, a2, a3);
 		case SYS_exec : 
 			return sys_exec((uint32_t) a1 , (uint32_t) a2 , (void *) a3 , (uint32_t) a4);
 		default :
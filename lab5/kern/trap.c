@@ -1,6 +1,7 @@
 #include <inc/mmu.h>
 #include <inc/x86.h>
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/pmap.h>
 #include <kern/trap.h>
@@ -13,9 +14,15 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/futex.h>
 
 static struct Taskstate ts;
 
+// Device interrupts forwarded to user-level drivers (see irq_forward):
+// for each IRQ, the physical address of a counter to bump when it
+// fires, or 0.
+static physaddr_t irq_counter[MAX_IRQS];
+
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
  * additional information in the latter case.
@@ -118,6 +125,7 @@ trap_init(void)
 	extern void irq_handler39();
 	extern void irq_handler46();
 	extern void irq_handler51();
+	extern void irq_handler52();
 	int i;
 	for (i = 0; i < 20; i++) {
 		if (i == T_BRKPT) {
@@ -135,6 +143,7 @@ trap_init(void)
 	SETGATE(idt[IRQ_OFFSET + IRQ_SPURIOUS], 0, GD_KT, irq_handler39, 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_IDE], 0, GD_KT, irq_handler46, 0);
 	SETGATE(idt[IRQ_OFFSET + IRQ_ERROR], 0, GD_KT, irq_handler51, 0);
+	SETGATE(idt[IRQ_OFFSET + IRQ_TLB], 0, GD_KT, irq_handler52, 0);
 
 
 	// Per-CPU setup 
@@ -235,6 +244,56 @@ print_regs(struct PushRegs *regs)
 	cprintf("  eax  0x%08x\n", regs->reg_eax);
 }
 
+// Forward 'irq' to environment e: from now on, each time it fires the
+// kernel increments the word at 'counter' and wakes one environment
+// sleeping on it with sys_futex_wait.  A driver starts a command, then
+// sleeps until the counter moves on from its value before the command,
+// so a completion that beats it to the futex is not lost.  The device
+// itself is left for the driver to acknowledge.  A null 'counter'
+// stops forwarding and masks the IRQ again.
+int
+irq_forward(struct Env *e, int irq, volatile uint32_t *counter)
+{
+	struct PageInfo *pp;
+	physaddr_t pa = 0;
+
+	if (irq <= 0 || irq >= MAX_IRQS || irq == IRQ_KBD || irq == IRQ_SLAVE
+	    || irq == IRQ_SERIAL || irq == IRQ_SPURIOUS)
+		return -E_INVAL;
+	if (counter) {
+		if ((uintptr_t) counter & 3)
+			return -E_INVAL;
+		if (user_mem_check(e, (const void *) counter, sizeof(*counter),
+				   PTE_U|PTE_W) < 0)
+			return -E_INVAL;
+		pp = page_lookup(e->env_pgdir, (void *) counter, NULL);
+		// The kernel writes the counter from interrupt context, when
+		// e may be gone; keep the page alive until it is replaced.
+		pp->pp_ref++;
+		pa = page2pa(pp) + PGOFF(counter);
+	}
+	if (irq_counter[irq])
+		page_decref(pa2page(irq_counter[irq]));
+	irq_counter[irq] = pa;
+	if (pa)
+		irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	else
+		irq_setmask_8259A(irq_mask_8259A | (1 << irq));
+	return 0;
+}
+
+static void
+irq_notify(int irq)
+{
+	physaddr_t pa = irq_counter[irq];
+
+	// Only the master PIC is in auto-EOI mode.
+	if (irq >= 8)
+		outb(IO_PIC2, 0x20);
+	(*(volatile uint32_t *) KADDR(pa))++;
+	futex_wake_key(pa, 1);
+}
+
 static void
 trap_dispatch(struct Trapframe *tf)
 {
@@ -266,9 +325,14 @@ trap_dispatch(struct Trapframe *tf)
 	//cprintf("%d", tf->tf_trapno);
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
 		lapic_eoi();
+		if (thiscpu == bootcpu)
+			futex_tick();
 		sched_yield();
 		return;
 	}
+	// Already answered in trap(); this one woke a halted CPU.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB)
+		return;
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_KBD) {
 		kbd_intr();
 		return;
@@ -277,6 +341,11 @@ trap_dispatch(struct Trapframe *tf)
 		serial_intr();
 		return;
 	}
+	if (tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS
+	    && irq_counter[tf->tf_trapno - IRQ_OFFSET]) {
+		irq_notify(tf->tf_trapno - IRQ_OFFSET);
+		return;
+	}
 
 	//cprintf("!!");
 	// Unexpected trap: The user process or the kernel has a bug.
@@ -322,6 +391,18 @@ trap(struct Trapframe *tf)
 	if (panicstr)
 		asm volatile("hlt");
 
+	// Answer a TLB shootdown at once, without the big kernel lock:
+	// the CPU asking for it holds the lock while it waits.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		lcr3(rcr3());
+		thiscpu->cpu_tlbacks++;
+		lapic_eoi();
+		if ((tf->tf_cs & 3) == 3)
+			env_pop_tf(tf);
+	}
+	// cr3 is reloaded on the way back to user mode
+	thiscpu->cpu_inuser = 0;
+
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
 	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
@@ -339,7 +420,11 @@ trap(struct Trapframe *tf)
 
 		lock_kernel();
 		assert(curenv);
-
+		// tlb_shootdown leaves CPUs in the kernel alone, so while
+		// we waited for the lock a thread on another CPU may have
+		// changed our address space under our TLB.
+		if (pa2page(PADDR(curenv->env_pgdir))->pp_ref > 1)
+			lcr3(rcr3());
 
 		// Garbage collect if current enviroment is a zombie
 		if (curenv->env_status == ENV_DYING) {
@@ -425,10 +510,11 @@ page_fault_handler(struct Trapframe *tf)
 //		cprintf("!!entry\n");
 		struct UTrapframe *uetf;
 		uint32_t add;
-		if (tf->tf_esp >= UXSTACKTOP - PGSIZE && tf->tf_esp < UXSTACKTOP) {
+		uintptr_t xstacktop = curenv->env_xstacktop;
+		if (tf->tf_esp >= xstacktop - PGSIZE && tf->tf_esp < xstacktop) {
 			add = tf->tf_esp - sizeof(struct UTrapframe) - 4;
 		} else {
-			add = UXSTACKTOP - sizeof(struct UTrapframe);
+			add = xstacktop - sizeof(struct UTrapframe);
 		}
 		uetf = (struct UTrapframe *) add;
 		user_mem_assert(curenv, (void*)add, sizeof(struct UTrapframe), PTE_U | PTE_W);
@@ -79,12 +79,15 @@ static ssize_t
 devcons_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	int c;
+	uint32_t zero = 0;
 
 	if (n == 0)
 		return 0;
 
+	// Nothing wakes us on input, so nap for a timer tick between polls
+	// rather than spinning.
 	while ((c = sys_cgetc()) == 0)
-		sys_yield();
+		sys_futex_wait(&zero, 0, 1);
 	if (c < 0)
 		return c;
 	if (c == 0x04)	// ctl-d is eof
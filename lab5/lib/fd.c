@@ -2,8 +2,6 @@
 
 #define debug		0
 
-// Maximum number of file descriptors a program may hold open concurrently
-#define MAXFD		32
 // Bottom of file descriptor area
 #define FDTABLE		0xD0000000
 // Bottom of file data area.  We reserve one data page for each FD,
@@ -32,6 +30,15 @@ fd2data(struct Fd *fd)
 	return INDEX2DATA(fd2num(fd));
 }
 
+// Returns true if 'fd' is a slot in this environment's file descriptor
+// table, rather than, say, a copy of a struct Fd somewhere else.
+bool
+fd_intable(struct Fd *fd)
+{
+	return (uintptr_t) fd >= FDTABLE && (uintptr_t) fd < FILEDATA
+		&& PGOFF(fd) == 0;
+}
+
 // Finds the smallest i from 0 to MAXFD-1 that doesn't have
 // its fd page mapped.
 // Sets *fd_store to the corresponding fd page virtual address.
@@ -318,3 +325,116 @@ stat(const char *path, struct Stat *stat)
 	return r;
 }
 
+
+// Copy up to n bytes from fdin to fdout, stopping early at end of
+// input or if fdout stops taking data.  One of the devices must offer
+// direct buffer access, so that the data is copied exactly once,
+// straight between the devices, rather than in and out of a buffer of
+// the caller's; otherwise this returns -E_NOT_SUPP and the caller
+// should copy through its own buffer.  It is not a zero-copy splice:
+// no pages change hands, since a pipe's ring shares its one page with
+// the pipe's header.  sendfile() is the zero-copy path from a file.
+// Returns the number of bytes copied, or < 0 if nothing could be
+// copied because of an error.
+ssize_t
+copyfd(int fdin, int fdout, size_t n)
+{
+	int r;
+	ssize_t m, w;
+	size_t tot;
+	struct Dev *din, *dout;
+	struct Fd *in, *out;
+	const void *src;
+	void *dst;
+
+	if ((r = fd_lookup(fdin, &in)) < 0
+	    || (r = dev_lookup(in->fd_dev_id, &din)) < 0
+	    || (r = fd_lookup(fdout, &out)) < 0
+	    || (r = dev_lookup(out->fd_dev_id, &dout)) < 0)
+		return r;
+	if ((in->fd_omode & O_ACCMODE) == O_WRONLY
+	    || (out->fd_omode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	if (!din->dev_read || !dout->dev_write
+	    || (!dout->dev_wbuf && !din->dev_rbuf))
+		return -E_NOT_SUPP;
+
+	for (tot = 0; tot < n; tot += m) {
+		if (dout->dev_wbuf) {
+			// read straight into the output device
+			if ((w = (*dout->dev_wbuf)(out, &dst, n - tot)) <= 0)
+				break;
+			m = (*din->dev_read)(in, dst, w);
+			if (m > 0)
+				(*dout->dev_commit)(out, m);
+		} else {
+			// write straight out of the input device
+			if ((m = (*din->dev_rbuf)(in, &src, n - tot)) <= 0)
+				return tot ? tot : m;
+			if ((w = (*dout->dev_write)(out, src, m)) > 0)
+				(*din->dev_consume)(in, w);
+			if (w != m)
+				return tot + MAX(w, 0);
+		}
+		if (m < 0)
+			return tot ? tot : m;
+		if (m == 0)
+			break;
+	}
+	return tot;
+}
+
+// Most bytes sendfile asks the devices to move at once
+#define SENDCHUNK	(FSREQ_MAXPAGES * PGSIZE)
+
+// Send up to n bytes of fdin, from offset on (from its position,
+// moving it, if offset < 0), to fdout without copying them through
+// this environment at all: fdin's device puts them straight into
+// fdout's buffer (a pipe's ring) or out to the console.  If the
+// devices cannot do that this returns -E_NOT_SUPP, and the caller
+// should fall back on copyfd() or its own buffer.
+// Returns the number of bytes sent, stopping early at end of input or
+// if fdout stops taking data, or < 0 if nothing could be sent because
+// of an error.
+ssize_t
+sendfile(int fdout, int fdin, off_t offset, size_t n)
+{
+	int r;
+	ssize_t m;
+	size_t tot, w;
+	struct Dev *din, *dout;
+	struct Fd *in, *out;
+	void *dst;
+
+	if ((r = fd_lookup(fdin, &in)) < 0
+	    || (r = dev_lookup(in->fd_dev_id, &din)) < 0
+	    || (r = fd_lookup(fdout, &out)) < 0
+	    || (r = dev_lookup(out->fd_dev_id, &dout)) < 0)
+		return r;
+	if ((in->fd_omode & O_ACCMODE) == O_WRONLY
+	    || (out->fd_omode & O_ACCMODE) == O_RDONLY)
+		return -E_INVAL;
+	if (!din->dev_send || (!dout->dev_wbuf && dout != &devcons))
+		return -E_NOT_SUPP;
+
+	for (tot = 0; tot < n; tot += m) {
+		dst = NULL;
+		w = MIN(n - tot, SENDCHUNK);
+		if (dout->dev_wbuf) {
+			if ((m = (*dout->dev_wbuf)(out, &dst, w)) < 0)
+				return tot ? tot : m;
+			if (m == 0)
+				break;
+			w = m;
+		}
+		if ((m = (*din->dev_send)(in, offset, dst, w)) < 0)
+			return tot ? tot : m;
+		if (m == 0)
+			break;
+		if (dst)
+			(*dout->dev_commit)(out, m);
+		if (offset >= 0)
+			offset += m;
+	}
+	return tot;
+}
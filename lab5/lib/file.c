@@ -1,31 +1,82 @@
 #include <inc/fs.h>
 #include <inc/string.h>
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 #define debug 0
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+static envid_t fsenv;
+static envid_t fsenv_owner;
+static int fsenv_nworker;	// workers running when fsenv was picked
+static uint32_t fsenv_nreq;
+
+// A client that picked while the server had only its main thread
+// running looks again every FS_REPICK requests, until it sees more.
+#define FS_REPICK	32
+
+// The file server runs several worker threads (see fs/serv.c), all
+// ENV_TYPE_FS.  Each client talks to one, picked by its environment
+// index so that clients spread evenly over them; a forked child picks
+// afresh rather than keep its parent's.
+static envid_t
+fs_worker(void)
+{
+	int i, n, nworker = 0;
+
+	if (fsenv_owner == thisenv->env_id
+	    && (fsenv_nworker > 1 || ++fsenv_nreq % FS_REPICK != 0))
+		return fsenv;
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_type == ENV_TYPE_FS && envs[i].env_status != ENV_FREE)
+			nworker++;
+	n = nworker ? ENVX(thisenv->env_id) % nworker : 0;
+	fsenv = 0;
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_type == ENV_TYPE_FS && envs[i].env_status != ENV_FREE
+		    && n-- == 0) {
+			fsenv = envs[i].env_id;
+			fsenv_owner = thisenv->env_id;
+			fsenv_nworker = nworker;
+			break;
+		}
+	return fsenv;
+}
+
 // Send an inter-environment request to the file server, and wait for
-// a reply.  The request body should be in fsipcbuf, and parts of the
-// response may be written back to fsipcbuf.
+// a reply.  The request body should be in *req, and parts of the
+// response may be written back to *req.
 // type: request code, passed as the simple integer IPC value.
-// dstva: virtual address at which to receive reply page, 0 if none.
+// dstva: virtual address at which to receive reply pages, 0 if none.
+// npages: on entry, how many reply pages dstva has room for;
+// on return, how many were received.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipcreq(unsigned type, union Fsipc *req, void *dstva, int *npages)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
-
-	static_assert(sizeof(fsipcbuf) == PGSIZE);
+	static_assert(sizeof(*req) == PGSIZE);
 
 	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)req);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	ipc_send(fs_worker(), type, req, PTE_P | PTE_W | PTE_U);
+	return ipc_recvv(NULL, dstva, npages, NULL);
+}
+
+// Send a request whose body is in fsipcbuf; see fsipcreq.
+static int
+fsipcv(unsigned type, void *dstva, int *npages)
+{
+	return fsipcreq(type, &fsipcbuf, dstva, npages);
+}
+
+static int
+fsipc(unsigned type, void *dstva)
+{
+	int npages = 1;
+
+	return fsipcv(type, dstva, &npages);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -33,6 +84,9 @@ static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
 static int devfile_trunc(struct Fd *fd, off_t newsize);
+static ssize_t devfile_rbuf(struct Fd *fd, const void **buf, size_t n);
+static void devfile_consume(struct Fd *fd, size_t n);
+static ssize_t devfile_send(struct Fd *fd, off_t offset, void *dst, size_t n);
 
 struct Dev devfile =
 {
@@ -41,6 +95,11 @@ struct Dev devfile =
 	.dev_read =	devfile_read,
 	.dev_close =	devfile_flush,
 	.dev_stat =	devfile_stat,
+	.dev_write =	devfile_write,
+	.dev_trunc =	devfile_trunc,
+	.dev_rbuf =	devfile_rbuf,
+	.dev_consume =	devfile_consume,
+	.dev_send =	devfile_send,
 };
 
 // Open a file (or directory).
@@ -97,6 +156,9 @@ open(const char *path, int mode)
 static int
 devfile_flush(struct Fd *fd)
 {
+	// Drop any block devfile_rbuf mapped that was never consumed.
+	if (fd_intable(fd))
+		sys_page_unmap(0, fd2data(fd));
 	fsipcbuf.flush.req_fileid = fd->fd_file.id;
 	return fsipc(FSREQ_FLUSH, NULL);
 }
@@ -114,6 +176,19 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
 	int r;
+	size_t tot;
+	const void *src;
+
+	// Real fds read through mapped block cache pages.
+	if (fd_intable(fd)) {
+		for (tot = 0; tot < n; tot += r) {
+			if ((r = devfile_rbuf(fd, &src, n - tot)) <= 0)
+				return tot ? tot : r;
+			memmove((char*) buf + tot, src, r);
+			devfile_consume(fd, r);
+		}
+		return tot;
+	}
 
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
@@ -125,6 +200,201 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	return r;
 }
 
+// Read at most 'n' bytes from 'fdnum' at the current position into the
+// page-aligned buffer 'dstva', in as few round trips as possible: the
+// file server sends the data as whole pages, which replace whatever was
+// mapped at dstva.  The part of the last page past the data is zeroed,
+// and pages beyond it are left alone.
+//
+// Returns:
+// 	The number of bytes successfully read (0 at end of file).
+// 	< 0 on error.
+ssize_t
+readpages(int fdnum, void *dstva, size_t n)
+{
+	struct Fd *fd;
+	size_t tot, m;
+	int r, npages;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if (PGOFF(dstva))
+		return -E_INVAL;
+
+	for (tot = 0; tot < n; tot += r) {
+		m = MIN(n - tot, FSREQ_MAXPAGES * PGSIZE);
+		fsipcbuf.read.req_fileid = fd->fd_file.id;
+		fsipcbuf.read.req_n = m;
+		npages = ROUNDUP(m, PGSIZE) / PGSIZE;
+		if ((r = fsipcv(FSREQ_READV, (char*) dstva + tot, &npages)) < 0)
+			return tot ? tot : r;
+		if (r < m)
+			return tot + r;
+	}
+	return tot;
+}
+
+// Read the entries of directory 'fdnum' from the current position on
+// into 'buf', packed as struct Dirents (step from one to the next with
+// DIRENT_SIZE), as many as fit in 'n' bytes, and move the position past
+// them.  A page's worth of entries comes in one round trip.
+//
+// Returns:
+//	The number of bytes of entries stored (0 at the end of the
+//	directory).
+//	< 0 on error; -E_INVAL if 'n' is too small for the next entry.
+ssize_t
+readdir(int fdnum, void *buf, size_t n)
+{
+	struct Fd *fd;
+	int r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+
+	fsipcbuf.readdir.req_fileid = fd->fd_file.id;
+	fsipcbuf.readdir.req_offset = fd->fd_offset;
+	fsipcbuf.readdir.req_n = MIN(n, sizeof(fsipcbuf.readdirRet.ret_buf));
+	if ((r = fsipc(FSREQ_READDIR, NULL)) < 0)
+		return r;
+	assert(r <= n);
+	memmove(buf, fsipcbuf.readdirRet.ret_buf, r);
+	fd->fd_offset = fsipcbuf.readdirRet.ret_next;
+	return r;
+}
+
+// Request page for fsmap.  fsmap is called from the page fault
+// handler, possibly while fsipcbuf still holds another reply.
+static union Fsipc fsmapbuf __attribute__((aligned(PGSIZE)));
+
+// Map up to npages pages of the open file 'fileid', starting at the
+// page-aligned 'offset', read-only at dstva.  The pages are the file
+// server's block cache pages, except that the part of the last page
+// past the end of file is a zeroed private copy.
+//
+// Returns:
+// 	The number of pages mapped (0 at end of file).
+// 	< 0 on error.
+int
+fsmap(int fileid, off_t offset, void *dstva, int npages)
+{
+	int r;
+
+	if (PGOFF(dstva) || PGOFF(offset) || npages <= 0)
+		return -E_INVAL;
+
+	fsmapbuf.map.req_fileid = fileid;
+	fsmapbuf.map.req_offset = offset;
+	fsmapbuf.map.req_npages = npages;
+	if ((r = fsipcreq(FSREQ_MAP, &fsmapbuf, dstva, &npages)) < 0)
+		return r;
+	return npages;
+}
+
+// Point *buf at up to n bytes of 'fd' at the current position.
+// A whole block is mapped read-only at the fd's data page, straight
+// from the file server's block cache; the partial last block is copied
+// into fsipcbuf instead.  The mapping lasts only until
+// devfile_consume: kept any longer, it would go on showing the block
+// after another client truncated or removed the file, and keep the
+// server from evicting the block.
+// Returns the number of bytes available at *buf (0 at end of file).
+static ssize_t
+devfile_rbuf(struct Fd *fd, const void **buf, size_t n)
+{
+	char *va = fd2data(fd);
+	off_t off = fd->fd_offset;
+	int r, npages = 1;
+
+	fsipcbuf.read.req_fileid = fd->fd_file.id;
+	fsipcbuf.read.req_n = n;
+	if ((r = fsipcv(FSREQ_READ_MAP, va, &npages)) <= 0)
+		return r;
+	if (npages == 0) {
+		*buf = &fsipcbuf;
+		return MIN(r, n);
+	}
+	*buf = va + off % BLKSIZE;
+	return MIN(n, r);
+}
+
+// Retire n bytes returned by devfile_rbuf, and drop its mapping.
+static void
+devfile_consume(struct Fd *fd, size_t n)
+{
+	fd->fd_offset += n;
+	if (fd_intable(fd))
+		sys_page_unmap(0, fd2data(fd));
+}
+
+// FSREQ_SENDFILE requests are built at FSSENDVA, with the page to put
+// the data in, if any, mapped just after for the length of the call.
+#define FSSENDVA	0xCE000000
+
+// Have the file server send up to n bytes of 'fd' from 'offset' (from
+// the current position, moving it, if offset < 0) straight into dst,
+// in a shared page of another device's, or to the console if dst is
+// NULL.  The data never passes through this environment.
+// Returns the number of bytes sent (0 at end of file), or < 0 on error.
+static ssize_t
+devfile_send(struct Fd *fd, off_t offset, void *dst, size_t n)
+{
+	union Fsipc *req = (union Fsipc *) FSSENDVA;
+	char *pg = (char *) req + PGSIZE;
+	int r, npages = 1;
+
+	if (!(uvpd[PDX(req)] & PTE_P) || !(uvpt[PGNUM(req)] & PTE_P))
+		if ((r = sys_page_alloc(0, req, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	req->sendfile.req_fileid = fd->fd_file.id;
+	req->sendfile.req_offset = offset;
+	req->sendfile.req_n = n;
+	req->sendfile.req_pgoff = PGOFF(dst);
+	if (dst) {
+		if ((r = sys_page_map(0, ROUNDDOWN(dst, PGSIZE), 0, pg,
+				      PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+		req->sendfile.req_n = MIN(n, PGSIZE - PGOFF(dst));
+		npages = 2;
+	}
+	ipc_sendv(fs_worker(), FSREQ_SENDFILE, req, npages, PTE_P|PTE_U|PTE_W);
+	r = ipc_recv(NULL, NULL, NULL);
+	// a pipe counts its ends by the references to its page
+	if (dst)
+		sys_page_unmap(0, pg);
+	return r;
+}
+
+// Write at most 'n' bytes from 'buf' to 'fd' at the current seek position.
+//
+// Returns:
+//	 The number of bytes successfully written.
+//	 < 0 on error.
+static ssize_t
+devfile_write(struct Fd *fd, const void *buf, size_t n)
+{
+	// Each FSREQ_WRITE carries at most sizeof req_buf bytes, so
+	// send the data a request at a time.
+	size_t tot, m;
+	int r;
+
+	for (tot = 0; tot < n; tot += r) {
+		m = MIN(n - tot, sizeof(fsipcbuf.write.req_buf));
+		memmove(fsipcbuf.write.req_buf, (const char *) buf + tot, m);
+		fsipcbuf.write.req_fileid = fd->fd_file.id;
+		fsipcbuf.write.req_n = m;
+		if ((r = fsipc(FSREQ_WRITE, NULL)) < 0)
+			return tot ? tot : r;
+		assert(r <= m);
+		if (r == 0)
+			break;
+	}
+	return tot;
+}
 
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
@@ -140,4 +410,231 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 	return 0;
 }
 
+// Truncate or extend an open file to 'size' bytes
+static int
+devfile_trunc(struct Fd *fd, off_t newsize)
+{
+	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
+	fsipcbuf.set_size.req_size = newsize;
+	return fsipc(FSREQ_SET_SIZE, NULL);
+}
+
+// Delete a file
+int
+remove(const char *path)
+{
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.remove.req_path, path);
+	return fsipc(FSREQ_REMOVE, NULL);
+}
+
+// Synchronize disk with buffer cache
+int
+sync(void)
+{
+	// Ask the file server to update the disk
+	// by writing any dirty blocks in the buffer cache.
+
+	return fsipc(FSREQ_SYNC, NULL);
+}
+
+// Set the file server's block cache budget to 'budget' blocks, unless
+// it is 0, its write policy to 'writethrough', its path lookup cache on
+// or off by 'pathcache' and its disk transfers to DMA or PIO by 'dma',
+// unless those are -1, and store the cache statistics in *st.
+int
+fscache(uint32_t budget, int writethrough, int pathcache, int dma,
+	struct Fscache *st)
+{
+	int r;
+
+	fsipcbuf.cache.req_budget = budget;
+	fsipcbuf.cache.req_writethrough = writethrough;
+	fsipcbuf.cache.req_pathcache = pathcache;
+	fsipcbuf.cache.req_dma = dma;
+	if ((r = fsipc(FSREQ_CACHE, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.cacheRet;
+	return 0;
+}
+
+// Store the file server's request and cache statistics in *st, then
+// turn its request tracing on or off by 'trace', unless it is -1, and
+// start its counts afresh if 'reset'.
+int
+fsstats(int reset, int trace, struct Fsstats *st)
+{
+	int r;
+
+	fsipcbuf.stats.req_dump = 0;
+	fsipcbuf.stats.req_trace = trace;
+	fsipcbuf.stats.req_reset = reset;
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*st = fsipcbuf.statsRet;
+	return 0;
+}
+
+// Store the file server's ring of recently traced requests in *tr.
+int
+fstrace(struct Fsret_trace *tr)
+{
+	int r;
+
+	fsipcbuf.stats.req_dump = 1;
+	fsipcbuf.stats.req_trace = -1;
+	fsipcbuf.stats.req_reset = 0;
+	if ((r = fsipc(FSREQ_STATS, NULL)) < 0)
+		return r;
+	*tr = fsipcbuf.traceRet;
+	return 0;
+}
+
+
+
+
+// Asynchronous requests through a request ring shared with the file
+// server (see struct Fsring).  The ring is set up on first use, and
+// again in a forked or spawned child, which inherits the mapping but
+// must not share the parent's ring.
 
+#define FSRINGVA	0xCF000000
+
+static struct Fsring *fsring = (struct Fsring *) FSRINGVA;
+static envid_t fsring_owner;
+
+// Client-side bookkeeping for each slot.
+static struct {
+	uint32_t gen;		// bumped when the slot is retired
+	void *buf;		// where to put the result
+} fsa_slot[FSRING_NSLOT];
+
+static int
+fsring_setup(void)
+{
+	int i, r;
+
+	if (fsring_owner == thisenv->env_id)
+		return 0;
+	// The pages are PTE_SHARE so that fork does not turn our side
+	// of the ring copy-on-write; children get fresh pages here.
+	for (i = 0; i < FSRING_NPAGES; i++)
+		if ((r = sys_page_alloc(0, (char*) fsring + i*PGSIZE,
+					PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+			return r;
+	ipc_sendv(fs_worker(), FSREQ_RING_SETUP, fsring, FSRING_NPAGES,
+		  PTE_P|PTE_U|PTE_W);
+	if ((r = ipc_recv(NULL, NULL, NULL)) < 0)
+		return r;
+	fsring_owner = thisenv->env_id;
+	return 0;
+}
+
+// Queue a request on a free slot and kick the server if needed.
+// Returns the request's tag, or < 0 on error (-E_AGAIN if every slot
+// is in use).
+static int
+fsa_submit(int fdnum, int type, void *buf, size_t n, off_t offset)
+{
+	struct Fd *fd;
+	struct Fsring_slot *s;
+	int i, r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if ((r = fsring_setup()) < 0)
+		return r;
+
+	for (i = 0; i < FSRING_NSLOT; i++)
+		if (fsring->r_slot[i].s_state == FSRING_FREE)
+			break;
+	if (i == FSRING_NSLOT)
+		return -E_AGAIN;
+
+	s = &fsring->r_slot[i];
+	s->s_type = type;
+	s->s_fileid = fd->fd_file.id;
+	s->s_offset = offset;
+	s->s_n = MIN(n, PGSIZE);
+	fsa_slot[i].buf = buf;
+	__asm __volatile("" : : : "memory");
+	s->s_state = FSRING_SUBMITTED;
+	if (xchg(&fsring->r_kicked, 1) == 0)
+		ipc_send(fs_worker(), FSREQ_RING_KICK, NULL, 0);
+	return (fsa_slot[i].gen & 0xFFFFFF) * FSRING_NSLOT + i;
+}
+
+// Start reading up to n bytes (at most a page) at 'offset' in fdnum
+// into buf.  The file position is not used or changed.
+// Returns a tag for fsa_poll/fsa_wait, or < 0 on error.
+int
+fsa_read(int fdnum, void *buf, size_t n, off_t offset)
+{
+	return fsa_submit(fdnum, FSREQ_READ, buf, n, offset);
+}
+
+// Start a stat of fdnum into *st.
+// Returns a tag for fsa_poll/fsa_wait, or < 0 on error.
+int
+fsa_stat(int fdnum, struct Stat *st)
+{
+	return fsa_submit(fdnum, FSREQ_STAT, st, 0, 0);
+}
+
+// Check whether the request 'tag' has finished.  If so, copy out its
+// result, retire the tag and return the request's return value (for
+// reads, the byte count).  Returns -E_AGAIN if it is still in flight.
+int
+fsa_poll(int tag)
+{
+	struct Fsring_slot *s;
+	struct Fsret_stat *ret;
+	struct Stat *st;
+	void *data;
+	int i, r;
+
+	i = tag % FSRING_NSLOT;
+	if (tag < 0 || fsring_owner != thisenv->env_id
+	    || (fsa_slot[i].gen & 0xFFFFFF) != tag / FSRING_NSLOT
+	    || fsring->r_slot[i].s_state == FSRING_FREE)
+		return -E_INVAL;
+	s = &fsring->r_slot[i];
+	if (s->s_state != FSRING_DONE)
+		return -E_AGAIN;
+	__asm __volatile("" : : : "memory");
+
+	data = (char*) fsring + (1 + i) * PGSIZE;
+	if ((r = s->s_ret) >= 0 && s->s_type == FSREQ_READ)
+		memmove(fsa_slot[i].buf, data, MIN(r, s->s_n));
+	else if (r >= 0 && s->s_type == FSREQ_STAT) {
+		ret = data;
+		st = fsa_slot[i].buf;
+		strcpy(st->st_name, ret->ret_name);
+		st->st_size = ret->ret_size;
+		st->st_isdir = ret->ret_isdir;
+		st->st_dev = &devfile;
+	}
+	fsa_slot[i].gen++;
+	s->s_state = FSRING_FREE;
+	return r;
+}
+
+// Wait for the request 'tag' to finish, then behave like fsa_poll.
+int
+fsa_wait(int tag)
+{
+	uint32_t done;
+	int r;
+
+	while (1) {
+		// sample r_done before polling, so a completion after
+		// the poll makes the futex wait return at once
+		done = fsring->r_done;
+		if ((r = fsa_poll(tag)) != -E_AGAIN)
+			return r;
+		sys_futex_wait(&fsring->r_done, done, 0);
+	}
+}
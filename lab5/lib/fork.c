@@ -3,20 +3,33 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
+// Replace the copy-on-write page at addr with a private writable copy.
+static void
+cow_copy(void *addr)
+{
+	int r;
+
+	r = sys_page_alloc(0, (void*)PFTEMP, PTE_P | PTE_W | PTE_U);
+	if (r < 0) panic("page alloc failed");
+	addr = ROUNDDOWN (addr, PGSIZE);
+	memcpy(PFTEMP, addr, PGSIZE);
+	r =	sys_page_map(0, (void*) PFTEMP, 0, addr, PTE_P | PTE_W | PTE_U);
+	if (r < 0) panic("sys_page_map failed");
+}
 
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
+// Faults in mmap regions are first offered to mmap_fault.
 //
 static void
 pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t err = utf->utf_err;
-	int r;
+
+	if (mmap_fault(addr, err))
+		return;
 
 	// Check that the faulting access was (1) a write, and (2) to a
 	// copy-on-write page.  If not, panic.
@@ -45,16 +58,24 @@ pgfault(struct UTrapframe *utf)
 	//   No need to explicitly delete the old page's mapping.
 
 	// LAB 4: Your code here.
-	r = sys_page_alloc(0, (void*)PFTEMP, PTE_P | PTE_W | PTE_U);
-	if (r < 0) panic("page alloc failed");
-	addr = ROUNDDOWN (addr, PGSIZE);
-	memcpy(PFTEMP, addr, PGSIZE);
-	r =	sys_page_map(0, (void*) PFTEMP, 0, addr, PTE_P | PTE_W | PTE_U);
-	if (r < 0) panic("sys_page_map failed");
+	cow_copy(addr);
 
 	//panic("pgfault not implemented");
 }
 
+// Install pgfault as this environment's page fault handler.
+void
+pgfault_init(void)
+{
+	extern void (*_pgfault_handler)(struct UTrapframe *utf);
+
+	// set_pgfault_handler stores the handler in memory before any
+	// fault can be handled, so that store must not fault
+	if (uvpt[PGNUM(&_pgfault_handler)] & PTE_COW)
+		cow_copy(&_pgfault_handler);
+	set_pgfault_handler(pgfault);
+}
+
 //
 // Map our virtual page pn (address pn*PGSIZE) into the target envid
 // at the same virtual address.  If the page is writable or copy-on-write,
@@ -114,7 +135,7 @@ fork(void)
 	// LAB 4: our code here.
 //	static int pri = 10000;
 	cprintf("fork start\n");
-	set_pgfault_handler(pgfault);
+	pgfault_init();
 	int envid = sys_exofork();
 	if (envid < 0) {
 		panic("sys_exofork: %e", envid);
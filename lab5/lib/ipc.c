@@ -61,6 +61,55 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	return;
 }
 
+// Like ipc_send, but send the 'npages' pages starting at 'pg'.
+void
+ipc_sendv(envid_t to_env, uint32_t val, void *pg, int npages, int perm)
+{
+	int r;
+
+	if (!pg)
+		pg = (void*) -1;
+	while ((r = sys_ipc_try_sendv(to_env, val, pg, npages, perm)) != 0) {
+		if (r != -E_IPC_NOT_RECV)
+			panic("ipc_sendv: %e", r);
+		sys_yield();
+	}
+}
+
+// Like ipc_recv, but accept up to *npages pages, mapped consecutively
+// at 'pg'.  On return *npages holds the number of pages received.
+int32_t
+ipc_recvv(envid_t *from_env_store, void *pg, int *npages, int *perm_store)
+{
+	return ipc_recvv_timeout(from_env_store, pg, npages, perm_store, 0);
+}
+
+// Like ipc_recvv, but give up with -E_TIMEOUT after 'timeout' timer
+// ticks, unless 'timeout' is 0.
+int32_t
+ipc_recvv_timeout(envid_t *from_env_store, void *pg, int *npages,
+		  int *perm_store, uint32_t timeout)
+{
+	int r;
+
+	if (from_env_store)
+		*from_env_store = 0;
+	if (perm_store)
+		*perm_store = 0;
+	if (!pg)
+		pg = (void*) -1;
+	if ((r = sys_ipc_recvv(pg, *npages, timeout)) < 0) {
+		*npages = 0;
+		return r;
+	}
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	*npages = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
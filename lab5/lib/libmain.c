@@ -11,6 +11,17 @@ const char *binaryname = "<unknown>";
 void
 libmain(int argc, char **argv)
 {
+	extern char end[];
+	uintptr_t va;
+
+	// spawn maps our writable data copy-on-write, so the page fault
+	// handler must be in place before we write to any of it
+	for (va = UTEXT; va < (uintptr_t) end; va += PGSIZE)
+		if ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_COW)) {
+			pgfault_init();
+			break;
+		}
+
 	// set thisenv to point at our Env structure in envs[].
 	// LAB 3: Your code here.
 //	extern struct Env* envs;
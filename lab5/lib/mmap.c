@@ -0,0 +1,188 @@
+// Memory-mapped files.
+//
+// A region is filled in lazily: the first touch of an unmapped page
+// faults, and mmap_fault asks the file server for that page and the
+// unmapped pages after it in one FSREQ_MAP request.  The server hands
+// over its block cache pages read-only, so mapping a file costs no
+// copying; a private writable region maps them copy-on-write.
+
+#include <inc/lib.h>
+
+// Each region holds a mapping of its file's Fd page here, which keeps
+// the file open on the server after the fd itself is closed.  It is
+// not PTE_SHARE, so fork passes it on and spawn does not.
+#define MMAPFD		0xCF400000
+#define NMMAP		32
+// Most pages one fault asks the file server for
+#define MMAPRUN		8
+
+struct Mmap {
+	uintptr_t m_va;		// start of the region, 0 if the slot is free
+	size_t m_len;		// bytes, a multiple of PGSIZE
+	off_t m_off;		// file offset mapped at m_va
+	int m_prot;
+	int m_flags;
+	int m_fileid;
+};
+
+static struct Mmap mmaptab[NMMAP];
+
+static bool
+va_mapped(uintptr_t va)
+{
+	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
+}
+
+// Find the lowest address in [MMAPBASE, MMAPTOP) with room for len
+// bytes that no region uses.  Returns 0 if there is none.
+static uintptr_t
+mmap_findva(size_t len)
+{
+	uintptr_t va;
+	int i;
+
+	va = MMAPBASE;
+ again:
+	if (va + len < va || va + len > MMAPTOP)
+		return 0;
+	for (i = 0; i < NMMAP; i++)
+		if (mmaptab[i].m_va && mmaptab[i].m_va < va + len
+		    && va < mmaptab[i].m_va + mmaptab[i].m_len) {
+			va = mmaptab[i].m_va + mmaptab[i].m_len;
+			goto again;
+		}
+	return va;
+}
+
+static struct Mmap *
+mmap_lookup(uintptr_t va)
+{
+	int i;
+
+	for (i = 0; i < NMMAP; i++)
+		if (mmaptab[i].m_va && mmaptab[i].m_va <= va
+		    && va < mmaptab[i].m_va + mmaptab[i].m_len)
+			return &mmaptab[i];
+	return NULL;
+}
+
+// Map len bytes of the file open as fd, from the page-aligned offset
+// on, at an address of our choosing, which is stored in *va_store.
+// prot is PROT_READ, optionally with PROT_WRITE.  Writes to a
+// MAP_PRIVATE region stay private to this environment (and are copied
+// on write across fork); MAP_SHARED regions must be read-only.
+// Touching a page wholly past the end of file panics.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if an argument is bad or fd is open write-only.
+//	-E_NOT_SUPP if fd is not a file, or for writable MAP_SHARED.
+//	-E_NO_MEM if there are no free regions or no room for this one.
+int
+mmap(int fdnum, off_t offset, size_t len, int prot, int flags, void **va_store)
+{
+	struct Fd *fd;
+	struct Mmap *m;
+	uintptr_t va;
+	int i, r;
+
+	if ((r = fd_lookup(fdnum, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_NOT_SUPP;
+	if ((fd->fd_omode & O_ACCMODE) == O_WRONLY)
+		return -E_INVAL;
+	if (offset < 0 || PGOFF(offset) || len == 0
+	    || !(prot & PROT_READ) || (prot & ~(PROT_READ|PROT_WRITE))
+	    || (flags != MAP_SHARED && flags != MAP_PRIVATE))
+		return -E_INVAL;
+	if (flags == MAP_SHARED && (prot & PROT_WRITE))
+		return -E_NOT_SUPP;
+
+	for (i = 0; i < NMMAP; i++)
+		if (mmaptab[i].m_va == 0)
+			break;
+	if (i == NMMAP)
+		return -E_NO_MEM;
+	len = ROUNDUP(len, PGSIZE);
+	if ((va = mmap_findva(len)) == 0)
+		return -E_NO_MEM;
+	if ((r = sys_page_map(0, fd, 0, (void*) (MMAPFD + i*PGSIZE),
+			      PTE_P|PTE_U)) < 0)
+		return r;
+
+	pgfault_init();
+	m = &mmaptab[i];
+	m->m_va = va;
+	m->m_len = len;
+	m->m_off = offset;
+	m->m_prot = prot;
+	m->m_flags = flags;
+	m->m_fileid = fd->fd_file.id;
+	*va_store = (void*) va;
+	return 0;
+}
+
+// Remove the region that mmap returned at va.
+// Returns 0 on success, -E_INVAL if there is no region starting at va.
+int
+munmap(void *va)
+{
+	struct Mmap *m;
+	uintptr_t p;
+
+	if ((m = mmap_lookup((uintptr_t) va)) == NULL || m->m_va != (uintptr_t) va)
+		return -E_INVAL;
+	for (p = m->m_va; p < m->m_va + m->m_len; p += PGSIZE)
+		if (va_mapped(p))
+			sys_page_unmap(0, (void*) p);
+	sys_page_unmap(0, (void*) (MMAPFD + (m - mmaptab)*PGSIZE));
+	m->m_va = 0;
+	return 0;
+}
+
+// Remove every region, as exec does: the new program image must not
+// inherit the old one's mappings.
+void
+munmap_all(void)
+{
+	int i;
+
+	for (i = 0; i < NMMAP; i++)
+		if (mmaptab[i].m_va)
+			munmap((void*) mmaptab[i].m_va);
+}
+
+// Called by the page fault handler.  If addr lies in an mmap region and
+// is not mapped yet, map it and up to MMAPRUN - 1 following unmapped
+// pages of the region, and return 1.  Otherwise return 0 and leave the
+// fault to the caller (a write to a mapped private page is an ordinary
+// copy-on-write fault).
+int
+mmap_fault(void *addr, uint32_t err)
+{
+	struct Mmap *m;
+	uintptr_t va, end, p;
+	int n, r;
+
+	va = ROUNDDOWN((uintptr_t) addr, PGSIZE);
+	if ((m = mmap_lookup(va)) == NULL || va_mapped(va))
+		return 0;
+	if ((err & FEC_WR) && !(m->m_prot & PROT_WRITE))
+		panic("mmap: write to read-only region at %08x", addr);
+
+	end = m->m_va + m->m_len;
+	for (n = 1; n < MMAPRUN && va + n*PGSIZE < end; n++)
+		if (va_mapped(va + n*PGSIZE))
+			break;
+	if ((n = fsmap(m->m_fileid, m->m_off + (va - m->m_va), (void*) va, n)) < 0)
+		panic("mmap: fsmap %08x: %e", addr, n);
+	if (n == 0)
+		panic("mmap: access past end of file at %08x", addr);
+
+	if (m->m_prot & PROT_WRITE)
+		for (p = va; p < va + n*PGSIZE; p += PGSIZE)
+			if ((r = sys_page_map(0, (void*) p, 0, (void*) p,
+					      PTE_P|PTE_U|PTE_COW)) < 0)
+				panic("mmap: sys_page_map: %e", r);
+	return 1;
+}
@@ -1,3 +1,4 @@
+#include <inc/x86.h>
 #include <inc/lib.h>
 
 #define debug 0
@@ -6,6 +7,10 @@ static ssize_t devpipe_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devpipe_write(struct Fd *fd, const void *buf, size_t n);
 static int devpipe_stat(struct Fd *fd, struct Stat *stat);
 static int devpipe_close(struct Fd *fd);
+static ssize_t devpipe_rbuf(struct Fd *fd, const void **buf, size_t n);
+static void devpipe_consume(struct Fd *fd, size_t n);
+static ssize_t devpipe_wbuf(struct Fd *fd, void **buf, size_t n);
+static void devpipe_commit(struct Fd *fd, size_t n);
 
 struct Dev devpipe =
 {
@@ -15,16 +20,33 @@ struct Dev devpipe =
 	.dev_write =	devpipe_write,
 	.dev_close =	devpipe_close,
 	.dev_stat =	devpipe_stat,
+	.dev_rbuf =	devpipe_rbuf,
+	.dev_consume =	devpipe_consume,
+	.dev_wbuf =	devpipe_wbuf,
+	.dev_commit =	devpipe_commit,
 };
 
-#define PIPEBUFSIZ 32		// small to provoke races
+// Sleepers wake at least this often (in timer ticks) to recheck
+// pipeisclosed, in case a close slipped in just before they slept.
+#define PIPEWAIT	10
 
 struct Pipe {
-	off_t p_rpos;		// read position
-	off_t p_wpos;		// write position
-	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
+	off_t p_rpos;		// read position, modulo 2 * PIPEBUFSIZ
+	off_t p_wpos;		// write position, modulo 2 * PIPEBUFSIZ
+	volatile uint32_t p_seq;	// bumped whenever rpos or wpos moves
+	volatile uint32_t p_nsleep;	// envs sleeping on p_seq
+	uint8_t p_buf[];	// data buffer, to the end of the page
 };
 
+#define PIPEBUFSIZ	(PGSIZE - sizeof(struct Pipe))
+
+// Number of bytes in the pipe.
+static size_t
+pipe_count(struct Pipe *p)
+{
+	return (p->p_wpos - p->p_rpos + 2 * PIPEBUFSIZ) % (2 * PIPEBUFSIZ);
+}
+
 int
 pipe(int pfd[2])
 {
@@ -101,11 +123,115 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Sleep until the pipe changes from the state in which p_seq was 'seq'.
+static void
+pipe_sleep(struct Fd *fd, struct Pipe *p, uint32_t seq)
+{
+	if (debug)
+		cprintf("[%08x] pipe sleep %08x\n", thisenv->env_id, seq);
+	xadd(&p->p_nsleep, 1);
+	// Registering as a sleeper is a full barrier, so anyone who
+	// changes p_seq after this point will also see p_nsleep != 0.
+	if (!_pipeisclosed(fd, p))
+		sys_futex_wait(&p->p_seq, seq, PIPEWAIT);
+	xadd(&p->p_nsleep, -1);
+}
+
+// Note that rpos or wpos moved and wake anyone sleeping on it.
+static void
+pipe_wakeup(struct Pipe *p)
+{
+	xadd(&p->p_seq, 1);
+	if (p->p_nsleep)
+		sys_futex_wake(&p->p_seq, NENV);
+}
+
+// Wait for data, then point *buf at up to n contiguous readable bytes.
+// Returns the number of bytes available there, or 0 at eof.
+static ssize_t
+devpipe_rbuf(struct Fd *fd, const void **buf, size_t n)
+{
+	size_t m, pos;
+	uint32_t seq;
+	struct Pipe *p;
+
+	p = (struct Pipe*) fd2data(fd);
+	while (1) {
+		// read p_seq before looking at the positions,
+		// so a write after this point makes pipe_sleep return
+		seq = p->p_seq;
+		if ((m = pipe_count(p)) > 0)
+			break;
+		// pipe is empty
+		// if all the writers are gone, note eof
+		if (_pipeisclosed(fd, p))
+			return 0;
+		pipe_sleep(fd, p, seq);
+	}
+	pos = p->p_rpos % PIPEBUFSIZ;
+	*buf = &p->p_buf[pos];
+	return MIN(MIN(m, n), PIPEBUFSIZ - pos);
+}
+
+// Retire n bytes returned by devpipe_rbuf.
+static void
+devpipe_consume(struct Fd *fd, size_t n)
+{
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+
+	// wait to advance rpos until the bytes are taken!
+	__asm __volatile("" : : : "memory");
+	p->p_rpos = (p->p_rpos + n) % (2 * PIPEBUFSIZ);
+	pipe_wakeup(p);
+}
+
+// Wait for free space, then point *buf at up to n contiguous free bytes.
+// Returns the number of bytes available there, or 0 if the readers
+// are all gone.
+static ssize_t
+devpipe_wbuf(struct Fd *fd, void **buf, size_t n)
+{
+	size_t m, pos;
+	uint32_t seq;
+	struct Pipe *p;
+
+	p = (struct Pipe*) fd2data(fd);
+	while (1) {
+		seq = p->p_seq;
+		if ((m = PIPEBUFSIZ - pipe_count(p)) > 0)
+			break;
+		// pipe is full
+		// if all the readers are gone
+		// (it's only writers like us now),
+		// note eof
+		if (_pipeisclosed(fd, p))
+			return 0;
+		pipe_sleep(fd, p, seq);
+	}
+	pos = p->p_wpos % PIPEBUFSIZ;
+	*buf = &p->p_buf[pos];
+	return MIN(MIN(m, n), PIPEBUFSIZ - pos);
+}
+
+// Publish n bytes stored through devpipe_wbuf.
+static void
+devpipe_commit(struct Fd *fd, size_t n)
+{
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+
+	// wait to advance wpos until the bytes are stored!
+	__asm __volatile("" : : : "memory");
+	p->p_wpos = (p->p_wpos + n) % (2 * PIPEBUFSIZ);
+	pipe_wakeup(p);
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	uint8_t *buf;
 	size_t i;
+	ssize_t m;
+	const void *src;
 	struct Pipe *p;
 
 	p = (struct Pipe*)fd2data(fd);
@@ -114,24 +240,14 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
-			// pipe is empty
-			// if we got any data, return it
-			if (i > 0)
-				return i;
-			// if all the writers are gone, note eof
-			if (_pipeisclosed(fd, p))
-				return 0;
-			// yield and see what happens
-			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
-		}
-		// there's a byte.  take it.
-		// wait to increment rpos until the byte is taken!
-		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
-		p->p_rpos++;
+	for (i = 0; i < n; i += m) {
+		// if we got any data and the pipe is empty, return it
+		if (i > 0 && pipe_count(p) == 0)
+			return i;
+		if ((m = devpipe_rbuf(fd, &src, n - i)) <= 0)
+			return i;
+		memmove(buf + i, src, m);
+		devpipe_consume(fd, m);
 	}
 	return i;
 }
@@ -141,6 +257,8 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
 	const uint8_t *buf;
 	size_t i;
+	ssize_t m;
+	void *dst;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -149,23 +267,11 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
 	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
-			// pipe is full
-			// if all the readers are gone
-			// (it's only writers like us now),
-			// note eof
-			if (_pipeisclosed(fd, p))
-				return 0;
-			// yield and see what happens
-			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
-		}
-		// there's room for a byte.  store it.
-		// wait to increment wpos until the byte is stored!
-		p->p_buf[p->p_wpos % PIPEBUFSIZ] = buf[i];
-		p->p_wpos++;
+	for (i = 0; i < n; i += m) {
+		if ((m = devpipe_wbuf(fd, &dst, n - i)) <= 0)
+			return 0;
+		memmove(dst, buf + i, m);
+		devpipe_commit(fd, m);
 	}
 
 	return i;
@@ -176,7 +282,7 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 {
 	struct Pipe *p = (struct Pipe*) fd2data(fd);
 	strcpy(stat->st_name, "<pipe>");
-	stat->st_size = p->p_wpos - p->p_rpos;
+	stat->st_size = pipe_count(p);
 	stat->st_isdir = 0;
 	stat->st_dev = &devpipe;
 	return 0;
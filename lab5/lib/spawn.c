@@ -5,7 +5,6 @@
 #define UTEMP2USTACK(addr)	((void*) (addr) + (USTACKTOP - PGSIZE) - UTEMP)
 #define UTEMP2			(UTEMP + PGSIZE)
 #define UTEMP3			(UTEMP2 + PGSIZE)
-#define DTEMP 0x80000000 
 // Helper functions for spawn.
 static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp, int stack_addr);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
@@ -259,6 +258,7 @@ exec(const char *prog, const char **argv)
 		return -E_NOT_EXEC;
 	}
 
+	munmap_all();
 	uint32_t now_addr = DTEMP;
 	ph = (struct Proghdr *) (elf_buf + elf->e_phoff);
 	for (i = 0; i < elf->e_phnum; i++, ph++) {
@@ -409,12 +409,21 @@ error:
 	return r;
 }
 
+// Map a segment of the program in 'fd' into child at va.
+// Pages of file data are the file server's block cache pages (see
+// fsmap), so every instance of a program shares them: read-only in
+// read-only segments, copy-on-write in writable ones (libmain installs
+// the page fault handler when it finds them).  A page where the file
+// data ends but the segment goes on is a private copy with the rest
+// zeroed, and pages past it are fresh.  exec (child 0) has sys_exec
+// remap the pages writable, so it copies all of a writable segment.
 static int
 map_segment(envid_t child, uintptr_t va, size_t memsz,
 	int fd, size_t filesz, off_t fileoffset, int perm)
 {
-	int i, r;
-	void *blk;
+	int i, j, n, r;
+	struct Fd *f;
+	size_t share;
 
 	//cprintf("map_segment %x+%x\n", va, memsz);
 
@@ -424,23 +433,51 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 		filesz += i;
 		fileoffset -= i;
 	}
+	if ((r = fd_lookup(fd, &f)) < 0)
+		return r;
+
+	// how much of the file data can be shared
+	if (perm & PTE_W)
+		share = child ? ROUNDDOWN(filesz, PGSIZE) : 0;
+	else if (memsz > filesz)
+		share = ROUNDDOWN(filesz, PGSIZE);
+	else
+		share = ROUNDUP(filesz, PGSIZE);
 
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
 			// allocate a blank page
 			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
 				return r;
-		} else {
-			// from file
-			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
+		} else if (i >= share) {
+			// from file, as many pages per request as the
+			// file server will send
 			if ((r = seek(fd, fileoffset + i)) < 0)
 				return r;
-			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
-				return r;
-			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
-				panic("spawn: sys_page_map data: %e", r);
-			sys_page_unmap(0, UTEMP);
+			if ((n = readpages(fd, UTEMP, MIN(filesz - i, FSREQ_MAXPAGES * PGSIZE))) < 0)
+				return n;
+			if (n == 0)
+				return -E_NOT_EXEC;
+			for (j = 0; j < n; j += PGSIZE) {
+				if ((r = sys_page_map(0, UTEMP + j, child, (void*) (va + i + j), perm)) < 0)
+					panic("spawn: sys_page_map data: %e", r);
+				sys_page_unmap(0, UTEMP + j);
+			}
+			i += j - PGSIZE;
+		} else {
+			// shared block cache pages
+			n = MIN((share - i) / PGSIZE, FSREQ_MAXPAGES);
+			if ((n = fsmap(f->fd_file.id, fileoffset + i, UTEMP, n)) < 0)
+				return n;
+			if (n == 0)
+				return -E_NOT_EXEC;
+			for (j = 0; j < n * PGSIZE; j += PGSIZE) {
+				if ((r = sys_page_map(0, UTEMP + j, child, (void*) (va + i + j),
+						      (perm & PTE_W) ? PTE_P|PTE_U|PTE_COW : perm)) < 0)
+					panic("spawn: sys_page_map text: %e", r);
+				sys_page_unmap(0, UTEMP + j);
+			}
+			i += j - PGSIZE;
 		}
 	}
 	return 0;
@@ -0,0 +1,203 @@
+// Blocking synchronization primitives built on sys_futex_wait/wake.
+//
+// The mutex is the classic three-state futex mutex: the fast paths
+// are a single atomic instruction, and only contended operations
+// enter the kernel.  Objects may be placed in a PTE_SHARE page to
+// synchronize environments; futexes are keyed by physical address.
+// The reader/writer lock works the same way, and lets writers waiting
+// for it go ahead of new readers.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+void
+mutex_init(struct Mutex *m)
+{
+	m->m_state = 0;
+}
+
+void
+mutex_lock(struct Mutex *m)
+{
+	uint32_t c;
+
+	if ((c = cmpxchg(&m->m_state, 0, 1)) == 0)
+		return;
+	do {
+		// Announce that there are waiters, then sleep.
+		if (c == 2 || cmpxchg(&m->m_state, 1, 2) != 0)
+			sys_futex_wait(&m->m_state, 2, 0);
+	} while ((c = cmpxchg(&m->m_state, 0, 2)) != 0);
+}
+
+// Returns 0 if the lock was acquired, -E_AGAIN if it is held.
+int
+mutex_trylock(struct Mutex *m)
+{
+	return cmpxchg(&m->m_state, 0, 1) == 0 ? 0 : -E_AGAIN;
+}
+
+void
+mutex_unlock(struct Mutex *m)
+{
+	if (xadd(&m->m_state, -1) != 1) {
+		m->m_state = 0;
+		sys_futex_wake(&m->m_state, 1);
+	}
+}
+
+void
+cond_init(struct Cond *c)
+{
+	c->c_seq = 0;
+}
+
+// Atomically release 'm' and wait for a signal on 'c', then reacquire
+// 'm'.  'timeout' is in timer ticks, 0 meaning forever.
+// Returns 0 or -E_TIMEOUT.  Wakeups may be spurious.
+int
+cond_wait(struct Cond *c, struct Mutex *m, uint32_t timeout)
+{
+	uint32_t seq = c->c_seq;
+	int r;
+
+	mutex_unlock(m);
+	r = sys_futex_wait(&c->c_seq, seq, timeout);
+	mutex_lock(m);
+	return r == -E_TIMEOUT ? r : 0;
+}
+
+void
+cond_signal(struct Cond *c)
+{
+	xadd(&c->c_seq, 1);
+	sys_futex_wake(&c->c_seq, 1);
+}
+
+void
+cond_broadcast(struct Cond *c)
+{
+	xadd(&c->c_seq, 1);
+	sys_futex_wake(&c->c_seq, NENV);
+}
+
+void
+sem_init(struct Sem *s, uint32_t count)
+{
+	s->s_count = count;
+	s->s_nwaiters = 0;
+}
+
+// Returns 0 if the semaphore was decremented, -E_AGAIN if it is zero.
+int
+sem_trywait(struct Sem *s)
+{
+	uint32_t v;
+
+	while ((v = s->s_count) > 0)
+		if (cmpxchg(&s->s_count, v, v - 1) == v)
+			return 0;
+	return -E_AGAIN;
+}
+
+// Decrement 's', sleeping while it is zero.  'timeout' bounds each
+// sleep, in timer ticks (0 means forever).  Returns 0 or -E_TIMEOUT.
+int
+sem_wait(struct Sem *s, uint32_t timeout)
+{
+	int r;
+
+	while (sem_trywait(s) < 0) {
+		xadd(&s->s_nwaiters, 1);
+		r = sys_futex_wait(&s->s_count, 0, timeout);
+		xadd(&s->s_nwaiters, -1);
+		if (r == -E_TIMEOUT)
+			return r;
+	}
+	return 0;
+}
+
+void
+sem_post(struct Sem *s)
+{
+	xadd(&s->s_count, 1);
+	if (s->s_nwaiters)
+		sys_futex_wake(&s->s_count, 1);
+}
+
+void
+rwlock_init(struct Rwlock *rw)
+{
+	rw->rw_state = 0;
+	rw->rw_writers = 0;
+	rw->rw_seq = 0;
+	rw->rw_nwaiters = 0;
+}
+
+// Sleep until rw may have come free since seq was read.
+static void
+rwlock_sleep(struct Rwlock *rw, uint32_t seq)
+{
+	sys_futex_wait(&rw->rw_seq, seq, 0);
+	xadd(&rw->rw_nwaiters, -1);
+}
+
+// Take rw shared with other readers.
+void
+rwlock_rdlock(struct Rwlock *rw)
+{
+	uint32_t v, seq;
+
+	while (1) {
+		v = rw->rw_state;
+		if (!(v & RW_WRITER) && !rw->rw_writers) {
+			if (cmpxchg(&rw->rw_state, v, v + 1) == v)
+				return;
+			continue;
+		}
+		// Count ourselves in before looking again, so that an
+		// unlock in between either is seen or wakes us.
+		xadd(&rw->rw_nwaiters, 1);
+		seq = rw->rw_seq;
+		v = rw->rw_state;
+		if (!(v & RW_WRITER) && !rw->rw_writers) {
+			xadd(&rw->rw_nwaiters, -1);
+			continue;
+		}
+		rwlock_sleep(rw, seq);
+	}
+}
+
+// Take rw exclusively.
+void
+rwlock_wrlock(struct Rwlock *rw)
+{
+	uint32_t seq;
+
+	if (cmpxchg(&rw->rw_state, 0, RW_WRITER) == 0)
+		return;
+	xadd(&rw->rw_writers, 1);
+	while (1) {
+		xadd(&rw->rw_nwaiters, 1);
+		seq = rw->rw_seq;
+		if (cmpxchg(&rw->rw_state, 0, RW_WRITER) == 0) {
+			xadd(&rw->rw_nwaiters, -1);
+			break;
+		}
+		rwlock_sleep(rw, seq);
+	}
+	xadd(&rw->rw_writers, -1);
+}
+
+// Release rw, held either shared or exclusively.
+void
+rwlock_unlock(struct Rwlock *rw)
+{
+	if (rw->rw_state == RW_WRITER)
+		rw->rw_state = 0;
+	else if (xadd(&rw->rw_state, -1) != 1)
+		return;
+	xadd(&rw->rw_seq, 1);
+	if (rw->rw_nwaiters)
+		sys_futex_wake(&rw->rw_seq, NENV);
+}
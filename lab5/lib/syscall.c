@@ -122,6 +122,49 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_try_sendv(envid_t envid, uint32_t value, void *srcva, int npages, int perm)
+{
+	return syscall(SYS_ipc_try_sendv, 0, envid, value, (uint32_t) srcva, npages, perm);
+}
+
+int
+sys_ipc_recvv(void *dstva, int npages, uint32_t timeout)
+{
+	return syscall(SYS_ipc_recvv, 1, (uint32_t)dstva, npages, timeout, 0, 0);
+}
+
+int
+sys_futex_wait(const volatile uint32_t *addr, uint32_t expected, uint32_t timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, expected, timeout, 0, 0);
+}
+
+int
+sys_futex_wake(const volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+int
+sys_irq_forward(int irq, volatile uint32_t *counter)
+{
+	return syscall(SYS_irq_forward, 0, irq, (uint32_t) counter, 0, 0, 0);
+}
+
+int
+sys_page_phys(void *va, int npages, physaddr_t *pa)
+{
+	return syscall(SYS_page_phys, 0, (uint32_t) va, npages, (uint32_t) pa, 0, 0);
+}
+
+envid_t
+sys_thread_create(void *eip, void *esp, void *xstacktop)
+{
+	return syscall(SYS_thread_create, 0, (uint32_t) eip, (uint32_t) esp,
+		       (uint32_t) xstacktop, 0, 0);
+}
+
 int
 sys_exec(uint32_t eip , uint32_t esp , void * v_ph , uint32_t phnum) 
 {
@@ -0,0 +1,141 @@
+// Measure path lookup latency in large directories.  Fills a fresh
+// directory with empty files, growing it through each of the given
+// sizes, and at each size times opening every file by name, looking
+// up as many names that are not there (the worst case for a scan), and
+// listing the directory with readdir().  The files are removed
+// afterwards.
+//
+// usage: dirbench [-m cpu-mhz] [nentries...]
+//
+// The default sizes are 100, 1000 and 10000.  100000 entries take
+// 6250 directory blocks, more than the stock 4096-block disk has.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define DIR		"/dirbench"
+// Most entries a directory can hold
+#define MAXENTRIES	(MAXEXTFILESIZE / sizeof(struct File))
+
+uint32_t mhz = 2000;
+
+void
+usage(void)
+{
+	printf("usage: dirbench [-m cpu-mhz] [nentries...]\n");
+	exit();
+}
+
+void
+name(char *buf, const char *prefix, int i)
+{
+	snprintf(buf, MAXPATHLEN, "%s/%s%d", DIR, prefix, i);
+}
+
+// Directory entries, a request's worth at a time
+char dirbuf[PGSIZE] __attribute__((aligned(4)));
+
+// List DIR, which should hold n entries, and return the number of
+// requests that took.
+int
+list(int n)
+{
+	int fd, r, nreq = 1, nentries = 0;
+	struct Dirent *d;
+
+	if ((fd = open(DIR, O_RDONLY)) < 0)
+		panic("open %s: %e", DIR, fd);
+	while ((r = readdir(fd, dirbuf, sizeof dirbuf)) > 0) {
+		nreq++;
+		for (d = (struct Dirent*) dirbuf; (char*) d < dirbuf + r;
+		     d = (struct Dirent*) ((char*) d + DIRENT_SIZE(d->d_namelen)))
+			nentries++;
+	}
+	if (r < 0)
+		panic("readdir %s: %e", DIR, r);
+	if (nentries != n)
+		panic("readdir %s: %d entries, not %d", DIR, nentries, n);
+	close(fd);
+	return nreq;
+}
+
+void
+report(const char *what, int n, uint64_t cycles)
+{
+	printf("dirbench %d entries, %s: %d cycles, %d us per lookup at %d MHz\n",
+	       n, what, (uint32_t) (cycles / n),
+	       (uint32_t) (cycles / n / mhz), mhz);
+}
+
+void
+umain(int argc, char **argv)
+{
+	static const char *defsizes[] = { "", "100", "1000", "10000" };
+	char path[MAXPATHLEN];
+	int i, j, r, fd, n, nfiles = 0;
+	uint64_t start;
+	struct Argstate args;
+
+	binaryname = "dirbench";
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 'm':
+			mhz = strtol(argvalue(&args), 0, 0);
+			break;
+		default:
+			usage();
+		}
+	if (mhz == 0)
+		usage();
+	if (argc < 2) {
+		argc = sizeof(defsizes) / sizeof(defsizes[0]);
+		argv = (char **) defsizes;
+	}
+
+	if ((fd = open(DIR, O_RDONLY|O_CREAT|O_MKDIR)) < 0)
+		panic("mkdir %s: %e", DIR, fd);
+	close(fd);
+
+	for (j = 1; j < argc; j++) {
+		n = strtol(argv[j], 0, 0);
+		if (n <= 0 || n > MAXENTRIES)
+			usage();
+		for (; nfiles < n; nfiles++) {
+			name(path, "f", nfiles);
+			if ((fd = open(path, O_RDONLY|O_CREAT|O_EXCL)) < 0)
+				panic("create %s: %e", path, fd);
+			close(fd);
+		}
+
+		start = read_tsc();
+		for (i = 0; i < n; i++) {
+			name(path, "f", i);
+			if ((fd = open(path, O_RDONLY)) < 0)
+				panic("open %s: %e", path, fd);
+			close(fd);
+		}
+		report("open", n, read_tsc() - start);
+
+		start = read_tsc();
+		for (i = 0; i < n; i++) {
+			name(path, "missing", i);
+			if ((r = open(path, O_RDONLY)) != -E_NOT_FOUND)
+				panic("open %s: got %e", path, r);
+		}
+		report("missing", n, read_tsc() - start);
+
+		start = read_tsc();
+		r = list(n);
+		printf("dirbench %d entries, list: %d requests, %d cycles per entry\n",
+		       n, r, (uint32_t) ((read_tsc() - start) / n));
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		name(path, "f", i);
+		if ((r = remove(path)) < 0)
+			panic("remove %s: %e", path, r);
+	}
+	if ((r = remove(DIR)) < 0)
+		panic("remove %s: %e", DIR, r);
+}
@@ -0,0 +1,541 @@
+// File system benchmarks, timed with the TSC.
+//
+// usage: fsbench [-cswPDi] [-b budget] [-m cpu-mhz] [-o nopen] [-p nclients]
+//		[-r reps] mode [file]
+//
+// -c times a single pass without warming the block cache first; it
+// measures the disk only the first time a file is read after boot
+// (use /bigfile), or with a budget smaller than the file.
+// -b sets the block cache budget, in blocks, and -s prints the cache
+// statistics afterwards.  -w makes the file server write through,
+// syncing after every change, for the run; compare write with and
+// without it.  -P turns the file server's path lookup cache off for
+// the run.  -D makes the file server move disk blocks by PIO instead of
+// DMA for the run.  -i runs a child that spins while the benchmark
+// does, and reports how much of the CPU it got: with -c and one CPU,
+// the CPU time a disk transfer leaves to other environments.  -p runs
+// one of the reading modes in nclients children at once, each reading
+// the file reps times, and reports their total throughput: with more
+// than one CPU, how well the file server's workers serve clients in
+// parallel.  -o keeps the file open nopen more times for the run,
+// crowding the file server's open-file table; compare open with and
+// without it.
+//
+// Modes:
+//	read	sequential read() of file with an 8 KB buffer
+//	readv	sequential readpages() of file, 64 KB at a time
+//	rand	RANDREADS page-sized read()s of file at random page offsets
+//	arand	the same reads by fsa_read(), a ring's worth in flight
+//	async	page-sized fsa_read()s of file, a ring's worth in flight
+//	mmap	mmap() of file, touching every word
+//	write	write() of 1 MB to file (default /fsbench.tmp) with an 8 KB
+//		buffer, then close(), which flushes it unless the disk has a
+//		journal (then it goes out at the next commit); the file is
+//		removed
+//	open	OPENREPS open()s and close()s of a file 8 directories deep
+//		(default /fsbench.d/d1/.../d7/file), made if need be
+//	files	FILEREPS files of one block each made in a directory (default
+//		/fsbench.f), synced, and removed; compare with -w, which
+//		commits each change on its own rather than in one group
+//
+// To compare the IDE disk with a RAM disk, run the same modes on a file
+// server built with "make FS_RAMDISK=1"; -s says which disk it is on.
+// Likewise, to measure reading compressed files, build the image with
+// "make FS_LZ4=1" and read a program (say -c read /sh) cold; -s counts
+// the blocks decompressed.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define BUFSIZE		(FSREQ_MAXPAGES * PGSIZE)
+
+char buf[BUFSIZE] __attribute__((aligned(PGSIZE)));
+
+uint32_t mhz = 2000;
+
+void
+usage(void)
+{
+	printf("usage: fsbench [-cswPDi] [-b budget] [-m cpu-mhz] [-o nopen] [-p nclients] [-r reps] read|readv|rand|arand|async|mmap|write|open|files [file]\n");
+	exit();
+}
+
+int
+xopen(const char *path)
+{
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	return fd;
+}
+
+size_t
+bench_read(const char *path)
+{
+	int fd, n;
+	size_t tot = 0;
+
+	fd = xopen(path);
+	while ((n = read(fd, buf, 8192)) > 0)
+		tot += n;
+	if (n < 0)
+		panic("read: %e", n);
+	close(fd);
+	return tot;
+}
+
+size_t
+bench_readv(const char *path)
+{
+	int fd, n;
+	size_t tot = 0;
+
+	fd = xopen(path);
+	while ((n = readpages(fd, buf, BUFSIZE)) > 0)
+		tot += n;
+	if (n < 0)
+		panic("readpages: %e", n);
+	close(fd);
+	return tot;
+}
+
+#define RANDREADS	256
+
+// The same pseudo-random sequence of page offsets into fd every run
+off_t
+randpage(int fd, uint32_t *seed)
+{
+	static uint32_t npages;
+	struct Stat st;
+	int r;
+
+	if (*seed == 0) {
+		if ((r = fstat(fd, &st)) < 0)
+			panic("fstat: %e", r);
+		if ((npages = st.st_size / PGSIZE) == 0)
+			panic("file is smaller than a page");
+		*seed = 1;
+	}
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed >> 8) % npages * PGSIZE;
+}
+
+size_t
+bench_rand(const char *path)
+{
+	int fd, i, n;
+	uint32_t seed = 0;
+
+	fd = xopen(path);
+	for (i = 0; i < RANDREADS; i++) {
+		seek(fd, randpage(fd, &seed));
+		if ((n = read(fd, buf, PGSIZE)) != PGSIZE)
+			panic("read: %e", n);
+	}
+	close(fd);
+	return RANDREADS * PGSIZE;
+}
+
+size_t
+bench_arand(const char *path)
+{
+	int fd, i, j, n, tag[FSRING_NSLOT];
+	uint32_t seed = 0;
+
+	fd = xopen(path);
+	for (i = 0; i < RANDREADS; i += j) {
+		for (j = 0; j < FSRING_NSLOT && i + j < RANDREADS; j++)
+			if ((tag[j] = fsa_read(fd, buf + j * PGSIZE, PGSIZE,
+					       randpage(fd, &seed))) < 0)
+				panic("fsa_read: %e", tag[j]);
+		for (n = 0; n < j; n++)
+			if ((tag[n] = fsa_wait(tag[n])) != PGSIZE)
+				panic("fsa_wait: %e", tag[n]);
+	}
+	close(fd);
+	return RANDREADS * PGSIZE;
+}
+
+size_t
+bench_async(const char *path)
+{
+	int fd, i, n, tag[FSRING_NSLOT];
+	size_t tot = 0;
+	off_t off = 0;
+	struct Stat st;
+
+	fd = xopen(path);
+	if ((n = fstat(fd, &st)) < 0)
+		panic("fstat: %e", n);
+	while (off < st.st_size) {
+		for (i = 0; i < FSRING_NSLOT && off < st.st_size; i++, off += PGSIZE)
+			if ((tag[i] = fsa_read(fd, buf + i * PGSIZE, PGSIZE, off)) < 0)
+				panic("fsa_read: %e", tag[i]);
+		while (--i >= 0) {
+			if ((n = fsa_wait(tag[i])) < 0)
+				panic("fsa_wait: %e", n);
+			tot += n;
+		}
+	}
+	close(fd);
+	return tot;
+}
+
+void
+report(const char *what, size_t bytes, int reps, uint64_t cycles)
+{
+	// bytes / (cycles / mhz) = bytes per microsecond = MB/s
+	printf("fsbench %s: %d KB x %d: %d Mcycles, %d MB/s at %d MHz\n",
+	       what, bytes / 1024, reps, (uint32_t) (cycles / 1000000),
+	       (uint32_t) ((uint64_t) bytes * reps * mhz / (cycles ? cycles : 1)),
+	       mhz);
+}
+
+size_t
+bench_mmap(const char *path)
+{
+	int fd, r;
+	struct Stat st;
+	const uint32_t *p;
+	void *va;
+	volatile uint32_t sum = 0;
+	size_t i;
+
+	fd = xopen(path);
+	if ((r = fstat(fd, &st)) < 0)
+		panic("fstat: %e", r);
+	if ((r = mmap(fd, 0, st.st_size, PROT_READ, MAP_SHARED, &va)) < 0)
+		panic("mmap: %e", r);
+	close(fd);
+	p = va;
+	for (i = 0; i < st.st_size / sizeof(*p); i++)
+		sum += p[i];
+	if ((r = munmap(va)) < 0)
+		panic("munmap: %e", r);
+	return st.st_size;
+}
+
+#define WRITESIZE	(1024 * 1024)
+
+size_t
+bench_write(const char *path)
+{
+	int fd, n;
+	size_t tot;
+
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+		panic("open %s: %e", path, fd);
+	for (tot = 0; tot < WRITESIZE; tot += n)
+		if ((n = write(fd, buf, 8192)) <= 0)
+			panic("write: %e", n);
+	close(fd);
+	if ((n = remove(path)) < 0)
+		panic("remove %s: %e", path, n);
+	return tot;
+}
+
+#define OPENREPS	100
+#define OPENPATH	"/fsbench.d/d1/d2/d3/d4/d5/d6/d7/file"
+
+// Make the directories on the way to path, and path, if need be.
+void
+mkpath(const char *path)
+{
+	char dir[MAXPATHLEN];
+	const char *p;
+	int fd;
+
+	for (p = path + 1; (p = strchr(p, '/')) != NULL; p++) {
+		memmove(dir, path, p - path);
+		dir[p - path] = '\0';
+		if ((fd = open(dir, O_RDONLY|O_CREAT|O_MKDIR)) < 0)
+			panic("mkdir %s: %e", dir, fd);
+		close(fd);
+	}
+	if ((fd = open(path, O_RDONLY|O_CREAT)) < 0)
+		panic("create %s: %e", path, fd);
+	close(fd);
+}
+
+// Returns the number of opens, not bytes.
+size_t
+bench_open(const char *path)
+{
+	int i;
+
+	for (i = 0; i < OPENREPS; i++)
+		close(xopen(path));
+	return OPENREPS;
+}
+
+// Keep path open n times in the file server without using up file
+// descriptors: each open's Fd page is mapped again from CROWDVA, where
+// it stays after the descriptor is closed.  The server's table must
+// keep room for the benchmark's own opens, and other clients'.
+#define CROWDVA		UPRIVBASE
+#define MAXCROWD	(MAXOPEN - 256)
+
+void
+crowd(const char *path, int n)
+{
+	struct Fd *fd;
+	int i, fdnum, r;
+
+	for (i = 0; i < n; i++) {
+		fdnum = xopen(path);
+		if ((r = fd_lookup(fdnum, &fd)) < 0)
+			panic("fd_lookup: %e", r);
+		if ((r = sys_page_map(0, fd, 0, (char*) CROWDVA + i * PGSIZE,
+				      PTE_P|PTE_U)) < 0)
+			panic("sys_page_map: %e", r);
+		close(fdnum);
+	}
+}
+
+#define NCLIENTS	16
+
+// The idle child's counter, in a page shared with it
+volatile uint32_t spins[PGSIZE / 4] __attribute__((aligned(PGSIZE)));
+#define IDLETICKS	100
+
+// Start a child that counts in spins[0] for as long as it gets the
+// CPU, and measure how fast it counts with the CPU to itself, in counts
+// per 1000 cycles.
+envid_t
+idle_start(uint32_t *rate)
+{
+	envid_t child;
+	uint32_t n, dummy = 0;
+	uint64_t start;
+	int r;
+
+	if ((r = sys_page_alloc(0, (void *) spins, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0)
+		for (;;)
+			spins[0]++;
+	n = spins[0];
+	start = read_tsc();
+	// Sleep, leaving the CPU to the child.
+	if ((r = sys_futex_wait(&dummy, 0, IDLETICKS)) != -E_TIMEOUT)
+		panic("sys_futex_wait: %e", r);
+	*rate = (uint64_t) (spins[0] - n) * 1000 / (read_tsc() - start);
+	return child;
+}
+
+// Run bench on path reps times in each of nclients children at once,
+// and wait for them all.
+void
+run_clients(size_t (*bench)(const char *), const char *path, int reps,
+	    int nclients)
+{
+	envid_t child[NCLIENTS];
+	int i, j;
+
+	for (i = 0; i < nclients; i++) {
+		if ((child[i] = fork()) < 0)
+			panic("fork: %e", child[i]);
+		if (child[i] == 0) {
+			for (j = 0; j < reps; j++)
+				bench(path);
+			exit();
+		}
+	}
+	for (i = 0; i < nclients; i++)
+		wait(child[i]);
+}
+
+#define FILEREPS	64
+
+// Returns the number of files, not bytes.
+size_t
+bench_files(const char *path)
+{
+	char name[MAXPATHLEN];
+	int i, fd, r;
+
+	if ((fd = open(path, O_RDONLY|O_CREAT|O_MKDIR)) < 0)
+		panic("mkdir %s: %e", path, fd);
+	close(fd);
+	for (i = 0; i < FILEREPS; i++) {
+		snprintf(name, sizeof(name), "%s/f%d", path, i);
+		if ((fd = open(name, O_WRONLY|O_CREAT|O_TRUNC)) < 0)
+			panic("create %s: %e", name, fd);
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write %s: %e", name, r);
+		close(fd);
+	}
+	sync();
+	for (i = 0; i < FILEREPS; i++) {
+		snprintf(name, sizeof(name), "%s/f%d", path, i);
+		if ((r = remove(name)) < 0)
+			panic("remove %s: %e", name, r);
+	}
+	if ((r = remove(path)) < 0)
+		panic("remove %s: %e", path, r);
+	sync();
+	return FILEREPS;
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r, reps = 10, cold = 0, stats = 0, writethrough = 0;
+	int pathcache = -1, dma = -1, idle = 0, nclients = 0, nopen = 0;
+	envid_t idler = 0;
+	uint32_t rate = 0, nspins = 0;
+	uint32_t budget = 0;
+	struct Fscache c;
+	size_t bytes = 0;
+	uint64_t start, cycles;
+	const char *mode, *path;
+	size_t (*bench)(const char *) = NULL;
+	struct Argstate args;
+
+	binaryname = "fsbench";
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 'b':
+			budget = strtol(argvalue(&args), 0, 0);
+			break;
+		case 'c':
+			cold = 1;
+			break;
+		case 's':
+			stats = 1;
+			break;
+		case 'w':
+			writethrough = 1;
+			break;
+		case 'P':
+			pathcache = 0;
+			break;
+		case 'D':
+			dma = 0;
+			break;
+		case 'i':
+			idle = 1;
+			break;
+		case 'm':
+			mhz = strtol(argvalue(&args), 0, 0);
+			break;
+		case 'o':
+			nopen = strtol(argvalue(&args), 0, 0);
+			break;
+		case 'p':
+			nclients = strtol(argvalue(&args), 0, 0);
+			break;
+		case 'r':
+			reps = strtol(argvalue(&args), 0, 0);
+			break;
+		default:
+			usage();
+		}
+	if (argc < 2 || argc > 3 || mhz == 0 || reps <= 0
+	    || nclients < 0 || nclients > NCLIENTS
+	    || nopen < 0 || nopen > MAXCROWD)
+		usage();
+	mode = argv[1];
+	if (argc == 3)
+		path = argv[2];
+	else if (strcmp(mode, "write") == 0)
+		path = "/fsbench.tmp";
+	else if (strcmp(mode, "open") == 0)
+		path = OPENPATH;
+	else if (strcmp(mode, "files") == 0)
+		path = "/fsbench.f";
+	else
+		path = "/fsbench";
+
+	if (strcmp(mode, "read") == 0)
+		bench = bench_read;
+	else if (strcmp(mode, "readv") == 0)
+		bench = bench_readv;
+	else if (strcmp(mode, "rand") == 0)
+		bench = bench_rand;
+	else if (strcmp(mode, "arand") == 0)
+		bench = bench_arand;
+	else if (strcmp(mode, "async") == 0)
+		bench = bench_async;
+	else if (strcmp(mode, "mmap") == 0)
+		bench = bench_mmap;
+	else if (strcmp(mode, "write") == 0)
+		bench = bench_write;
+	else if (strcmp(mode, "open") == 0) {
+		bench = bench_open;
+		mkpath(path);
+	} else if (strcmp(mode, "files") == 0)
+		bench = bench_files;
+	else
+		usage();
+	if (nclients && (cold || bench == bench_write || bench == bench_open
+			 || bench == bench_files))
+		usage();
+	if (nopen && (bench == bench_write || bench == bench_files))
+		usage();
+
+	if ((r = fscache(budget, writethrough, pathcache, dma, &c)) < 0)
+		panic("fscache: %e", r);
+
+	crowd(path, nopen);
+	// Warm the block cache so we time the file server, not the disk.
+	if (cold)
+		reps = 1;
+	else
+		bytes = bench(path);
+	if (idle)
+		idler = idle_start(&rate);
+	nspins = spins[0];
+	start = read_tsc();
+	if (nclients)
+		run_clients(bench, path, reps, nclients);
+	else
+		for (i = 0; i < reps; i++)
+			bytes = bench(path);
+	cycles = read_tsc() - start;
+	if (bench == bench_open)
+		printf("fsbench open: %d x %d: %d cycles per open%s\n",
+		       bytes, reps, (uint32_t) (cycles / (bytes * reps)),
+		       pathcache ? "" : " (no path cache)");
+	else if (bench == bench_files)
+		printf("fsbench files: %d x %d: %d cycles per file\n",
+		       bytes, reps, (uint32_t) (cycles / (bytes * reps)));
+	else if (nclients) {
+		report(mode, bytes, nclients * reps, cycles);
+		printf("fsbench clients: %d at once\n", nclients);
+	} else
+		report(mode, bytes, reps, cycles);
+	if (idle) {
+		nspins = spins[0] - nspins;
+		sys_env_destroy(idler);
+		printf("fsbench idle: %d%% of the CPU left to others\n",
+		       (uint32_t) ((uint64_t) nspins * 1000 * 100
+				   / (cycles * (rate ? rate : 1))));
+	}
+
+	// Put the write policy, path cache and DMA back; the statistics
+	// come along.
+	if ((r = fscache(0, 0, 1, 1, &c)) < 0)
+		panic("fscache: %e", r);
+	if (stats) {
+		printf("cache: budget %d resident %d hits %d misses %d prefetched %d evictions %d writebacks %d%s\n",
+		       c.c_budget, c.c_resident, c.c_hits, c.c_misses,
+		       c.c_prefetched, c.c_evictions, c.c_writebacks,
+		       writethrough ? " (write-through)" : "");
+		printf("path cache: hits %d misses %d\n",
+		       c.c_pathhits, c.c_pathmisses);
+		printf("disk: %s, %d DMA commands, %d sleeps, %d PIO commands\n",
+		       c.c_ramdisk ? "RAM disk" : c.c_dma && dma ? "DMA" : "PIO",
+		       c.c_dmacmds, c.c_irqwaits,
+		       c.c_piocmds);
+		printf("requests: %d in %d disk commands, %d past the elevator\n",
+		       c.c_bios, c.c_biocmds, c.c_biodeadlines);
+		printf("compressed: %d blocks decompressed\n", c.c_zfills);
+		printf("journal: %d commits, %d blocks journaled\n",
+		       c.c_commits, c.c_journaled);
+	}
+}
@@ -0,0 +1,146 @@
+// Report the file server's statistics: for each request type served,
+// how many, how many failed, the mean latency and a histogram of the
+// latencies, in TSC cycles from the request's arrival to the reply;
+// then the block cache, the disk, and the bytes of file data served.
+//
+// usage: fsstat [-rd] [-t on|off]
+//
+// -r starts the counts afresh after reporting them.  -t turns request
+// tracing on or off, and -d dumps the trace ring of the most recent
+// requests, oldest first, instead of the counts.
+
+#include <inc/lib.h>
+
+static const char *names[FSSTAT_NTYPE] = {
+	[0] =			"invalid",
+	[FSREQ_OPEN] =		"open",
+	[FSREQ_SET_SIZE] =	"set_size",
+	[FSREQ_READ] =		"read",
+	[FSREQ_WRITE] =		"write",
+	[FSREQ_STAT] =		"stat",
+	[FSREQ_FLUSH] =		"flush",
+	[FSREQ_REMOVE] =	"remove",
+	[FSREQ_SYNC] =		"sync",
+	[FSREQ_RING_SETUP] =	"ring_setup",
+	[FSREQ_RING_KICK] =	"ring_kick",
+	[FSREQ_READV] =		"readv",
+	[FSREQ_READ_MAP] =	"read_map",
+	[FSREQ_MAP] =		"map",
+	[FSREQ_CACHE] =		"cache",
+	[FSREQ_READDIR] =	"readdir",
+	[FSREQ_STATS] =		"stats",
+	[FSREQ_SENDFILE] =	"sendfile",
+};
+
+void
+usage(void)
+{
+	printf("usage: fsstat [-rd] [-t on|off]\n");
+	exit();
+}
+
+const char *
+name(uint32_t type)
+{
+	return type < FSSTAT_NTYPE && names[type] ? names[type] : "?";
+}
+
+void
+report(struct Fsstats *st)
+{
+	struct Fsreqstat *rs;
+	struct Fscache *c = &st->st_cache;
+	int t, b;
+
+	printf("fsstat: %d Mcycles of counting\n",
+	       (uint32_t) ((st->st_now - st->st_since) >> 20));
+	printf("%-10s %8s %6s %10s  latency in Kcycles: count\n",
+	       "request", "count", "errors", "mean");
+	for (t = 0; t < FSSTAT_NTYPE; t++) {
+		rs = &st->st_req[t];
+		if (rs->rs_count == 0)
+			continue;
+		printf("%-10s %8d %6d %10d ", name(t), rs->rs_count,
+		       rs->rs_errors, (uint32_t) (rs->rs_cycles / rs->rs_count));
+		for (b = 0; b < FSSTAT_NBUCKET; b++) {
+			if (rs->rs_hist[b] == 0)
+				continue;
+			if (b < FSSTAT_NBUCKET - 1)
+				printf(" <%d:%d", 1 << b, rs->rs_hist[b]);
+			else
+				printf(" >=%d:%d", 1 << (b - 1), rs->rs_hist[b]);
+		}
+		printf("\n");
+	}
+	printf("cache: hits %d misses %d faults %d prefetched %d evictions %d writebacks %d\n",
+	       c->c_hits, c->c_misses, c->c_faults, c->c_prefetched,
+	       c->c_evictions, c->c_writebacks);
+	printf("disk: %d sectors read, %d written\n",
+	       c->c_sectread, c->c_sectwritten);
+	printf("data: %d KB read, %d KB written\n",
+	       (uint32_t) (st->st_bytesread >> 10),
+	       (uint32_t) (st->st_byteswritten >> 10));
+}
+
+void
+dump(struct Fsret_trace *tr)
+{
+	struct Fstrace *t;
+	uint32_t i, n;
+
+	n = MIN(tr->tr_next, FSTRACE_N);
+	printf("fsstat: %d requests traced, the last %d:\n", tr->tr_next, n);
+	for (i = tr->tr_next - n; i != tr->tr_next; i++) {
+		t = &tr->tr_ring[i % FSTRACE_N];
+		printf("%08x%08x %08x %-10s %d, %d cycles\n",
+		       (uint32_t) (t->t_start >> 32), (uint32_t) t->t_start,
+		       t->t_envid, name(t->t_type), t->t_result, t->t_cycles);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	static struct Fsstats st;
+	static struct Fsret_trace tr;
+	int i, r, reset = 0, trace = -1, dumping = 0;
+	const char *v;
+	struct Argstate args;
+
+	binaryname = "fsstat";
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 'r':
+			reset = 1;
+			break;
+		case 'd':
+			dumping = 1;
+			break;
+		case 't':
+			v = argvalue(&args);
+			if (strcmp(v, "on") == 0)
+				trace = 1;
+			else if (strcmp(v, "off") == 0)
+				trace = 0;
+			else
+				usage();
+			break;
+		default:
+			usage();
+		}
+	if (argc > 1)
+		usage();
+
+	if (dumping) {
+		if ((r = fstrace(&tr)) < 0)
+			panic("fstrace: %e", r);
+		dump(&tr);
+		if ((reset || trace >= 0) && (r = fsstats(reset, trace, &st)) < 0)
+			panic("fsstats: %e", r);
+	} else {
+		if ((r = fsstats(reset, trace, &st)) < 0)
+			panic("fsstats: %e", r);
+		report(&st);
+	}
+}
@@ -19,21 +19,24 @@ ls(const char *path, const char *prefix)
 		ls1(0, st.st_isdir, st.st_size, path);
 }
 
+// Directory entries, a request's worth at a time
+char dirbuf[PGSIZE] __attribute__((aligned(4)));
+
 void
 lsdir(const char *path, const char *prefix)
 {
 	int fd, n;
-	struct File f;
+	struct Dirent *d;
 
 	if ((fd = open(path, O_RDONLY)) < 0)
 		panic("open %s: %e", path, fd);
-	while ((n = readn(fd, &f, sizeof f)) == sizeof f)
-		if (f.f_name[0])
-			ls1(prefix, f.f_type==FTYPE_DIR, f.f_size, f.f_name);
-	if (n > 0)
-		panic("short read in directory %s", path);
+	while ((n = readdir(fd, dirbuf, sizeof dirbuf)) > 0)
+		for (d = (struct Dirent*) dirbuf; (char*) d < dirbuf + n;
+		     d = (struct Dirent*) ((char*) d + DIRENT_SIZE(d->d_namelen)))
+			ls1(prefix, d->d_type == FTYPE_DIR, d->d_size, d->d_name);
 	if (n < 0)
 		panic("error reading directory %s: %e", path, n);
+	close(fd);
 }
 
 void
@@ -0,0 +1,114 @@
+// Measure pipe throughput: a child writes a large stream into a pipe
+// and the parent reads it back, timing the transfer with the TSC.
+// With -f, the stream is the file instead, which the child has the
+// file server send straight into the pipe with sendfile(), or with -c
+// copies through its own buffer, as cat did before sendfile.
+//
+// usage: pipebench [-c] [-k kbytes] [-b bufsize] [-m cpu-mhz] [-f file]
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+static char buf[16384] __attribute__((aligned(PGSIZE)));
+
+void
+usage(void)
+{
+	printf("usage: pipebench [-c] [-k kbytes] [-b bufsize] [-m cpu-mhz] [-f file]\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r, pid, p[2], f = -1, copy = 0;
+	size_t total = 4096 * 1024, bufsize = 4096, done;
+	uint32_t mhz = 2000;
+	uint64_t start, cycles;
+	const char *file = NULL;
+	char how[32];
+	struct Argstate args;
+	struct Stat st;
+
+	binaryname = "pipebench";
+	argstart(&argc, argv, &args);
+	while ((i = argnext(&args)) >= 0)
+		switch (i) {
+		case 'k':
+			total = strtol(argvalue(&args), 0, 0) * 1024;
+			break;
+		case 'b':
+			bufsize = strtol(argvalue(&args), 0, 0);
+			break;
+		case 'm':
+			mhz = strtol(argvalue(&args), 0, 0);
+			break;
+		case 'f':
+			file = argvalue(&args);
+			break;
+		case 'c':
+			copy = 1;
+			break;
+		default:
+			usage();
+		}
+	if (bufsize == 0 || bufsize > sizeof(buf) || mhz == 0 || (copy && !file))
+		usage();
+	if (file) {
+		if ((f = open(file, O_RDONLY)) < 0)
+			panic("open %s: %e", file, f);
+		if ((r = fstat(f, &st)) < 0)
+			panic("stat %s: %e", file, r);
+		total = st.st_size;
+	}
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	if ((pid = fork()) < 0)
+		panic("fork: %e", pid);
+
+	if (pid == 0) {
+		close(p[0]);
+		if (file && !copy) {
+			if ((r = sendfile(p[1], f, 0, total)) != total)
+				panic("sendfile: %e", r);
+			exit();
+		}
+		if (file) {
+			for (done = 0; done < total; done += r)
+				if ((r = readpages(f, buf, MIN(bufsize, total - done))) <= 0
+				    || write(p[1], buf, r) != r)
+					panic("copy: %e", r);
+			exit();
+		}
+		memset(buf, 'x', sizeof(buf));
+		for (done = 0; done < total; done += r)
+			if ((r = write(p[1], buf, MIN(bufsize, total - done))) <= 0)
+				panic("write: %e", r);
+		exit();
+	}
+
+	close(p[1]);
+	if (f >= 0)
+		close(f);
+	start = read_tsc();
+	for (done = 0; (r = read(p[0], buf, bufsize)) > 0; done += r)
+		/* do nothing */;
+	if (r < 0)
+		panic("read: %e", r);
+	cycles = read_tsc() - start;
+	wait(pid);
+
+	if (done != total)
+		panic("read %d bytes, expected %d", done, total);
+	// bytes / (cycles / mhz) = bytes per microsecond = MB/s
+	if (!file)
+		snprintf(how, sizeof how, "in %d-byte writes", bufsize);
+	else if (copy)
+		snprintf(how, sizeof how, "copied in %d-byte reads", bufsize);
+	else
+		snprintf(how, sizeof how, "sent by sendfile");
+	printf("pipebench: %d KB %s: %d Mcycles, %d MB/s at %d MHz\n",
+	       total / 1024, how, (uint32_t) (cycles / 1000000),
+	       (uint32_t) ((uint64_t) total * mhz / (cycles ? cycles : 1)), mhz);
+}
@@ -0,0 +1,92 @@
+// Measure spawn latency and the memory each spawned instance holds.
+// Spawns copies of itself that wait for a message before exiting,
+// timing the spawns with the TSC and counting the physical pages
+// they take (private pages plus page tables; text pages shared
+// through the file server's block cache are counted only once).
+//
+// usage: spawnbench [-n instances] [-m cpu-mhz]
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define MAXINST		64
+
+void
+usage(void)
+{
+	printf("usage: spawnbench [-n instances] [-m cpu-mhz]\n");
+	exit();
+}
+
+// Count the physical pages nobody holds a reference to.
+int
+freepages(void)
+{
+	uintptr_t va;
+	int i, n = 0;
+
+	for (i = 0; ; i++) {
+		va = (uintptr_t) &pages[i];
+		if (!(uvpd[PDX(va)] & PTE_P) || !(uvpt[PGNUM(va)] & PTE_P))
+			return n;
+		if (pages[i].pp_ref == 0)
+			n++;
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	int i, r, n = 16, free0, free1;
+	envid_t inst[MAXINST];
+	uint32_t mhz = 2000;
+	uint64_t start, cycles;
+	const char *args[] = { "spawnbench", "-c", 0 };
+	struct Argstate as;
+
+	binaryname = "spawnbench";
+	argstart(&argc, argv, &as);
+	while ((i = argnext(&as)) >= 0)
+		switch (i) {
+		case 'c':
+			// an instance: wait to be told to go
+			ipc_recv(0, 0, 0);
+			return;
+		case 'n':
+			n = strtol(argvalue(&as), 0, 0);
+			break;
+		case 'm':
+			mhz = strtol(argvalue(&as), 0, 0);
+			break;
+		default:
+			usage();
+		}
+	if (argc != 1 || n <= 0 || n > MAXINST || mhz == 0)
+		usage();
+
+	// Warm the block cache so we time spawn, not the disk.
+	if ((r = spawn(args[0], args)) < 0)
+		panic("spawn: %e", r);
+	ipc_send(r, 0, 0, 0);
+	wait(r);
+
+	free0 = freepages();
+	start = read_tsc();
+	for (i = 0; i < n; i++)
+		if ((inst[i] = spawn(args[0], args)) < 0)
+			panic("spawn: %e", inst[i]);
+	cycles = read_tsc() - start;
+	// let every instance run up to its ipc_recv
+	for (i = 0; i < n; i++)
+		while (envs[ENVX(inst[i])].env_status != ENV_NOT_RUNNABLE)
+			sys_yield();
+	free1 = freepages();
+
+	for (i = 0; i < n; i++) {
+		ipc_send(inst[i], 0, 0, 0);
+		wait(inst[i]);
+	}
+
+	printf("spawnbench: %d instances: %d us per spawn at %d MHz, %d pages per instance\n",
+	       n, (uint32_t) (cycles / n / mhz), mhz, (free0 - free1) / n);
+}
@@ -0,0 +1,40 @@
+// Test asynchronous file server requests through the request ring.
+
+#include <inc/lib.h>
+
+char want[1024], async[4][256];
+
+void
+umain(int argc, char **argv)
+{
+	int fd, r, i, n, tag[4], stag;
+	struct Stat st;
+
+	if ((fd = open("/lorem", O_RDONLY)) < 0)
+		panic("open /lorem: %e", fd);
+	if ((n = readn(fd, want, sizeof want)) < 0)
+		panic("readn: %e", n);
+
+	// Put several requests in flight at once, then collect them
+	// out of order.
+	for (i = 0; i < 4; i++)
+		if ((tag[i] = fsa_read(fd, async[i], 256, 256 * i)) < 0)
+			panic("fsa_read: %e", tag[i]);
+	if ((stag = fsa_stat(fd, &st)) < 0)
+		panic("fsa_stat: %e", stag);
+
+	if ((r = fsa_wait(stag)) < 0)
+		panic("fsa_wait stat: %e", r);
+	if (strcmp(st.st_name, "lorem") != 0 || st.st_size < n)
+		panic("fsa_stat returned %s size %d", st.st_name, st.st_size);
+	for (i = 3; i >= 0; i--) {
+		if ((r = fsa_wait(tag[i])) != MIN(256, MAX(n - 256 * i, 0)))
+			panic("fsa_wait read %d: got %d", i, r);
+		if (memcmp(async[i], want + 256 * i, r) != 0)
+			panic("fsa_read %d returned wrong data", i);
+	}
+	if ((r = fsa_poll(tag[0])) != -E_INVAL)
+		panic("fsa_poll on retired tag: %e", r);
+	close(fd);
+	cprintf("fsring is good\n");
+}
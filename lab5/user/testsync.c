@@ -0,0 +1,58 @@
+// Test the futex-based mutex and semaphore across environments.
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NITER	200
+
+struct Shared {
+	struct Mutex mu;
+	struct Sem done;
+	int counter;
+};
+
+struct Shared *sh = (struct Shared *) (0x0ffff000 - PGSIZE);
+
+void
+umain(int argc, char **argv)
+{
+	int i, j, r, v;
+
+	if ((r = sys_page_alloc(0, sh, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	mutex_init(&sh->mu);
+	sem_init(&sh->done, 0);
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			for (j = 0; j < NITER; j++) {
+				mutex_lock(&sh->mu);
+				v = sh->counter;
+				// Give the others a chance to race us.
+				if (j % 8 == 0)
+					sys_yield();
+				sh->counter = v + 1;
+				mutex_unlock(&sh->mu);
+			}
+			sem_post(&sh->done);
+			exit();
+		}
+	}
+
+	for (i = 0; i < NCHILD; i++)
+		if ((r = sem_wait(&sh->done, 0)) < 0)
+			panic("sem_wait: %e", r);
+	if (sh->counter != NCHILD * NITER)
+		panic("counter is %d, expected %d", sh->counter, NCHILD * NITER);
+
+	// A futex wait on a changed value must not block, and a timed
+	// wait must time out.
+	if ((r = sys_futex_wait((uint32_t *) &sh->counter, 0, 0)) != -E_AGAIN)
+		panic("futex_wait on changed value: %e", r);
+	if ((r = sys_futex_wait((uint32_t *) &sh->counter, sh->counter, 2)) != -E_TIMEOUT)
+		panic("futex_wait with timeout: %e", r);
+
+	cprintf("sync ok\n");
+}
@@ -0,0 +1,107 @@
+// Test threads (sys_thread_create).  They share the address space, so
+// a page the main thread maps over another is what the others read
+// from the moment sys_page_map returns, even while they run on other
+// CPUs (see tlb_shootdown); and the address space outlives threads
+// that exit.  Run with CPUS=4 to give the shootdown some work.
+
+#include <inc/x86.h>
+#include <inc/lib.h>
+
+#define NTHREAD		3
+#define NROUND		200
+// Each thread's stack is the page below its exception stack, which is
+// the top page of its THREADSIZE bytes from THREADVA.
+#define THREADVA	0xE0000000
+#define THREADSIZE	(2 * PGSIZE)
+#define PAGEVA		0xD0000000
+
+volatile uint32_t *page = (uint32_t *) PAGEVA;
+volatile uint32_t cur;		// the round whose page is mapped
+volatile uint32_t stop;
+volatile uint32_t seen[NTHREAD];
+volatile uint32_t stale;	// reads of an older round's page
+
+void
+thread(int i)
+{
+	uint32_t r, v;
+
+	while (!stop) {
+		r = cur;
+		__asm __volatile("" : : : "memory");
+		v = *page;
+		if (v < r)
+			xadd(&stale, 1);
+		seen[i] = v;
+	}
+	sys_env_destroy(0);
+}
+
+// Map a fresh page holding r at PAGEVA, over the last one.
+void
+remap(uint32_t r)
+{
+	int e;
+
+	if ((e = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc: %e", e);
+	*(uint32_t *) UTEMP = r;
+	if ((e = sys_page_map(0, UTEMP, 0, (void *) PAGEVA, PTE_P|PTE_U)) < 0)
+		panic("sys_page_map: %e", e);
+	if ((e = sys_page_unmap(0, UTEMP)) < 0)
+		panic("sys_page_unmap: %e", e);
+	cur = r;
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t ids[NTHREAD];
+	uintptr_t top;
+	uint32_t *sp;
+	int i, r, n, tries;
+
+	remap(1);
+	for (i = 0; i < NTHREAD; i++) {
+		top = THREADVA + (i + 1) * THREADSIZE;
+		if ((r = sys_page_alloc(0, (void *) (top - 2 * PGSIZE),
+					PTE_P|PTE_U|PTE_W)) < 0
+		    || (r = sys_page_alloc(0, (void *) (top - PGSIZE),
+					   PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		sp = (uint32_t *) (top - PGSIZE);
+		*--sp = i;
+		*--sp = 0;		// thread never returns
+		if ((ids[i] = sys_thread_create((void *) thread, sp,
+						(void *) top)) < 0)
+			panic("sys_thread_create: %e", ids[i]);
+	}
+
+	for (r = 2; r <= NROUND; r++) {
+		remap(r);
+		// wait for every thread to read the new page
+		for (tries = 0; ; tries++) {
+			for (i = 0, n = 0; i < NTHREAD; i++)
+				if (seen[i] >= r)
+					n++;
+			if (n == NTHREAD)
+				break;
+			if (tries == 10000)
+				panic("round %d: %d of %d threads saw it",
+				      r, n, NTHREAD);
+			sys_yield();
+		}
+	}
+	if (stale)
+		panic("%d reads of a page already mapped over", stale);
+
+	stop = 1;
+	for (i = 0; i < NTHREAD; i++)
+		while (envs[ENVX(ids[i])].env_id == ids[i]
+		       && envs[ENVX(ids[i])].env_status != ENV_FREE)
+			sys_yield();
+	// our memory must have survived them
+	if (*page != NROUND)
+		panic("page holds %d after the threads exited", *page);
+	cprintf("thread ok\n");
+}